@@ -36,6 +36,36 @@ const char *op_to_string(enum opcode op)
     }
 }
 
+int op_num_args(enum opcode op)
+{
+    switch (op) {
+        case HALT: case RET: case NOOP:
+            return 0;
+        case PUSH: case POP: case JMP: case CALL: case OUT: case IN:
+            return 1;
+        case SET: case JT: case JF: case NOT: case RMEM: case WMEM:
+            return 2;
+        case EQ: case GT: case ADD: case MULT: case MOD: case AND: case OR:
+            return 3;
+        default:
+            fprintf(stderr, "INTERNAL ERROR in %s! Unrecognized opcode: %d\n",
+                __func__, op);
+            exit(1);
+    }
+}
+
+/* Whether the first argument of `op` names the register it writes to */
+bool op_has_dest_reg(enum opcode op)
+{
+    switch (op) {
+        case SET: case POP: case EQ: case GT: case ADD: case MULT: case MOD:
+        case AND: case OR: case NOT: case RMEM: case IN:
+            return true;
+        default:
+            return false;
+    }
+}
+
 bool is_valid_int(uint16_t n)
 {
     return n <= MAX_INT;
@@ -47,15 +77,13 @@ bool is_reg(uint16_t addr)
 }
 
 
-int readU16(uint16_t *ret)
+/* Reads the word at `*offset` and advances it */
+int readU16(const uint16_t *memory, uint16_t *offset, uint16_t *ret)
 {
-    extern uint16_t memory[];
-    extern uint16_t mem_offset;
-
-    if (mem_offset >= MAX_INT)
+    if (*offset >= MAX_INT)
         return -1;
 
-    *ret = le16toh(memory[mem_offset++]);
+    *ret = memory[(*offset)++];
     return 0;
 }
 
@@ -65,3 +93,47 @@ int addr_to_reg_num(uint16_t addr)
         return -1;
     return addr - MIN_REG;
 }
+
+/*
+ * Prints the error message for a run which ended with `status`. `value` is
+ * the offending word, or the op code for SYN_TRAP_ARGS.
+ */
+void print_trap(FILE *fp, enum syn_status status, uint16_t value)
+{
+    switch (status) {
+        case SYN_TRAP_OP:
+            fprintf(fp, "ERROR: Op code out of range! Valid codes are from "
+            "0 through %u. Offending op code: %u\n", NUM_OP_CODES - 1, value);
+            break;
+        case SYN_TRAP_ARGS:
+            fprintf(fp, "Not enough arguments to op '%s'!", op_to_string(value));
+            break;
+        case SYN_TRAP_INT:
+            fprintf(fp, "ERROR: Number is out of range: %u\n"
+                "Numbers are from 0 through %u\n", value, MAX_INT);
+            break;
+        case SYN_TRAP_REG:
+            fprintf(fp, "ERROR: Address expected to be a register, "
+                "but its value is out of range! The accused: 0x%02x\n", value);
+            break;
+        case SYN_TRAP_UNDERFLOW:
+            fprintf(fp, "ERROR: Stack underflow!\n");
+            break;
+        case SYN_TRAP_NOMEM:
+            fprintf(fp, "ERROR: Out of memory!\n");
+            break;
+        case SYN_TRAP_HOOK:
+            fprintf(fp, "ERROR: The hook for address %u disagrees with "
+                "the guest routine!\n", value);
+            break;
+        case SYN_TRAP_DIV:
+            fprintf(fp, "ERROR: Division by zero!\n");
+            break;
+        case SYN_TRAP_ADDR:
+            fprintf(fp, "ERROR: Address is out of range: %u\n"
+                "Addresses are from 0 through %u\n", value, MAX_INT);
+            break;
+        default:
+            break;
+    }
+}
@@ -3,10 +3,13 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include "synacor.h"
 
 #define MAX_INT 32767
 #define MIN_REG 32768
 #define MAX_REG 32775
+#define REG_NUM 8
 
 /* The integer values here are significant  */
 enum opcode {
@@ -36,10 +39,13 @@ enum opcode {
 };
 
 const char *op_to_string(enum opcode op);
+int op_num_args(enum opcode op);
+bool op_has_dest_reg(enum opcode op);
 int addr_to_reg_num(uint16_t addr);
 bool is_valid_int(uint16_t n);
 bool is_reg(uint16_t addr);
-int readU16(uint16_t *ret);
+int readU16(const uint16_t *memory, uint16_t *offset, uint16_t *ret);
+void print_trap(FILE *fp, enum syn_status status, uint16_t value);
 
 /*
 
@@ -0,0 +1,443 @@
+/*
+ * syn-asm: assembles Synacor assembly into an image for syn-run.
+ *
+ * A line holds an optional label, then an instruction or a directive, then
+ * an optional comment from ';' on:
+ *
+ *   loop:   add r0 r0 -1       ; operands may also be separated by commas
+ *           jt r0, loop
+ *
+ * Mnemonics are the names op_to_string() gives the op codes. An operand is a
+ * register (r0-r7), a number (decimal, 0x hex or 0 octal; negative numbers
+ * wrap modulo 32768), a character ('a', '\n') or a symbol, optionally with
+ * an offset (`table+2`). Symbols are labels or constants and may be used before
+ * they are defined. The directives are:
+ *
+ *   .word <value>, ...         words as they are, up to 65535
+ *   .string "<text>"           a word per character, without a terminator
+ *   .zero <count>              zero words
+ *   .org <addr>                continues at `addr`, padding with zeros
+ *   .equ <name> <value>        defines a constant
+ *
+ * The counts of .zero and .org must be known where they appear.
+ *
+ * Usage: syn-asm <source> [<image>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <endian.h>
+#include "arch.h"
+
+#define MAX_NAME 64
+
+struct symbol {
+    char name[MAX_NAME];
+    uint16_t value;
+    bool defined;
+};
+
+/* A word which takes the value of a symbol once it is known */
+struct fixup {
+    uint32_t addr;
+    size_t symbol;
+    int32_t offset;
+    bool raw;                   /* a .word, which may hold any 16-bit value */
+    int line;
+};
+
+static uint16_t memory[MAX_INT + 1];
+static uint32_t here, image_words;
+
+static struct symbol *symbols;
+static size_t num_symbols, max_symbols;
+
+static struct fixup *fixups;
+static size_t num_fixups, max_fixups;
+
+static const char *path;
+static int line_no;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <source> [<image>]\n", prog);
+    exit(1);
+}
+
+static void error(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "ERROR: %s:%d: ", path, line_no);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void *grow(void *array, size_t *max, size_t size)
+{
+    *max = *max ? 2 * *max : 64;
+    if (!(array = realloc(array, *max * size))) {
+        perror("syn-asm");
+        exit(1);
+    }
+    return array;
+}
+
+/* Returns the index of the symbol `name`, which is added if new */
+static size_t symbol(const char *name)
+{
+    for (size_t i = 0; i < num_symbols; i++)
+        if (!strcmp(symbols[i].name, name))
+            return i;
+
+    if (num_symbols == max_symbols)
+        symbols = grow(symbols, &max_symbols, sizeof *symbols);
+    memset(&symbols[num_symbols], 0, sizeof *symbols);
+    strcpy(symbols[num_symbols].name, name);
+    return num_symbols++;
+}
+
+static void define(const char *name, uint16_t value)
+{
+    size_t i = symbol(name);
+    struct symbol *sym = &symbols[i];
+
+    if (sym->defined)
+        error("'%s' is already defined", name);
+    sym->value = value;
+    sym->defined = true;
+}
+
+static void emit(uint16_t word)
+{
+    if (here > MAX_INT)
+        error("The program does not fit into memory");
+    memory[here++] = word;
+    if (here > image_words)
+        image_words = here;
+}
+
+static const char *skip_space(const char *p)
+{
+    while (isspace((unsigned char)*p))
+        p++;
+    return p;
+}
+
+/* Reads a name into `buf`. Returns the end of it, or NULL if there is none. */
+static const char *parse_name(const char *p, char buf[MAX_NAME])
+{
+    size_t len = 0;
+
+    if (!isalpha((unsigned char)*p) && *p != '_' && *p != '.')
+        return NULL;
+    while (isalnum((unsigned char)*p) || *p == '_' || *p == '.') {
+        if (len == MAX_NAME - 1)
+            error("Name too long");
+        buf[len++] = *p++;
+    }
+    buf[len] = '\0';
+    return p;
+}
+
+/* Reads a character of a literal, escapes included */
+static const char *parse_char(const char *p, uint16_t *c)
+{
+    if (!*p)
+        error("Unterminated literal");
+    if (*p != '\\') {
+        *c = (unsigned char)*p;
+        return p + 1;
+    }
+
+    switch (*++p) {
+        case 'n': *c = '\n'; break;
+        case 't': *c = '\t'; break;
+        case '0': *c = '\0'; break;
+        case '\\': case '\'': case '"': *c = *p; break;
+        default:
+            error("Unknown escape '\\%c'", *p);
+    }
+    return p + 1;
+}
+
+static bool is_reg_name(const char *name)
+{
+    return name[0] == 'r' && name[1] >= '0' && name[1] <= '7' && !name[2];
+}
+
+/*
+ * Reads an operand and emits it. Numbers must be valid operands unless
+ * `raw`, registers are only allowed if `reg` is, and required if `dest`.
+ */
+static const char *parse_operand(const char *p, bool raw, bool reg, bool dest)
+{
+    char name[MAX_NAME], *end;
+    long n = 0, offset;
+    size_t sym;
+    uint16_t c;
+
+    if ((end = (char *)parse_name(p, name))) {
+        if (is_reg_name(name)) {
+            if (!reg)
+                error("A register is not allowed here");
+            emit(MIN_REG + name[1] - '0');
+            return end;
+        }
+        if (dest)
+            error("Expected a register, not '%s'", name);
+
+        offset = 0;
+        p = end;
+        if (*p == '+' || *p == '-') {
+            offset = strtol(p + 1, &end, 0);
+            if (end == p + 1)
+                error("Expected a number after '%c'", *p);
+            if (*p == '-')
+                offset = -offset;
+            p = end;
+        }
+
+        if (num_fixups == max_fixups)
+            fixups = grow(fixups, &max_fixups, sizeof *fixups);
+        sym = symbol(name);
+        fixups[num_fixups++] = (struct fixup){ here, sym, offset, raw, line_no };
+        emit(0);
+        return p;
+    }
+
+    if (dest)
+        error("Expected a register");
+
+    if (*p == '\'') {
+        p = parse_char(p + 1, &c);
+        if (*p != '\'')
+            error("Unterminated character");
+        emit(c);
+        return p + 1;
+    }
+
+    n = strtol(p, &end, 0);
+    if (end == p)
+        error("Expected an operand");
+    if (raw ? n < -(MAX_INT + 1) || n > UINT16_MAX : n < -(MAX_INT + 1) || n > MAX_INT)
+        error("Number out of range: %ld", n);
+    emit(n < 0 ? n & MAX_INT : n);
+    return end;
+}
+
+/* Reads a value which must be known already, for .zero, .org and .equ */
+static long parse_known(const char **pp)
+{
+    char name[MAX_NAME], *end;
+    const char *p = *pp;
+    struct symbol *sym;
+    size_t i;
+    long n;
+
+    if ((end = (char *)parse_name(p, name))) {
+        i = symbol(name);
+        sym = &symbols[i];
+        if (!sym->defined)
+            error("'%s' must be defined before it is used here", name);
+        *pp = end;
+        return sym->value;
+    }
+
+    n = strtol(p, &end, 0);
+    if (end == p)
+        error("Expected a number");
+    *pp = end;
+    return n;
+}
+
+/* Moves on to the next operand. Returns NULL at the end of the line. */
+static const char *next_operand(const char *p)
+{
+    p = skip_space(p);
+    if (*p == ',')
+        p = skip_space(p + 1);
+    return *p ? p : NULL;
+}
+
+static void directive(const char *name, const char *p)
+{
+    char sym[MAX_NAME];
+    long n;
+    uint16_t c;
+
+    if (!strcmp(name, ".word")) {
+        if (!(p = next_operand(p)))
+            error("Expected a value");
+        do
+            p = parse_operand(p, true, true, false);
+        while ((p = next_operand(p)));
+        return;
+    } else if (!strcmp(name, ".string")) {
+        if (*p != '"')
+            error("Expected a string");
+        for (p++; *p != '"'; ) {
+            p = parse_char(p, &c);
+            emit(c);
+        }
+        p++;
+    } else if (!strcmp(name, ".zero")) {
+        if ((n = parse_known(&p)) < 0 || n > MAX_INT + 1 - here)
+            error("Count out of range: %ld", n);
+        while (n--)
+            emit(0);
+    } else if (!strcmp(name, ".org")) {
+        if ((n = parse_known(&p)) < here || n > MAX_INT)
+            error("Address out of range or behind: %ld", n);
+        while (here < n)
+            emit(0);
+    } else if (!strcmp(name, ".equ")) {
+        if (!(p = parse_name(p, sym)) || is_reg_name(sym))
+            error("Expected a name");
+        p = next_operand(p);
+        if (!p || (n = parse_known(&p)) < 0 || n > UINT16_MAX)
+            error("Expected a value up to 65535");
+        define(sym, n);
+    } else {
+        error("Unknown directive '%s'", name);
+    }
+
+    if (next_operand(p))
+        error("Unexpected '%s'", next_operand(p));
+}
+
+static void instruction(const char *name, const char *p)
+{
+    int op, args;
+
+    for (op = 0; op < NUM_OP_CODES; op++)
+        if (!strcmp(name, op_to_string(op)))
+            break;
+    if (op == NUM_OP_CODES)
+        error("Unknown instruction '%s'", name);
+
+    emit(op);
+    args = op_num_args(op);
+    for (int i = 0; i < args; i++) {
+        if (!(p = i ? next_operand(p) : *p ? p : NULL))
+            error("'%s' takes %d operand%s", name, args, args == 1 ? "" : "s");
+        p = parse_operand(p, false, true, i == 0 && op_has_dest_reg(op));
+    }
+
+    if (next_operand(p))
+        error("'%s' takes %d operand%s", name, args, args == 1 ? "" : "s");
+}
+
+/* Cuts a comment off the end of the line, leaving literals alone */
+static void strip_comment(char *line)
+{
+    char quote = 0;
+
+    for (char *p = line; *p; p++) {
+        if (quote) {
+            if (*p == '\\' && p[1])
+                p++;
+            else if (*p == quote)
+                quote = 0;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == ';') {
+            *p = '\0';
+            return;
+        }
+    }
+}
+
+static void assemble_line(char *line)
+{
+    char name[MAX_NAME];
+    const char *p, *end;
+
+    line[strcspn(line, "\n")] = '\0';
+    strip_comment(line);
+    p = skip_space(line);
+
+    if ((end = parse_name(p, name)) && *end == ':') {
+        if (is_reg_name(name))
+            error("'%s' is a register", name);
+        define(name, here);
+        p = skip_space(end + 1);
+    }
+    if (!*p)
+        return;
+
+    if (!(end = parse_name(p, name)))
+        error("Expected an instruction or a directive");
+    p = skip_space(end);
+    if (name[0] == '.')
+        directive(name, p);
+    else
+        instruction(name, p);
+}
+
+static void resolve(void)
+{
+    const struct fixup *f;
+    const struct symbol *sym;
+    int32_t value;
+
+    for (size_t i = 0; i < num_fixups; i++) {
+        f = &fixups[i];
+        sym = &symbols[f->symbol];
+        line_no = f->line;
+        if (!sym->defined)
+            error("'%s' is not defined", sym->name);
+
+        value = sym->value + f->offset;
+        if (value < 0 || value > (f->raw ? UINT16_MAX : MAX_INT))
+            error("'%s%+d' is out of range: %d", sym->name, f->offset, value);
+        memory[f->addr] = value;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char line[1024];
+    FILE *in, *out = stdout;
+
+    if (argc != 2 && argc != 3)
+        usage(argv[0]);
+
+    path = argv[1];
+    if (!(in = fopen(path, "r"))) {
+        perror(path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof line, in)) {
+        line_no++;
+        if (!strchr(line, '\n') && !feof(in))
+            error("Line too long");
+        assemble_line(line);
+    }
+    fclose(in);
+    resolve();
+
+    if (argc == 3 && !(out = fopen(argv[2], "wb"))) {
+        perror(argv[2]);
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < image_words; i++)
+        memory[i] = htole16(memory[i]);
+    if (fwrite(memory, sizeof *memory, image_words, out) != image_words || fclose(out)) {
+        perror("fwrite");
+        exit(1);
+    }
+
+    free(symbols);
+    free(fixups);
+    return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * Benchmarks the engines on a corpus of synthetic programs, each of which
+ * stresses one kind of work: arithmetic in a tight loop, recursive calls,
+ * streaming through memory with `rmem`/`wmem`, pushing and popping, and
+ * printing. The programs are assembled here, run to their `halt` on every
+ * engine, and reported in MIPS and ns per instruction (best of a number of
+ * runs). Every engine must leave the same registers, memory and output
+ * behind and count the same instructions, or the benchmark fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <unistd.h>
+#include "synacor.h"
+#include "arch.h"
+
+#define R(n) (MIN_REG + (n))
+#define MINUS_ONE 32767
+
+/* Where the programs keep their data, well past their code */
+#define DATA 0x4000
+#define DATA_LEN 0x2000
+
+static const char *engine_names[] = { "call", "switch", "threaded", "decoded", "jit" };
+#define NUM_ENGINES (sizeof engine_names / sizeof *engine_names)
+
+struct prog {
+    uint16_t words[MAX_INT + 1];
+    uint16_t len;
+};
+
+/* Appends an instruction, given as its op code and operands. Returns its address. */
+static uint16_t emit(struct prog *p, const uint16_t *words, size_t n)
+{
+    uint16_t at = p->len;
+
+    memcpy(&p->words[at], words, n * sizeof *words);
+    p->len += n;
+    return at;
+}
+
+#define I(p, ...) \
+    emit((p), (const uint16_t[]){ __VA_ARGS__ }, \
+        sizeof((const uint16_t[]){ __VA_ARGS__ }) / sizeof(uint16_t))
+
+/* Points the operand `arg` of the instruction at `at` to the next one emitted */
+static void patch(struct prog *p, uint16_t at, int arg)
+{
+    p->words[at + 1 + arg] = p->len;
+}
+
+/* Counts `reg` down and jumps back to `top` until it reaches 0 */
+static void count_down(struct prog *p, int reg, uint16_t top)
+{
+    I(p, ADD, R(reg), R(reg), MINUS_ONE);
+    I(p, JT, R(reg), top);
+}
+
+/* Arithmetic on registers: add, mult, and, or, and the loop's eq/jf */
+static void arith(struct prog *p)
+{
+    uint16_t outer, inner;
+
+    I(p, SET, R(7), 1250);
+    outer = I(p, SET, R(0), 1000);
+    inner = I(p, ADD, R(1), R(1), R(0));
+    I(p, MULT, R(2), R(1), 31);
+    I(p, AND, R(3), R(2), R(1));
+    I(p, OR, R(4), R(3), R(0));
+    I(p, NOT, R(6), R(4));
+    I(p, ADD, R(0), R(0), MINUS_ONE);
+    I(p, EQ, R(3), R(0), 0);
+    I(p, JF, R(3), inner);
+    count_down(p, 7, outer);
+    I(p, RET);
+}
+
+/* Recursive calls: fib(n) the naive way, with push/pop around each call */
+static void calls(struct prog *p)
+{
+    uint16_t top, call, fib, rec;
+
+    I(p, SET, R(7), 160);
+    top = I(p, SET, R(0), 18);
+    call = I(p, CALL, 0);
+    count_down(p, 7, top);
+    I(p, RET);
+
+    patch(p, call, 0);
+    fib = I(p, GT, R(1), R(0), 1);
+    rec = I(p, JT, R(1), 0);
+    I(p, RET);
+    patch(p, rec, 1);
+    I(p, PUSH, R(0));
+    I(p, ADD, R(0), R(0), MINUS_ONE);
+    I(p, CALL, fib);
+    I(p, POP, R(1));
+    I(p, PUSH, R(0));
+    I(p, ADD, R(0), R(1), MINUS_ONE - 1);
+    I(p, CALL, fib);
+    I(p, POP, R(1));
+    I(p, ADD, R(0), R(0), R(1));
+    I(p, RET);
+}
+
+/* Streams through the data: every word read, added to and written back */
+static void memory(struct prog *p)
+{
+    uint16_t outer, inner;
+
+    I(p, SET, R(7), 180);
+    outer = I(p, SET, R(0), 0);
+    inner = I(p, ADD, R(2), R(0), DATA);
+    I(p, RMEM, R(1), R(2));
+    I(p, ADD, R(1), R(1), R(0));
+    I(p, WMEM, R(2), R(1));
+    I(p, ADD, R(0), R(0), 1);
+    I(p, EQ, R(3), R(0), DATA_LEN);
+    I(p, JF, R(3), inner);
+    count_down(p, 7, outer);
+    I(p, RET);
+}
+
+/* Churns the stack, a few words deep and then a few hundred */
+static void stack(struct prog *p)
+{
+    uint16_t outer, inner, deep, back;
+
+    I(p, SET, R(7), 1000);
+    outer = I(p, SET, R(0), 1000);
+    inner = I(p, PUSH, R(0));
+    I(p, PUSH, R(1));
+    I(p, PUSH, R(2));
+    I(p, POP, R(1));
+    I(p, POP, R(2));
+    I(p, POP, R(3));
+    count_down(p, 0, inner);
+
+    I(p, SET, R(0), 256);
+    deep = I(p, PUSH, R(0));
+    count_down(p, 0, deep);
+    I(p, SET, R(0), 256);
+    back = I(p, POP, R(1));
+    count_down(p, 0, back);
+    count_down(p, 7, outer);
+    I(p, RET);
+}
+
+/* Prints a string from memory a character at a time, and a few immediates */
+static void output(struct prog *p)
+{
+    static const char line[] =
+        "The quick brown fox jumps over the lazy dog, packs my box with five dozen jugs";
+    uint16_t outer, loop, done;
+
+    for (size_t i = 0; i < sizeof line; i++)
+        p->words[DATA + i] = (unsigned char)line[i];
+
+    I(p, SET, R(7), 25000);
+    outer = I(p, SET, R(0), DATA);
+    loop = I(p, RMEM, R(1), R(0));
+    done = I(p, JF, R(1), 0);
+    I(p, OUT, R(1));
+    I(p, ADD, R(0), R(0), 1);
+    I(p, JMP, loop);
+    patch(p, done, 1);
+    I(p, OUT, '!');
+    I(p, OUT, '\n');
+    count_down(p, 7, outer);
+    I(p, RET);
+}
+
+static const struct {
+    const char *name;
+    void (*body)(struct prog *p);
+} programs[] = {
+    { "arith", arith },
+    { "calls", calls },
+    { "memory", memory },
+    { "stack", stack },
+    { "output", output },
+};
+#define NUM_PROGRAMS (sizeof programs / sizeof *programs)
+
+/*
+ * Assembles a program which calls the body `scale` times and halts, and
+ * returns its image
+ */
+static size_t assemble(int prog, int scale, uint16_t *image)
+{
+    static struct prog p;
+    uint16_t top, call;
+
+    memset(&p, 0, sizeof p);
+    I(&p, SET, R(5), scale);
+    top = call = I(&p, CALL, 0);
+    count_down(&p, 5, top);
+    I(&p, HALT);
+    patch(&p, call, 0);
+    programs[prog].body(&p);
+
+    for (int i = 0; i <= MAX_INT; i++)
+        image[i] = htole16(p.words[i]);
+    return (DATA + DATA_LEN) * sizeof *image;
+}
+
+/* FNV-1a, of the output and of the machine once it has halted */
+static void hash(uint64_t *h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    for (size_t i = 0; i < len; i++)
+        *h = (*h ^ p[i]) * 0x100000001b3u;
+}
+
+static void hash_output(void *ctx, const char *data, size_t len)
+{
+    hash(ctx, data, len);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct result {
+    uint64_t ns;            /* of the fastest run */
+    uint64_t insns;
+    uint64_t digest;
+};
+
+/* Runs an image to its halt on a new VM. Returns 0, or -1 if it did not halt. */
+static int run_once(const uint16_t *image, size_t size, enum syn_engine engine,
+        struct result *res)
+{
+    struct syn_stats stats;
+    uint64_t digest = 0xcbf29ce484222325u, start, ns;
+    enum syn_status status;
+    uint16_t word;
+    syn_vm *vm;
+
+    if (!(vm = syn_create()) || syn_load_image(vm, image, size) ||
+            syn_set_engine(vm, engine)) {
+        perror("bench");
+        exit(1);
+    }
+    syn_output_callback(vm, hash_output, &digest);
+
+    start = now_ns();
+    status = syn_run(vm, SYN_RUN_FOREVER);
+    ns = now_ns() - start;
+
+    if (status != SYN_HALT) {
+        fprintf(stderr, "ERROR: %s stopped with '%s'\n", engine_names[engine],
+            syn_status_string(status));
+        syn_print_trap(vm, stderr);
+        syn_destroy(vm);
+        return -1;
+    }
+
+    for (int r = 0; r < REG_NUM; r++) {
+        word = syn_reg(vm, r);
+        hash(&digest, &word, sizeof word);
+    }
+    for (int addr = 0; addr <= MAX_INT; addr++) {
+        word = syn_peek(vm, addr);
+        hash(&digest, &word, sizeof word);
+    }
+    syn_stats(vm, &stats);
+    syn_destroy(vm);
+
+    if (!res->ns || ns < res->ns)
+        res->ns = ns;
+    res->insns = stats.instructions;
+    res->digest = digest;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-e <engine>]... [-p <program>]... [-r <runs>] [-s <scale>]\n"
+        "Programs:", prog);
+    for (size_t i = 0; i < NUM_PROGRAMS; i++)
+        printf(" %s", programs[i].name);
+    printf("\n");
+    exit(1);
+}
+
+/* Returns the index of `name` in `names`, or exits */
+static int lookup(const char *name, const char *const *names, size_t n,
+        const char *what, const char *prog)
+{
+    for (size_t i = 0; i < n; i++)
+        if (!strcmp(name, names[i]))
+            return i;
+
+    fprintf(stderr, "ERROR: Unknown %s '%s'\n", what, name);
+    usage(prog);
+    return 0;
+}
+
+static long number(const char *arg, long max, const char *prog)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 0);
+    if (errno || end == arg || *end || n < 1 || n > max) {
+        fprintf(stderr, "ERROR: Bad number '%s'\n", arg);
+        usage(prog);
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char *prog_names[NUM_PROGRAMS];
+    bool engines[NUM_ENGINES] = { false }, progs[NUM_PROGRAMS] = { false };
+    bool any_engine = false, any_prog = false;
+    struct result res = { 0 }, first = { 0 };
+    uint16_t *image;
+    size_t size;
+    int runs = 5, scale = 1, failed = 0;
+    int opt, i;
+
+    for (i = 0; i < (int)NUM_PROGRAMS; i++)
+        prog_names[i] = programs[i].name;
+
+    while ((opt = getopt(argc, argv, "e:p:r:s:")) != -1) {
+        switch (opt) {
+            case 'e':
+                i = lookup(optarg, engine_names, NUM_ENGINES, "engine", argv[0]);
+                if (!syn_engine_available(i)) {
+                    fprintf(stderr, "ERROR: The %s engine is not available here!\n", optarg);
+                    exit(1);
+                }
+                engines[i] = any_engine = true;
+                break;
+            case 'p':
+                progs[lookup(optarg, prog_names, NUM_PROGRAMS, "program", argv[0])] =
+                    any_prog = true;
+                break;
+            case 'r':
+                runs = number(optarg, 1000, argv[0]);
+                break;
+            case 's':
+                scale = number(optarg, MAX_INT, argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind != argc)
+        usage(argv[0]);
+
+    if (!(image = malloc((MAX_INT + 1) * sizeof *image))) {
+        perror("bench");
+        exit(1);
+    }
+
+    printf("%-8s %-9s %12s %10s %9s %8s\n",
+        "program", "engine", "insns", "best (s)", "MIPS", "ns/insn");
+
+    for (int p = 0; p < (int)NUM_PROGRAMS; p++) {
+        if (any_prog && !progs[p])
+            continue;
+        size = assemble(p, scale, image);
+        first.insns = 0;
+
+        for (int e = 0; e < (int)NUM_ENGINES; e++) {
+            if (any_engine ? !engines[e] : !syn_engine_available(e))
+                continue;
+
+            res.ns = 0;
+            for (i = 0; i < runs; i++)
+                if (run_once(image, size, e, &res))
+                    break;
+            if (i < runs) {
+                failed = 1;
+                continue;
+            }
+
+            printf("%-8s %-9s %12llu %10.3f %9.1f %8.2f\n",
+                programs[p].name, engine_names[e], (unsigned long long)res.insns,
+                res.ns / 1e9, res.insns * 1e3 / res.ns, (double)res.ns / res.insns);
+            fflush(stdout);
+
+            if (!first.insns) {
+                first = res;
+            } else if (res.insns != first.insns || res.digest != first.digest) {
+                fprintf(stderr, "ERROR: %s ends differently on %s\n",
+                    programs[p].name, engine_names[e]);
+                failed = 1;
+            }
+        }
+    }
+
+    free(image);
+    return failed;
+}
@@ -0,0 +1,246 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "arch.h"
+#include "decode.h"
+
+#define FUSED_PATTERNS
+#include "fused.h"
+
+/* The most words an instruction takes, and an entry covers */
+#define MAX_INSN_LEN 4
+#define MAX_SPAN (MAX_INSN_LEN * FUSED_MAX_INSNS)
+
+/* The sources of a variant as bits of `kinds`, from the first source on */
+#define KINDS_R  1
+#define KINDS_I  0
+#define KINDS_RR 3
+#define KINDS_RI 1
+#define KINDS_IR 2
+#define KINDS_II 0
+
+/* The variant of each op code per kinds of its sources, 0 if there is none */
+#define VARIANT(op, kinds) [op][KINDS_##kinds] = OP_##op##_##kinds,
+static const uint8_t variants[NUM_OP_CODES][4] = { SPECIALIZED_OPS(VARIANT) };
+#undef VARIANT
+
+/* And the op code each variant is one of */
+#define BASE(op, kinds) [OP_##op##_##kinds - OP_SPECIALIZED] = op,
+static const uint8_t base_ops[NUM_SPECIALIZED] = { SPECIALIZED_OPS(BASE) };
+#undef BASE
+
+static void set_op(struct icache *ic, struct insn *in, uint8_t op)
+{
+    in->op = op;
+    in->handler = ic->handlers ? ic->handlers[op] : NULL;
+}
+
+/*
+ * Returns an empty cache for `memory`, or NULL if out of memory. `handlers`
+ * maps op codes (including the pseudo ones and the superinstructions) to the
+ * engine's handler addresses and may be NULL for engines which dispatch on
+ * `op` instead.
+ */
+struct icache *icache_new(const uint16_t *memory, const void *const *handlers)
+{
+    struct icache *ic;
+
+    if (!(ic = malloc(sizeof *ic)))
+        return NULL;
+
+    ic->memory = memory;
+    ic->handlers = handlers;
+    for (uint32_t addr = 0; addr < ICACHE_SIZE; addr++)
+        set_op(ic, &ic->insn[addr], addr < MAX_INT ? OP_UNDECODED : OP_END);
+
+    return ic;
+}
+
+void icache_free(struct icache *ic)
+{
+    free(ic);
+}
+
+/*
+ * Decodes the instruction at `addr` into `in` (all fields but `handler`).
+ * Returns false if executing the instruction would fault; the caller is
+ * expected to run it through the checked path instead so that the usual
+ * error is reported.
+ */
+bool decode_insn(const uint16_t *memory, uint16_t addr, struct insn *in)
+{
+    uint16_t op, word;
+    int nargs;
+
+    if (addr >= MAX_INT)
+        return false;
+
+    op = memory[addr];
+    if (op >= NUM_OP_CODES)
+        return false;
+
+    nargs = op_num_args(op);
+    if (addr + nargs >= MAX_INT)
+        return false;
+
+    in->kinds = 0;
+    for (int i = 0; i < nargs; i++) {
+        word = memory[addr + 1 + i];
+
+        if (is_reg(word)) {
+            in->kinds |= 1 << i;
+#ifdef FOLDED_REGS
+            in->arg[i] = word;
+#else
+            in->arg[i] = addr_to_reg_num(word);
+#endif
+        } else if (i == 0 && op_has_dest_reg(op)) {
+            return false;
+        } else if (!is_valid_int(word)) {
+            return false;
+        } else {
+            in->arg[i] = word;
+        }
+    }
+
+    in->len = 1 + nargs;
+    in->op = op;
+    return true;
+}
+
+/* The variant of a decoded instruction for the kinds of its sources, if any */
+static uint8_t specialize(const struct insn *in)
+{
+    int kinds = in->kinds >> (op_has_dest_reg(in->op) ? 1 : 0);
+
+    return variants[in->op][kinds & 3] ? variants[in->op][kinds & 3] : in->op;
+}
+
+/* Decodes the instruction at `addr` into its cache entry as it is */
+static bool fill_one(struct icache *ic, uint16_t addr)
+{
+    struct insn *in = &ic->insn[addr];
+
+    if (!decode_insn(ic->memory, addr, in)) {
+        set_op(ic, in, OP_UNDECODED);
+        return false;
+    }
+
+    in->span = in->len;
+    set_op(ic, in, specialize(in));
+    return true;
+}
+
+/* The op code of the instruction an entry starts with */
+static uint8_t first_op(const struct insn *in)
+{
+    if (in->op >= OP_FUSED)
+        return fused_ops[in->op - OP_FUSED][0];
+    if (in->op >= OP_SPECIALIZED)
+        return base_ops[in->op - OP_SPECIALIZED];
+    return in->op;
+}
+
+/*
+ * Makes the entry at `addr` the first superinstruction (fused.h) which the
+ * instructions from there match, decoding the others as it goes. Their
+ * entries stay as they are, for the superinstruction's handler to run them
+ * from and for jumps into the sequence.
+ */
+static void fuse(struct icache *ic, uint16_t addr)
+{
+    struct insn *in = &ic->insn[addr];
+    const uint8_t *ops;
+    uint32_t pc;
+    int n;
+
+    for (int f = 0; f < NUM_FUSED; f++) {
+        ops = fused_ops[f];
+        if (ops[0] != first_op(in))
+            continue;
+
+        pc = addr;
+        for (n = 1; n < FUSED_MAX_INSNS && ops[n] != NUM_OP_CODES; n++) {
+            pc += ic->insn[pc].len;
+            if (ic->insn[pc].op == OP_UNDECODED && !fill_one(ic, pc))
+                break;
+            if (first_op(&ic->insn[pc]) != ops[n])
+                break;
+        }
+
+        if (n == FUSED_MAX_INSNS || ops[n] == NUM_OP_CODES) {
+            in->span = pc + ic->insn[pc].len - addr;
+            set_op(ic, in, OP_FUSED + f);
+            return;
+        }
+    }
+}
+
+/*
+ * Decodes the instruction at `addr` into its cache entry, see decode_insn(),
+ * and fuses it with the ones after it if it can
+ */
+bool icache_fill(struct icache *ic, uint16_t addr)
+{
+    if (!fill_one(ic, addr))
+        return false;
+
+    fuse(ic, addr);
+    return true;
+}
+
+/*
+ * Drops every decoded instruction which covers `addr`, superinstructions
+ * included. An entry covers at most MAX_SPAN words, so only the entries
+ * starting from addr - MAX_SPAN + 1 through addr can be affected.
+ */
+void icache_invalidate(struct icache *ic, uint16_t addr)
+{
+    int first = addr >= MAX_SPAN - 1 ? addr - (MAX_SPAN - 1) : 0;
+    int last = addr < MAX_INT ? addr : MAX_INT - 1;
+
+    for (int start = first; start <= last; start++) {
+        struct insn *in = &ic->insn[start];
+
+        if (in->op != OP_UNDECODED && start + in->span > addr)
+            set_op(ic, in, OP_UNDECODED);
+    }
+}
+
+static void verify(struct verified *v, const uint16_t *memory, uint16_t addr)
+{
+    struct insn in;
+
+    if (decode_insn(memory, addr, &in))
+        v->bits[addr / 64] |= 1ull << (addr % 64);
+    else
+        v->bits[addr / 64] &= ~(1ull << (addr % 64));
+}
+
+/* Verifies all of `memory`. Returns NULL if out of memory. */
+struct verified *verified_new(const uint16_t *memory)
+{
+    struct verified *v;
+
+    if (!(v = calloc(1, sizeof *v)))
+        return NULL;
+
+    for (uint16_t addr = 0; addr < MAX_INT; addr++)
+        verify(v, memory, addr);
+    return v;
+}
+
+void verified_free(struct verified *v)
+{
+    free(v);
+}
+
+/* Verifies the instructions which `addr` may be part of again, after a write to it */
+void verified_update(struct verified *v, const uint16_t *memory, uint16_t addr)
+{
+    int first = addr >= MAX_INSN_LEN - 1 ? addr - (MAX_INSN_LEN - 1) : 0;
+
+    for (int start = first; start <= addr && start < MAX_INT; start++)
+        verify(v, memory, start);
+}
@@ -0,0 +1,91 @@
+#ifndef SYNACOR_DECODE_H__
+#define SYNACOR_DECODE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "arch.h"
+
+/*
+ * The instructions the decoder specializes by the kinds of their sources,
+ * a register (R) or an immediate (I) each, in order: OP_ADD_RI adds an
+ * immediate to a register. Their handlers fetch every operand the one way
+ * it comes, without checking.
+ */
+#define SPECIALIZED_1(X, op) X(op, R) X(op, I)
+#define SPECIALIZED_2(X, op) X(op, RR) X(op, RI) X(op, IR) X(op, II)
+#define SPECIALIZED_OPS(X) \
+    SPECIALIZED_1(X, SET) SPECIALIZED_1(X, PUSH) SPECIALIZED_2(X, EQ) \
+    SPECIALIZED_2(X, GT) SPECIALIZED_2(X, JT) SPECIALIZED_2(X, JF) \
+    SPECIALIZED_2(X, ADD) SPECIALIZED_2(X, MULT) SPECIALIZED_2(X, MOD) \
+    SPECIALIZED_2(X, AND) SPECIALIZED_2(X, OR) SPECIALIZED_1(X, NOT) \
+    SPECIALIZED_1(X, RMEM)
+
+/* Pseudo op codes which only ever appear in the instruction cache */
+#define SPECIALIZED_ENUM(op, kinds) OP_##op##_##kinds,
+enum {
+    OP_UNDECODED = NUM_OP_CODES,        /* not decoded yet, or invalidated */
+    OP_END,                             /* the fetch ran off the end of memory */
+    SPECIALIZED_OPS(SPECIALIZED_ENUM)   /* from OP_SPECIALIZED on */
+    OP_FUSED                            /* the first superinstruction, see fused.h */
+};
+#undef SPECIALIZED_ENUM
+
+#define OP_SPECIALIZED (OP_END + 1)
+#define NUM_SPECIALIZED (OP_FUSED - OP_SPECIALIZED)
+
+#define ICACHE_SIZE (UINT16_MAX + 1)
+
+/*
+ * A decoded instruction. Bit n of `kinds` is set when arg[n] names a register,
+ * in which case arg[n] holds the register number (0-7); otherwise it holds
+ * the immediate value. With FOLDED_REGS, arg[n] is always the operand's slot
+ * in the operand file, i.e. the raw operand word.
+ *
+ * In the instruction cache, the first instruction of a sequence which the
+ * decoder fuses into a superinstruction gets its op code, and `span` covers
+ * the words of the whole sequence; the others keep their own entries.
+ */
+struct insn {
+    const void *handler;
+    uint16_t arg[3];
+    uint8_t op;
+    uint8_t len;
+    uint8_t kinds;
+    uint8_t span;               /* in the instruction cache only */
+};
+
+/* The decoded instructions of one VM's memory */
+struct icache {
+    const uint16_t *memory;
+    const void *const *handlers;
+    /* Indexed by program counter. Entries past MAX_INT - 1 are always OP_END. */
+    struct insn insn[ICACHE_SIZE];
+};
+
+bool decode_insn(const uint16_t *memory, uint16_t addr, struct insn *in);
+
+struct icache *icache_new(const uint16_t *memory,
+    const void *const *handlers);
+void icache_free(struct icache *ic);
+bool icache_fill(struct icache *ic, uint16_t addr);
+void icache_invalidate(struct icache *ic, uint16_t addr);
+
+/*
+ * The addresses of one VM's memory whose instructions decode, i.e. which
+ * can execute without an operand or op code fault, one bit each. The
+ * switch and threaded engines run those without checks.
+ */
+struct verified {
+    uint64_t bits[ICACHE_SIZE / 64];
+};
+
+struct verified *verified_new(const uint16_t *memory);
+void verified_free(struct verified *v);
+void verified_update(struct verified *v, const uint16_t *memory, uint16_t addr);
+
+static inline bool verified_at(const struct verified *v, uint16_t addr)
+{
+    return v->bits[addr / 64] >> (addr % 64) & 1;
+}
+
+#endif /* SYNACOR_DECODE_H__ */
@@ -0,0 +1,1157 @@
+/*
+ * The execution engines. Each of them runs the VM until vm_stop() ends the
+ * run, which happens for every fault in the guest as well; nothing in here
+ * ever exits the process.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "cmc/stack.h"
+#include "arch.h"
+#include "decode.h"
+#include "fused.h"
+#include "prog_stack.h"
+#include "vm.h"
+#include "jit.h"
+#include "profile.h"
+
+#ifdef DEBUG
+    #define dprintf(f, ...) printf("*** DEBUG (%s): " f, __func__, ## __VA_ARGS__)
+    #define dpf() dprintf("\n")
+#else
+    #define dprintf(f, ...)
+    #define dpf()
+#endif
+
+#define READ_WORD(var) readU16(vm->memory, &vm->mem_offset, &(var))
+
+#define READ1(op, var) \
+    uint16_t var; \
+    if (READ_WORD(var) == -1) \
+        vm_stop(vm, SYN_TRAP_ARGS, op);
+
+#define READ2(op, var1, var2) \
+    uint16_t var1, var2; \
+    if (READ_WORD(var1) == -1 || READ_WORD(var2) == -1) \
+        vm_stop(vm, SYN_TRAP_ARGS, op);
+
+#define READ3(op, var1, var2, var3) \
+    uint16_t var1, var2, var3; \
+    if (READ_WORD(var1) == -1 || READ_WORD(var2) == -1 || READ_WORD(var3) == -1 ) \
+        vm_stop(vm, SYN_TRAP_ARGS, op);
+
+/* Generated here so that the engines can inline the stack operations */
+STACK_GENERATE_SOURCE(s, stack, /* func modifier */, uint16_t)
+
+static void halt(struct vm *vm);
+static void set(struct vm *vm);
+static void push(struct vm *vm);
+static void pop(struct vm *vm);
+static void eq(struct vm *vm);
+static void gt(struct vm *vm);
+static void jmp(struct vm *vm);
+static void jt(struct vm *vm);
+static void jf(struct vm *vm);
+static void add(struct vm *vm);
+static void mult(struct vm *vm);
+static void mod(struct vm *vm);
+static void and(struct vm *vm);
+static void or(struct vm *vm);
+static void not(struct vm *vm);
+static void rmem(struct vm *vm);
+static void wmem(struct vm *vm);
+static void call(struct vm *vm);
+static void ret(struct vm *vm);
+static void out(struct vm *vm);
+static void in(struct vm *vm);
+static void noop(struct vm *vm);
+
+static void (*op_functions[NUM_OP_CODES])(struct vm *vm) = {
+    halt,
+    set,
+    push,
+    pop,
+    eq,
+    gt,
+    jmp,
+    jt,
+    jf,
+    add,
+    mult,
+    mod,
+    and,
+    or,
+    not,
+    rmem,
+    wmem,
+    call,
+    ret,
+    out,
+    in,
+    noop
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define HAVE_COMPUTED_GOTO 1
+#endif
+
+bool engine_available(enum syn_engine engine)
+{
+    switch (engine) {
+        case SYN_ENGINE_CALL:
+        case SYN_ENGINE_SWITCH:
+        case SYN_ENGINE_DECODED:
+            return true;
+        case SYN_ENGINE_THREADED:
+#ifdef HAVE_COMPUTED_GOTO
+            return true;
+#else
+            return false;
+#endif
+        case SYN_ENGINE_JIT:
+            return jit_available();
+    }
+    return false;
+}
+
+/* Helper functions */
+
+static uint16_t get_reg_val(struct vm *vm, uint16_t reg)
+{
+    if (!is_reg(reg)) {
+        fprintf(stderr, "INTERNAL ERROR: Attempting to read a register which doesn't exist!\n");
+        exit(1);
+    }
+    return vm->regs[addr_to_reg_num(reg)];
+}
+
+void verify_int_or_die(struct vm *vm, uint16_t i)
+{
+    if (i > MAX_INT)
+        vm_stop(vm, SYN_TRAP_INT, i);
+}
+
+void verify_reg_or_die(struct vm *vm, uint16_t addr)
+{
+    if (!is_reg(addr))
+        vm_stop(vm, SYN_TRAP_REG, addr);
+}
+
+static void verify_addr_or_die(struct vm *vm, uint16_t addr)
+{
+    if (addr > MAX_INT)
+        vm_stop(vm, SYN_TRAP_ADDR, addr);
+}
+
+static void verify_reg_or_int_and_get_val_or_die(struct vm *vm, uint16_t *i)
+{
+#ifdef FOLDED_REGS
+    if (*i > MAX_REG)
+        verify_int_or_die(vm, *i);
+    *i = vm->operand_file[*i];
+    return;
+#endif
+    if (is_reg(*i))
+        *i = get_reg_val(vm, *i);
+    else
+        verify_int_or_die(vm, *i);
+}
+
+void execute_file(struct vm *vm)
+{
+    uint64_t budget = vm->budget;
+    uint16_t op;
+
+    VM_PUBLISH(vm, vm->mem_offset);
+    for (;;) {
+        VM_TICK(vm, budget, vm->mem_offset);
+        VM_SYNC(vm, budget);    /* the handlers may stop anywhere */
+        if (READ_WORD(op) == -1)
+            vm_stop(vm, SYN_END, 0);
+        if (op >= NUM_OP_CODES)
+            vm_stop(vm, SYN_TRAP_OP, op);
+        op_functions[op](vm);
+        budget = vm->budget;    /* and memoized calls take from it */
+    }
+}
+
+/* Common exit path of the inlined engines once the fetch runs off the end */
+static _Noreturn void end_of_memory(struct vm *vm, uint16_t pc, uint64_t budget)
+{
+    vm->mem_offset = pc;
+    VM_SYNC(vm, budget);
+    vm_stop(vm, SYN_END, 0);
+}
+
+static void bad_op_code(struct vm *vm, uint16_t pc, uint16_t op, uint64_t budget)
+{
+    vm->mem_offset = pc;
+    VM_SYNC(vm, budget);
+    vm_stop(vm, SYN_TRAP_OP, op);
+}
+
+/*
+ * Stops at a `mod` by 0, an address past memory or a push the stack has no
+ * room for, `pc` being the next instruction
+ */
+static _Noreturn void bad_operand(struct vm *vm, uint16_t pc, enum syn_status status,
+        uint16_t value, uint64_t budget)
+{
+    vm->mem_offset = pc;
+    VM_SYNC(vm, budget);
+    vm_stop(vm, status, value);
+}
+
+/* The verified instructions of `vm`, which are verified on first use */
+static const struct verified *verified(struct vm *vm)
+{
+    if (!vm->verified && !(vm->verified = verified_new(vm->memory)))
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+    return vm->verified;
+}
+
+/* Cases of the switch engine's handlers without checks */
+#define UNCHECKED_CASE (UINT16_MAX + 1)
+
+/*
+ * Same semantics as execute_file(), but with every handler inlined into one
+ * function so that an instruction costs a jump instead of a call. Verified
+ * instructions go to a second set of handlers without checks.
+ */
+void execute_file_switch(struct vm *vm)
+{
+    const struct verified *v = verified(vm);
+    uint64_t budget = vm->budget;
+    uint16_t pc = vm->mem_offset;
+    uint16_t op, a, b, c;
+    uint32_t key;
+
+    VM_PUBLISH(vm, pc);
+    for (;;) {
+        VM_TICK(vm, budget, pc);
+        if (verified_at(v, pc)) {
+            op = vm->memory[pc++];
+            key = UNCHECKED_CASE + op;
+        } else {
+            if (pc >= MAX_INT)
+                end_of_memory(vm, pc, budget);
+            key = op = vm->memory[pc++];
+        }
+
+#define DISPATCH() continue
+
+        switch (key) {
+#define TARGET(op) case op:
+#include "exec_loop.h"
+#undef TARGET
+
+#define TARGET(op) case UNCHECKED_CASE + op:
+#define UNCHECKED
+#include "exec_loop.h"
+#undef UNCHECKED
+#undef TARGET
+
+            default:
+                bad_op_code(vm, pc, op, budget);
+        }
+
+#undef DISPATCH
+    }
+}
+
+#ifdef HAVE_COMPUTED_GOTO
+/*
+ * Threaded variant of execute_file_switch(): every handler ends in its own
+ * indirect jump, which gives the branch predictor one history per op code.
+ */
+void execute_file_threaded(struct vm *vm)
+{
+    static void *labels[NUM_OP_CODES] = {
+        [HALT] = &&label_HALT,
+        [SET] = &&label_SET,
+        [PUSH] = &&label_PUSH,
+        [POP] = &&label_POP,
+        [EQ] = &&label_EQ,
+        [GT] = &&label_GT,
+        [JMP] = &&label_JMP,
+        [JT] = &&label_JT,
+        [JF] = &&label_JF,
+        [ADD] = &&label_ADD,
+        [MULT] = &&label_MULT,
+        [MOD] = &&label_MOD,
+        [AND] = &&label_AND,
+        [OR] = &&label_OR,
+        [NOT] = &&label_NOT,
+        [RMEM] = &&label_RMEM,
+        [WMEM] = &&label_WMEM,
+        [CALL] = &&label_CALL,
+        [RET] = &&label_RET,
+        [OUT] = &&label_OUT,
+        [IN] = &&label_IN,
+        [NOOP] = &&label_NOOP
+    };
+    static void *unchecked[NUM_OP_CODES] = {
+        [HALT] = &&unchecked_HALT,
+        [SET] = &&unchecked_SET,
+        [PUSH] = &&unchecked_PUSH,
+        [POP] = &&unchecked_POP,
+        [EQ] = &&unchecked_EQ,
+        [GT] = &&unchecked_GT,
+        [JMP] = &&unchecked_JMP,
+        [JT] = &&unchecked_JT,
+        [JF] = &&unchecked_JF,
+        [ADD] = &&unchecked_ADD,
+        [MULT] = &&unchecked_MULT,
+        [MOD] = &&unchecked_MOD,
+        [AND] = &&unchecked_AND,
+        [OR] = &&unchecked_OR,
+        [NOT] = &&unchecked_NOT,
+        [RMEM] = &&unchecked_RMEM,
+        [WMEM] = &&unchecked_WMEM,
+        [CALL] = &&unchecked_CALL,
+        [RET] = &&unchecked_RET,
+        [OUT] = &&unchecked_OUT,
+        [IN] = &&unchecked_IN,
+        [NOOP] = &&unchecked_NOOP
+    };
+
+    const struct verified *v = verified(vm);
+    uint64_t budget = vm->budget;
+    uint16_t pc = vm->mem_offset;
+    uint16_t op, a, b, c;
+
+#define DISPATCH() \
+    do { \
+        VM_TICK(vm, budget, pc); \
+        if (verified_at(v, pc)) \
+            goto *unchecked[vm->memory[pc++]]; \
+        if (pc >= MAX_INT) \
+            end_of_memory(vm, pc, budget); \
+        op = vm->memory[pc++]; \
+        if (op >= NUM_OP_CODES) \
+            bad_op_code(vm, pc, op, budget); \
+        goto *labels[op]; \
+    } while (0)
+
+    VM_PUBLISH(vm, pc);
+    DISPATCH();
+
+#define TARGET(op) label_##op:
+#include "exec_loop.h"
+#undef TARGET
+
+#define TARGET(op) unchecked_##op:
+#define UNCHECKED
+#include "exec_loop.h"
+#undef UNCHECKED
+#undef TARGET
+
+#undef DISPATCH
+}
+#else
+void execute_file_threaded(struct vm *vm)
+{
+    execute_file_switch(vm);
+}
+#endif
+
+/*
+ * The switch engine once more, with the profiler (profile.c) counting every
+ * instruction and following every call. run() takes it while profiling,
+ * whatever engine is set.
+ */
+void execute_file_profiled(struct vm *vm)
+{
+    uint64_t budget = vm->budget;
+    uint16_t pc = vm->mem_offset;
+    uint16_t op, a, b, c;
+
+    for (;;) {
+        VM_TICK(vm, budget, pc);
+        if (pc >= MAX_INT)
+            end_of_memory(vm, pc, budget);
+
+        op = vm->memory[pc];
+        profile_step(vm, pc, op);
+        pc++;
+
+#define TARGET(op) case op:
+#define DISPATCH() continue
+#define CALL_HOOK(target, next) profile_call(vm, (target), (next))
+
+        switch (op) {
+#include "exec_loop.h"
+            default:
+                bad_op_code(vm, pc, op, budget);
+        }
+
+#undef TARGET
+#undef DISPATCH
+#undef CALL_HOOK
+    }
+}
+
+/*
+ * Runs the instruction at `pc` through op_functions[] and returns the next
+ * program counter. The decoded engine falls back to this for instructions
+ * which do not decode, so that they fail exactly like they do in
+ * execute_file().
+ */
+static uint16_t execute_one(struct vm *vm, uint16_t pc)
+{
+    uint16_t op;
+
+    vm->mem_offset = pc;
+    if (READ_WORD(op) == -1)
+        end_of_memory(vm, vm->mem_offset, vm->budget);
+    if (op >= NUM_OP_CODES)
+        bad_op_code(vm, vm->mem_offset, op, vm->budget);
+    op_functions[op](vm);
+
+    return vm->mem_offset;
+}
+
+/*
+ * Runs from the instruction cache in decode.c, so operands are fetched and
+ * classified once per decoded instruction instead of once per execution.
+ * wmem() drops the cache entries it overwrites. The decoder gives the
+ * hottest instructions variants for the kinds of their sources (see
+ * decode.h), whose handlers fetch them without testing `kinds`.
+ *
+ * The decoder also fuses the sequences of instructions in fused.h, which
+ * fusegen.c generates from a profile, into superinstructions. Their
+ * handlers (fused_handlers.h) run every instruction but the last with the
+ * DO_*() macros below and then jump to the last one's handler, so the
+ * sequence costs a single dispatch. Each instruction is still counted
+ * against the budget, and a run can stop at any of them.
+ */
+void execute_file_decoded(struct vm *vm)
+{
+#ifdef HAVE_COMPUTED_GOTO
+    #define SPECIALIZED_HANDLER(op, kinds) [OP_##op##_##kinds] = &&decoded_OP_##op##_##kinds,
+    #define FUSED_HANDLER(op) [op] = &&decoded_##op,
+    static const void *const handlers[OP_FUSED + NUM_FUSED] = {
+        [HALT] = &&decoded_HALT,
+        [SET] = &&decoded_SET,
+        [PUSH] = &&decoded_PUSH,
+        [POP] = &&decoded_POP,
+        [EQ] = &&decoded_EQ,
+        [GT] = &&decoded_GT,
+        [JMP] = &&decoded_JMP,
+        [JT] = &&decoded_JT,
+        [JF] = &&decoded_JF,
+        [ADD] = &&decoded_ADD,
+        [MULT] = &&decoded_MULT,
+        [MOD] = &&decoded_MOD,
+        [AND] = &&decoded_AND,
+        [OR] = &&decoded_OR,
+        [NOT] = &&decoded_NOT,
+        [RMEM] = &&decoded_RMEM,
+        [WMEM] = &&decoded_WMEM,
+        [CALL] = &&decoded_CALL,
+        [RET] = &&decoded_RET,
+        [OUT] = &&decoded_OUT,
+        [IN] = &&decoded_IN,
+        [NOOP] = &&decoded_NOOP,
+        [OP_UNDECODED] = &&decoded_OP_UNDECODED,
+        [OP_END] = &&decoded_OP_END,
+        SPECIALIZED_OPS(SPECIALIZED_HANDLER)
+        FUSED_OPS(FUSED_HANDLER)
+    };
+    #undef SPECIALIZED_HANDLER
+    #undef FUSED_HANDLER
+
+    #define TARGET(op) decoded_##op:
+    #define DISPATCH() \
+        do { \
+            VM_TICK(vm, budget, pc); \
+            in = &ic->insn[pc]; \
+            goto *in->handler; \
+        } while (0)
+    #define FUSED_TAIL(op) goto decoded_##op
+#else
+    static const void *const *handlers = NULL;
+
+    #define TARGET(op) case op:
+    /* Not `continue`, which NEXT()'s do-while would take for its own */
+    #define DISPATCH() goto dispatch
+    /* Dispatches on the last instruction after all, which has been counted */
+    #define FUSED_TAIL(op) do { budget++; goto dispatch; } while (0)
+#endif
+
+#ifdef FOLDED_REGS
+    #define DEST    (vm->operand_file[in->arg[0]])
+    #define VAL(n)  (vm->operand_file[in->arg[n]])
+    #define REG(n)  (vm->operand_file[in->arg[n]])
+#else
+    #define DEST    (vm->regs[in->arg[0]])
+    #define VAL(n)  ((in->kinds & (1 << (n))) ? vm->regs[in->arg[n]] : in->arg[n])
+    #define REG(n)  (vm->regs[in->arg[n]])
+#endif
+    #define IMM(n)  (in->arg[n])
+    #define NEXT() \
+        do { \
+            pc += in->len; \
+            DISPATCH(); \
+        } while (0)
+
+    /* Moves on to the next instruction of a superinstruction */
+    #define FUSED_NEXT() \
+        do { \
+            pc += in->len; \
+            VM_TICK(vm, budget, pc); \
+            in = &ic->insn[pc]; \
+            vm->stats.fused++; \
+        } while (0)
+
+    /*
+     * What the instructions which the decoder specializes do with their
+     * sources `a` and `b`, however those are fetched
+     */
+    #define SET_OF(a)       (DEST = (a))
+    #define PUSH_OF(a) \
+        do { \
+            if (!vm_push(vm, (a))) \
+                bad_operand(vm, pc + in->len, SYN_TRAP_NOMEM, 0, budget); \
+        } while (0)
+    #define EQ_OF(a, b)     (DEST = (a) == (b))
+    #define GT_OF(a, b)     (DEST = (a) > (b))
+    #define JT_OF(a, b)     (pc = (a) ? (b) : pc + in->len, VM_PUBLISH(vm, pc))
+    #define JF_OF(a, b)     (pc = !(a) ? (b) : pc + in->len, VM_PUBLISH(vm, pc))
+    #define ADD_OF(a, b)    (DEST = ((a) + (b)) % (MAX_INT + 1))
+    #define MULT_OF(a, b)   (DEST = ((a) * (b)) % (MAX_INT + 1))
+    #define MOD_OF(a, b) \
+        do { \
+            if (!(b)) \
+                bad_operand(vm, pc + in->len, SYN_TRAP_DIV, 0, budget); \
+            DEST = (a) % (b); \
+        } while (0)
+    #define AND_OF(a, b)    (DEST = (a) & (b))
+    #define OR_OF(a, b)     (DEST = (a) | (b))
+    #define NOT_OF(a)       (DEST = ~(a) & MAX_INT)
+    #define RMEM_OF(a) \
+        do { \
+            if ((a) > MAX_INT) \
+                bad_operand(vm, pc + in->len, SYN_TRAP_ADDR, (a), budget); \
+            DEST = vm->memory[(a)]; \
+        } while (0)
+
+    /*
+     * The handlers of an instruction's variants (decode.h), with its sources
+     * from operand `n` on, and of how it moves on
+     */
+    #define VARIANTS_1(op, n, next) \
+        TARGET(OP_##op##_R) { op##_OF(REG(n)); next(); } \
+        TARGET(OP_##op##_I) { op##_OF(IMM(n)); next(); }
+    #define VARIANTS_2(op, n, next) \
+        TARGET(OP_##op##_RR) { op##_OF(REG(n), REG(n + 1)); next(); } \
+        TARGET(OP_##op##_RI) { op##_OF(REG(n), IMM(n + 1)); next(); } \
+        TARGET(OP_##op##_IR) { op##_OF(IMM(n), REG(n + 1)); next(); } \
+        TARGET(OP_##op##_II) { op##_OF(IMM(n), IMM(n + 1)); next(); }
+
+    /*
+     * What the handlers of the instructions which superinstructions may run
+     * before others do, up to their dispatch
+     */
+    #define DO_SET()    SET_OF(VAL(1))
+    #define DO_PUSH()   PUSH_OF(VAL(0))
+    #define DO_POP() \
+        do { \
+            if (s_empty(vm->prog_stack)) { \
+                vm->mem_offset = pc + in->len; \
+                VM_SYNC(vm, budget); \
+                vm_stop(vm, SYN_TRAP_UNDERFLOW, 0); \
+            } \
+            DEST = s_top(vm->prog_stack); \
+            s_pop(vm->prog_stack); \
+        } while (0)
+    #define DO_EQ()     EQ_OF(VAL(1), VAL(2))
+    #define DO_GT()     GT_OF(VAL(1), VAL(2))
+    #define DO_ADD()    ADD_OF(VAL(1), VAL(2))
+    #define DO_MULT()   MULT_OF(VAL(1), VAL(2))
+    #define DO_MOD()    MOD_OF(VAL(1), VAL(2))
+    #define DO_AND()    AND_OF(VAL(1), VAL(2))
+    #define DO_OR()     OR_OF(VAL(1), VAL(2))
+    #define DO_NOT()    NOT_OF(VAL(1))
+    #define DO_RMEM()   RMEM_OF(VAL(1))
+    #define DO_OUT() \
+        do { \
+            VM_SYNC(vm, budget); \
+            vm_output(vm, pc, VAL(0)); \
+        } while (0)
+    #define DO_NOOP()   ((void)0)
+
+    uint64_t budget = vm->budget;
+    uint16_t pc = vm->mem_offset;
+    const struct insn *in;
+    struct icache *ic;
+    uint16_t addr;
+
+    if (!vm->icache && !(vm->icache = icache_new(vm->memory, handlers)))
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+    ic = vm->icache;
+
+    VM_PUBLISH(vm, pc);
+#ifdef HAVE_COMPUTED_GOTO
+    DISPATCH();
+#else
+    for (;;) {
+dispatch:
+        VM_TICK(vm, budget, pc);
+        in = &ic->insn[pc];
+        switch (in->op) {
+#endif
+
+    TARGET(HALT) {
+        vm->mem_offset = pc + 1;
+        VM_SYNC(vm, budget);
+        vm_stop(vm, SYN_HALT, 0);
+    }
+
+    TARGET(SET) {
+        DO_SET();
+        NEXT();
+    }
+
+    TARGET(PUSH) {
+        DO_PUSH();
+        NEXT();
+    }
+
+    TARGET(POP) {
+        DO_POP();
+        NEXT();
+    }
+
+    TARGET(EQ) {
+        DO_EQ();
+        NEXT();
+    }
+
+    TARGET(GT) {
+        DO_GT();
+        NEXT();
+    }
+
+    TARGET(JMP) {
+        pc = VAL(0);
+        VM_PUBLISH(vm, pc);
+        DISPATCH();
+    }
+
+    TARGET(JT) {
+        JT_OF(VAL(0), VAL(1));
+        DISPATCH();
+    }
+
+    TARGET(JF) {
+        JF_OF(VAL(0), VAL(1));
+        DISPATCH();
+    }
+
+    TARGET(ADD) {
+        DO_ADD();
+        NEXT();
+    }
+
+    TARGET(MULT) {
+        DO_MULT();
+        NEXT();
+    }
+
+    TARGET(MOD) {
+        DO_MOD();
+        NEXT();
+    }
+
+    TARGET(AND) {
+        DO_AND();
+        NEXT();
+    }
+
+    TARGET(OR) {
+        DO_OR();
+        NEXT();
+    }
+
+    TARGET(NOT) {
+        DO_NOT();
+        NEXT();
+    }
+
+    TARGET(RMEM) {
+        DO_RMEM();
+        NEXT();
+    }
+
+    TARGET(WMEM) {
+        addr = VAL(0);
+        if (addr > MAX_INT)
+            bad_operand(vm, pc + in->len, SYN_TRAP_ADDR, addr, budget);
+        vm_store(vm, addr, VAL(1));
+        icache_invalidate(ic, addr);
+        NEXT();
+    }
+
+    TARGET(CALL) {
+        VM_SYNC(vm, budget);
+        if ((vm->hooks || vm->memo) && vm_hook(vm, VAL(0), pc + in->len)) {
+            pc = vm->mem_offset;
+            budget = vm->budget;    /* a memoized call takes what it ran */
+            VM_PUBLISH(vm, pc);
+            DISPATCH();
+        }
+        if (!vm_push(vm, pc + in->len))
+            bad_operand(vm, pc + in->len, SYN_TRAP_NOMEM, 0, budget);
+        pc = VAL(0);
+        VM_PUBLISH(vm, pc);
+        DISPATCH();
+    }
+
+    TARGET(RET) {
+        if (s_empty(vm->prog_stack)) {
+            vm->mem_offset = pc + in->len;
+            VM_SYNC(vm, budget);
+            vm_stop(vm, SYN_TRAP_UNDERFLOW, 0);
+        }
+        pc = s_top(vm->prog_stack);
+        s_pop(vm->prog_stack);
+        VM_PUBLISH(vm, pc);
+        DISPATCH();
+    }
+
+    TARGET(OUT) {
+        DO_OUT();
+        NEXT();
+    }
+
+    TARGET(IN) {
+        VM_SYNC(vm, budget);
+        DEST = vm_input(vm, pc);
+        NEXT();
+    }
+
+    TARGET(NOOP) {
+        NEXT();
+    }
+
+    TARGET(OP_UNDECODED) {
+        if (icache_fill(ic, pc)) {
+            budget++;           /* it is dispatched again right away */
+        } else {
+            VM_SYNC(vm, budget);
+            pc = execute_one(vm, pc);
+            budget = vm->budget;
+        }
+        DISPATCH();
+    }
+
+    TARGET(OP_END) {
+        end_of_memory(vm, pc, budget);
+    }
+
+    VARIANTS_1(SET, 1, NEXT)
+    VARIANTS_1(PUSH, 0, NEXT)
+    VARIANTS_2(EQ, 1, NEXT)
+    VARIANTS_2(GT, 1, NEXT)
+    VARIANTS_2(JT, 0, DISPATCH)
+    VARIANTS_2(JF, 0, DISPATCH)
+    VARIANTS_2(ADD, 1, NEXT)
+    VARIANTS_2(MULT, 1, NEXT)
+    VARIANTS_2(MOD, 1, NEXT)
+    VARIANTS_2(AND, 1, NEXT)
+    VARIANTS_2(OR, 1, NEXT)
+    VARIANTS_1(NOT, 1, NEXT)
+    VARIANTS_1(RMEM, 1, NEXT)
+
+#include "fused_handlers.h"
+
+#ifndef HAVE_COMPUTED_GOTO
+        }
+    }
+#endif
+
+    #undef TARGET
+    #undef DISPATCH
+    #undef DEST
+    #undef VAL
+    #undef REG
+    #undef IMM
+    #undef NEXT
+    #undef FUSED_NEXT
+    #undef SET_OF
+    #undef PUSH_OF
+    #undef EQ_OF
+    #undef GT_OF
+    #undef JT_OF
+    #undef JF_OF
+    #undef ADD_OF
+    #undef MULT_OF
+    #undef MOD_OF
+    #undef AND_OF
+    #undef OR_OF
+    #undef NOT_OF
+    #undef RMEM_OF
+    #undef VARIANTS_1
+    #undef VARIANTS_2
+    #undef FUSED_TAIL
+    #undef DO_SET
+    #undef DO_PUSH
+    #undef DO_POP
+    #undef DO_EQ
+    #undef DO_GT
+    #undef DO_ADD
+    #undef DO_MULT
+    #undef DO_MOD
+    #undef DO_AND
+    #undef DO_OR
+    #undef DO_NOT
+    #undef DO_RMEM
+    #undef DO_OUT
+    #undef DO_NOOP
+}
+
+/*
+ * Runs translated code from jit.c, interpreting whatever the JIT leaves
+ * alone (halt, in, out and instructions which fault).
+ */
+void execute_file_jit(struct vm *vm)
+{
+    uint16_t pc = vm->mem_offset;
+    struct jit *jit;
+    uint32_t next;
+    void *code;
+
+    if (!vm->jit && !(vm->jit = jit_new(vm)))
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+    jit = vm->jit;
+
+    for (;;) {
+        if (pc >= MAX_INT) {
+            /* Counted like the fetch past the end in the interpreters */
+            VM_TICK(vm, vm->budget, pc);
+            end_of_memory(vm, pc, vm->budget);
+        }
+
+        if (!(code = jit_lookup(jit, pc))) {
+            VM_TICK(vm, vm->budget, pc);
+            VM_PUBLISH(vm, pc);
+            pc = execute_one(vm, pc);
+            continue;
+        }
+
+        next = jit_run(jit, code);
+        pc = next & ~JIT_INTERPRET;
+        if (next & JIT_INTERPRET) {
+            VM_TICK(vm, vm->budget, pc);
+            VM_PUBLISH(vm, pc);
+            pc = execute_one(vm, pc);
+        }
+    }
+}
+
+/* op code implementations */
+
+static void halt(struct vm *vm)
+{
+    dpf();
+    vm_stop(vm, SYN_HALT, 0);
+}
+
+static void set(struct vm *vm)
+{
+    READ2(SET, reg, val)
+
+    verify_reg_or_die(vm, reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &val);
+
+    dprintf("Setting register %d to 0x%02x |%c|\n", reg - MIN_REG,
+        val, isprint(val) ? val : '.');
+
+    vm->regs[addr_to_reg_num(reg)] = val;
+}
+
+static void push(struct vm *vm)
+{
+    READ1(PUSH, val);
+    verify_reg_or_int_and_get_val_or_die(vm, &val);
+    if (!vm_push(vm, val))
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+
+}
+
+static void pop(struct vm *vm)
+{
+    READ1(POP, dest_reg);
+    verify_reg_or_die(vm, dest_reg);
+
+    if (s_empty(vm->prog_stack))
+        vm_stop(vm, SYN_TRAP_UNDERFLOW, 0);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = s_top(vm->prog_stack);
+    s_pop(vm->prog_stack);
+}
+
+static void eq(struct vm *vm)
+{
+    READ3(EQ, dest_reg, val1, val2)
+    
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &val1);
+    verify_reg_or_int_and_get_val_or_die(vm, &val2);
+
+    dprintf("val1: 0x%02x, val2: 0x%02x\n", val1, val2);
+
+    if (val1 == val2) {
+        dprintf("Values equal. Setting reg %d to 1\n", dest_reg - MIN_REG);
+        vm->regs[addr_to_reg_num(dest_reg)] = 1;
+    } else {
+        dprintf("Values NOT equal. Setting reg %d to 0\n", dest_reg - MIN_REG);
+        vm->regs[addr_to_reg_num(dest_reg)] = 0;
+    }
+}
+
+static void gt(struct vm *vm)
+{
+    READ3(GT, dest_reg, val1, val2)
+    
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &val1);
+    verify_reg_or_int_and_get_val_or_die(vm, &val2);
+
+    dprintf("val1: 0x%02x, val2: 0x%02x\n", val1, val2);
+
+    if (val1 > val2) {
+        dprintf("val 1 > val2. Setting reg %d to 1\n", dest_reg - MIN_REG);
+        vm->regs[addr_to_reg_num(dest_reg)] = 1;
+    } else {
+        dprintf("val 1 is <= val2. Setting reg %d to 0\n", dest_reg - MIN_REG);
+        vm->regs[addr_to_reg_num(dest_reg)] = 0;
+    }
+}
+
+static void jmp(struct vm *vm)
+{
+    READ1(JMP, addr)
+    verify_reg_or_int_and_get_val_or_die(vm, &addr);
+    
+    dprintf("current word-wise file offset: %u\n", vm->mem_offset - 1);
+    dprintf("jump addr: %u\n", addr);
+    
+    vm->mem_offset = addr;
+    VM_PUBLISH(vm, addr);
+}
+
+static void jt(struct vm *vm)
+{
+    READ2(JT, boolean, addr)
+    
+    verify_reg_or_int_and_get_val_or_die(vm, &boolean);
+    verify_reg_or_int_and_get_val_or_die(vm, &addr);
+
+    dprintf("boolean val: '%c'\tjump addr: %u\n", boolean != 0 ? 'T' : 'F', addr);
+    dprintf("current word-wise file offset: %u\n", vm->mem_offset - 3);
+
+    if (boolean) {
+        vm->mem_offset = addr;
+        VM_PUBLISH(vm, addr);
+    }
+}
+
+static void jf(struct vm *vm)
+{
+    READ2(JF, boolean, addr)
+    
+    verify_reg_or_int_and_get_val_or_die(vm, &boolean);
+    verify_reg_or_int_and_get_val_or_die(vm, &addr);
+    
+    dprintf("boolean val: '%c'\tjump addr: %u\n", boolean != 0 ? 'T' : 'F', addr);
+    dprintf("current word-wise file offset: %u\n", vm->mem_offset - 3);
+
+    if (!boolean) {
+        vm->mem_offset = addr;
+        VM_PUBLISH(vm, addr);
+    }
+}
+
+static void add(struct vm *vm)
+{
+    READ3(ADD, dest_reg, addend1, addend2)
+
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &addend1);
+    verify_reg_or_int_and_get_val_or_die(vm, &addend2);
+    
+    uint16_t sum = (addend1 + addend2) % (MAX_INT + 1);
+
+    dprintf("Setting register %d to (0x%02x + 0x%02x) %% MAX_INT+1 = 0x%02x\n", dest_reg - MIN_REG,
+        addend1, addend2, sum);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = sum;
+}
+
+static void mult(struct vm *vm)
+{
+    READ3(MULT, dest_reg, factor1, factor2)
+
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &factor1);
+    verify_reg_or_int_and_get_val_or_die(vm, &factor2);
+    
+    uint16_t product = (factor1 * factor2) % (MAX_INT + 1);
+
+    dprintf("Setting register %d to (0x%02x * 0x%02x) %% MAX_INT+1 = 0x%02x\n", dest_reg - MIN_REG,
+        factor1, factor2, product);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = product;
+}
+
+static void mod(struct vm *vm)
+{
+    READ3(MOD, dest_reg, val1, val2)
+
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &val1);
+    verify_reg_or_int_and_get_val_or_die(vm, &val2);
+    if (!val2)
+        vm_stop(vm, SYN_TRAP_DIV, 0);
+    
+    uint16_t res = val1 % val2;
+
+    dprintf("Setting register %d to (0x%02x %% 0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
+        val1, val2, res);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = res;
+}
+
+static void and(struct vm *vm)
+{
+    READ3(AND, dest_reg, val1, val2)
+
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &val1);
+    verify_reg_or_int_and_get_val_or_die(vm, &val2);
+    
+    uint16_t res = val1 & val2;
+
+    dprintf("Setting register %d to (0x%02x & 0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
+        val1, val2, res);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = res;
+}
+
+static void or(struct vm *vm)
+{
+    READ3(OR, dest_reg, val1, val2)
+
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &val1);
+    verify_reg_or_int_and_get_val_or_die(vm, &val2);
+    
+    uint16_t res = val1 | val2;
+
+    dprintf("Setting register %d to (0x%02x | 0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
+        val1, val2, res);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = res;
+}
+
+static void not(struct vm *vm)
+{
+    READ2(NOT, dest_reg, val1)
+
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &val1);
+    
+    uint16_t res = ~val1 & MAX_INT;
+
+    dprintf("Setting register %d to (~0x%02x %% MAX_INT+1) = 0x%02x\n", dest_reg - MIN_REG,
+        val1, res);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = res;
+}
+
+static void rmem(struct vm *vm)
+{
+    READ2(RMEM, dest_reg, addr)
+
+    verify_reg_or_die(vm, dest_reg);
+    verify_reg_or_int_and_get_val_or_die(vm, &addr);
+    verify_addr_or_die(vm, addr);
+    
+    uint16_t res = vm->memory[addr];
+
+    dprintf("Setting register %d to value of mem location (0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
+        addr, res);
+
+    vm->regs[addr_to_reg_num(dest_reg)] = res;
+}
+
+static void wmem(struct vm *vm)
+{
+    READ2(WMEM, addr, val)
+
+    verify_reg_or_int_and_get_val_or_die(vm, &addr);
+    verify_reg_or_int_and_get_val_or_die(vm, &val);
+    verify_addr_or_die(vm, addr);
+    
+    vm_store(vm, addr, val);
+
+    dprintf("Setting mem loc %u to value of %02x\n", addr, vm->memory[addr]);
+}
+
+static void call(struct vm *vm)
+{
+    READ1(CALL, addr)
+    verify_reg_or_int_and_get_val_or_die(vm, &addr);
+    
+    dprintf("current word-wise file offset: %u\n", vm->mem_offset - 2);
+    dprintf("jump addr: %u\n", addr);
+
+    if ((vm->hooks || vm->memo) && vm_hook(vm, addr, vm->mem_offset)) {
+        VM_PUBLISH(vm, vm->mem_offset);
+        return;
+    }
+    
+    if (!vm_push(vm, vm->mem_offset))
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+    vm->mem_offset = addr;
+    VM_PUBLISH(vm, addr);
+}
+
+static void ret(struct vm *vm)
+{
+    if (s_empty(vm->prog_stack))
+        vm_stop(vm, SYN_TRAP_UNDERFLOW, 0);
+
+    vm->mem_offset = s_top(vm->prog_stack);
+    s_pop(vm->prog_stack);
+    VM_PUBLISH(vm, vm->mem_offset);
+    
+    dprintf("current word-wise file offset: %u\n", vm->mem_offset - 1);
+    dprintf("jump addr: %u\n", vm->mem_offset);
+}
+
+static void out(struct vm *vm)
+{
+    READ1(OUT, ch)
+    verify_reg_or_int_and_get_val_or_die(vm, &ch);
+    vm_output(vm, vm->mem_offset - 2, ch);
+}
+
+static void in(struct vm *vm)
+{
+    READ1(IN, reg)
+    verify_reg_or_die(vm, reg);
+
+    vm->regs[addr_to_reg_num(reg)] = vm_input(vm, vm->mem_offset - 2);
+}
+
+static void noop(struct vm *vm)
+{
+    (void)vm;
+    dpf();
+}
+
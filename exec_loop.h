@@ -0,0 +1,348 @@
+/*
+ * Body of the inlined interpreter loop. This file is included by exec.c,
+ * once for the switch engine and once for the threaded engine, and by the
+ * runtime of translated programs (translate_rt.c). The includer provides:
+ *
+ *   TARGET(op)  - label or case for the handler of `op`
+ *   DISPATCH()  - fetch the next op code and transfer control to its handler
+ *
+ * and the locals `vm`, `pc` (the cached vm->mem_offset), `budget` (the
+ * cached vm->budget, see VM_SYNC()) and the scratch operands `a`, `b` and
+ * `c`. The first dispatch is also up to the includer, which may also define
+ * STORE(addr, val) to see every write to memory, CALL_HOOK(target, next) to
+ * run native hooks (hooks.c) in place of calls, SYNC() and RELOAD() to store
+ * the budget and load it back some other way, and PUBLISH() to tell the
+ * sampler where control went (see VM_PUBLISH()). With UNCHECKED defined, the
+ * handlers leave out the checks of operands and of the end of memory, for
+ * instructions which have been verified (see struct verified).
+ */
+
+#ifndef SYNC
+#define SYNC() VM_SYNC(vm, budget)
+#define RELOAD() (budget = vm->budget)
+#define EXEC_LOOP_DEFAULT_SYNC
+#endif
+
+#ifndef PUBLISH
+#define PUBLISH() VM_PUBLISH(vm, pc)
+#define EXEC_LOOP_DEFAULT_PUBLISH
+#endif
+
+#ifndef STORE
+#define STORE(addr, val) vm_store(vm, (addr), (val))
+#define EXEC_LOOP_DEFAULT_STORE
+#endif
+
+#ifndef CALL_HOOK
+#define CALL_HOOK(target, next) \
+    ((vm->hooks || vm->memo) && vm_hook(vm, (target), (next)))
+#define EXEC_LOOP_DEFAULT_CALL_HOOK
+#endif
+
+#ifdef UNCHECKED
+#define ARG(var, op) (var = vm->memory[pc++])
+#else
+#define ARG(var, op) \
+    do { \
+        if (pc >= MAX_INT) { \
+            vm->mem_offset = pc; \
+            SYNC(); \
+            vm_stop(vm, SYN_TRAP_ARGS, op); \
+        } \
+        var = vm->memory[pc++]; \
+    } while (0)
+#endif
+
+#define ARG1(a, op)       ARG(a, op)
+#define ARG2(a, b, op)    ARG(a, op); ARG(b, op)
+#define ARG3(a, b, c, op) ARG(a, op); ARG(b, op); ARG(c, op)
+
+#ifdef UNCHECKED
+#define DEST(r) ((void)0)
+#else
+#define DEST(r) \
+    do { \
+        if (!is_reg(r)) { \
+            SYNC(); \
+            verify_reg_or_die(vm, r); \
+        } \
+    } while (0)
+#endif
+
+#if defined(UNCHECKED) && defined(FOLDED_REGS)
+#define VAL(v) (v = vm->operand_file[v])
+#elif defined(UNCHECKED)
+#define VAL(v) \
+    do { \
+        if (is_reg(v)) \
+            v = vm->regs[v - MIN_REG]; \
+    } while (0)
+#elif defined(FOLDED_REGS)
+#define VAL(v) \
+    do { \
+        if (v > MAX_REG) { \
+            SYNC(); \
+            verify_int_or_die(vm, v); \
+        } \
+        v = vm->operand_file[v]; \
+    } while (0)
+#else
+#define VAL(v) \
+    do { \
+        if (is_reg(v)) \
+            v = vm->regs[v - MIN_REG]; \
+        else if (v > MAX_INT) { \
+            SYNC(); \
+            verify_int_or_die(vm, v); \
+        } \
+    } while (0)
+#endif
+
+    TARGET(HALT) {
+        vm->mem_offset = pc;
+        SYNC();
+        vm_stop(vm, SYN_HALT, 0);
+    }
+
+    TARGET(SET) {
+        ARG2(a, b, SET);
+        DEST(a);
+        VAL(b);
+        vm->regs[a - MIN_REG] = b;
+        DISPATCH();
+    }
+
+    TARGET(PUSH) {
+        ARG1(a, PUSH);
+        VAL(a);
+        if (!vm_push(vm, a)) {
+            vm->mem_offset = pc;
+            SYNC();
+            vm_stop(vm, SYN_TRAP_NOMEM, 0);
+        }
+        DISPATCH();
+    }
+
+    TARGET(POP) {
+        ARG1(a, POP);
+        DEST(a);
+        if (s_empty(vm->prog_stack)) {
+            vm->mem_offset = pc;
+            SYNC();
+            vm_stop(vm, SYN_TRAP_UNDERFLOW, 0);
+        }
+        vm->regs[a - MIN_REG] = s_top(vm->prog_stack);
+        s_pop(vm->prog_stack);
+        DISPATCH();
+    }
+
+    TARGET(EQ) {
+        ARG3(a, b, c, EQ);
+        DEST(a);
+        VAL(b);
+        VAL(c);
+        vm->regs[a - MIN_REG] = b == c;
+        DISPATCH();
+    }
+
+    TARGET(GT) {
+        ARG3(a, b, c, GT);
+        DEST(a);
+        VAL(b);
+        VAL(c);
+        vm->regs[a - MIN_REG] = b > c;
+        DISPATCH();
+    }
+
+    TARGET(JMP) {
+        ARG1(a, JMP);
+        VAL(a);
+        pc = a;
+        PUBLISH();
+        DISPATCH();
+    }
+
+    TARGET(JT) {
+        ARG2(a, b, JT);
+        VAL(a);
+        VAL(b);
+        if (a) {
+            pc = b;
+            PUBLISH();
+        }
+        DISPATCH();
+    }
+
+    TARGET(JF) {
+        ARG2(a, b, JF);
+        VAL(a);
+        VAL(b);
+        if (!a) {
+            pc = b;
+            PUBLISH();
+        }
+        DISPATCH();
+    }
+
+    TARGET(ADD) {
+        ARG3(a, b, c, ADD);
+        DEST(a);
+        VAL(b);
+        VAL(c);
+        vm->regs[a - MIN_REG] = (b + c) % (MAX_INT + 1);
+        DISPATCH();
+    }
+
+    TARGET(MULT) {
+        ARG3(a, b, c, MULT);
+        DEST(a);
+        VAL(b);
+        VAL(c);
+        vm->regs[a - MIN_REG] = (b * c) % (MAX_INT + 1);
+        DISPATCH();
+    }
+
+    TARGET(MOD) {
+        ARG3(a, b, c, MOD);
+        DEST(a);
+        VAL(b);
+        VAL(c);
+        if (!c) {
+            vm->mem_offset = pc;
+            SYNC();
+            vm_stop(vm, SYN_TRAP_DIV, 0);
+        }
+        vm->regs[a - MIN_REG] = b % c;
+        DISPATCH();
+    }
+
+    TARGET(AND) {
+        ARG3(a, b, c, AND);
+        DEST(a);
+        VAL(b);
+        VAL(c);
+        vm->regs[a - MIN_REG] = b & c;
+        DISPATCH();
+    }
+
+    TARGET(OR) {
+        ARG3(a, b, c, OR);
+        DEST(a);
+        VAL(b);
+        VAL(c);
+        vm->regs[a - MIN_REG] = b | c;
+        DISPATCH();
+    }
+
+    TARGET(NOT) {
+        ARG2(a, b, NOT);
+        DEST(a);
+        VAL(b);
+        vm->regs[a - MIN_REG] = ~b & MAX_INT;
+        DISPATCH();
+    }
+
+    TARGET(RMEM) {
+        ARG2(a, b, RMEM);
+        DEST(a);
+        VAL(b);
+        if (b > MAX_INT) {
+            vm->mem_offset = pc;
+            SYNC();
+            vm_stop(vm, SYN_TRAP_ADDR, b);
+        }
+        vm->regs[a - MIN_REG] = vm->memory[b];
+        DISPATCH();
+    }
+
+    TARGET(WMEM) {
+        ARG2(a, b, WMEM);
+        VAL(a);
+        VAL(b);
+        if (a > MAX_INT) {
+            vm->mem_offset = pc;
+            SYNC();
+            vm_stop(vm, SYN_TRAP_ADDR, a);
+        }
+        STORE(a, b);
+        DISPATCH();
+    }
+
+    TARGET(CALL) {
+        ARG1(a, CALL);
+        VAL(a);
+        SYNC();
+        if (CALL_HOOK(a, pc)) {
+            pc = vm->mem_offset;
+            RELOAD();           /* a memoized call takes what it ran */
+            PUBLISH();
+            DISPATCH();
+        }
+        if (!vm_push(vm, pc)) {
+            vm->mem_offset = pc;
+            vm_stop(vm, SYN_TRAP_NOMEM, 0);
+        }
+        pc = a;
+        PUBLISH();
+        DISPATCH();
+    }
+
+    TARGET(RET) {
+        if (s_empty(vm->prog_stack)) {
+            vm->mem_offset = pc;
+            SYNC();
+            vm_stop(vm, SYN_TRAP_UNDERFLOW, 0);
+        }
+        pc = s_top(vm->prog_stack);
+        s_pop(vm->prog_stack);
+        PUBLISH();
+        DISPATCH();
+    }
+
+    TARGET(OUT) {
+        ARG1(a, OUT);
+        VAL(a);
+        SYNC();
+        vm_output(vm, pc - 2, a);
+        DISPATCH();
+    }
+
+    TARGET(IN) {
+        ARG1(a, IN);
+        DEST(a);
+        SYNC();
+        vm->regs[a - MIN_REG] = vm_input(vm, pc - 2);
+        DISPATCH();
+    }
+
+    TARGET(NOOP) {
+        DISPATCH();
+    }
+
+#undef ARG
+#undef ARG1
+#undef ARG2
+#undef ARG3
+#undef DEST
+#undef VAL
+
+#ifdef EXEC_LOOP_DEFAULT_CALL_HOOK
+#undef CALL_HOOK
+#undef EXEC_LOOP_DEFAULT_CALL_HOOK
+#endif
+
+#ifdef EXEC_LOOP_DEFAULT_PUBLISH
+#undef PUBLISH
+#undef EXEC_LOOP_DEFAULT_PUBLISH
+#endif
+
+#ifdef EXEC_LOOP_DEFAULT_STORE
+#undef STORE
+#undef EXEC_LOOP_DEFAULT_STORE
+#endif
+
+#ifdef EXEC_LOOP_DEFAULT_SYNC
+#undef SYNC
+#undef RELOAD
+#undef EXEC_LOOP_DEFAULT_SYNC
+#endif
@@ -0,0 +1,294 @@
+/*
+ * fusegen: generates the superinstructions of the decoded engine from a
+ * profile, at build time.
+ *
+ * It reads the "sequence" table of a profile report (syn_profile_report(),
+ * see profile.c): sequences of two or three op codes which run one after
+ * the other, most frequent first. The first FUSED_MAX of them which can be
+ * fused become superinstructions. Every instruction but the last of one
+ * must be one which always goes on with the next and cannot change code,
+ * so that the whole sequence can run from the entries decoded for it. A
+ * sequence which only ever runs as part of a longer one is left out, as the
+ * decoder fuses the longer one and never gets to start it.
+ *
+ * Two files come out: `fused.h` numbers the superinstructions and lists
+ * their op codes for the decoder (decode.c), `fused_handlers.h` has their
+ * handlers, which execute_file_decoded() includes like exec_loop.h. Each
+ * handler runs the instructions but the last with the DO_<op>() macros of
+ * the engine, moving on with FUSED_NEXT(), and hands the last one to the
+ * engine's own handler with FUSED_TAIL(<op>).
+ *
+ * Usage: fusegen <profile> <fused.h> <fused_handlers.h>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include "arch.h"
+
+#define FUSED_MAX 16
+#define FUSED_MAX_INSNS 3
+#define MAX_ROWS 256
+
+struct fusion {
+    enum opcode ops[FUSED_MAX_INSNS];
+    int len;
+    unsigned long long count;
+};
+
+static struct fusion rows[MAX_ROWS];
+static int num_rows;
+
+static struct fusion fusions[FUSED_MAX];
+static int num_fusions;
+
+/* Whether `op` can run before others in a superinstruction */
+static bool fusable(enum opcode op)
+{
+    switch (op) {
+        case SET: case PUSH: case POP: case EQ: case GT: case ADD: case MULT:
+        case MOD: case AND: case OR: case NOT: case RMEM: case OUT: case NOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int parse_op(const char *name)
+{
+    for (int op = 0; op < NUM_OP_CODES; op++)
+        if (!strcmp(name, op_to_string(op)))
+            return op;
+    return -1;
+}
+
+/* Reads a line of the table. Returns false if it is not one. */
+static bool parse_line(char *line, struct fusion *f)
+{
+    char *tok, *end;
+    int op;
+
+    f->len = 0;
+    for (tok = strtok(line, " \t\n"); tok; tok = strtok(NULL, " \t\n")) {
+        if (isdigit((unsigned char)*tok))
+            break;
+        if ((op = parse_op(tok)) == -1 || f->len == FUSED_MAX_INSNS)
+            return false;
+        f->ops[f->len++] = op;
+    }
+    if (f->len < 2 || !tok)
+        return false;
+
+    f->count = strtoull(tok, &end, 10);
+    return !*end;
+}
+
+static void read_profile(const char *path)
+{
+    char line[256];
+    struct fusion f;
+    bool table = false;
+    int i;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r"))) {
+        perror(path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof line, fp) && num_rows < MAX_ROWS) {
+        if (!table) {
+            table = !strncmp(line, "sequence ", 9);
+            continue;
+        }
+        if (line[0] == '\n')
+            break;
+        if (!parse_line(line, &f)) {
+            line[strcspn(line, "\n")] = '\0';
+            fprintf(stderr, "ERROR: %s: Bad sequence '%s'\n", path, line);
+            exit(1);
+        }
+
+        for (i = 0; i < f.len - 1 && fusable(f.ops[i]); i++)
+            ;
+        if (i == f.len - 1)
+            rows[num_rows++] = f;
+    }
+
+    if (ferror(fp) || !table) {
+        fprintf(stderr, "ERROR: %s: No table of sequences\n", path);
+        exit(1);
+    }
+    fclose(fp);
+}
+
+/* Whether the ops of `f` appear in `g` */
+static bool within(const struct fusion *f, const struct fusion *g)
+{
+    for (int i = 0; i + f->len <= g->len; i++)
+        if (!memcmp(&g->ops[i], f->ops, f->len * sizeof *f->ops))
+            return true;
+    return false;
+}
+
+/* Picks the rows to fuse, leaving out those which only run within others */
+static void pick(void)
+{
+    int i, j;
+
+    for (i = 0; i < num_rows && num_fusions < FUSED_MAX; i++) {
+        for (j = 0; j < num_rows; j++)
+            if (rows[j].len > rows[i].len && rows[j].count >= rows[i].count &&
+                    within(&rows[i], &rows[j]))
+                break;
+        if (j == num_rows)
+            fusions[num_fusions++] = rows[i];
+    }
+}
+
+/* The decoder takes the first which matches, so longer ones go first */
+static int by_len(const void *a, const void *b)
+{
+    const struct fusion *x = a, *y = b;
+
+    if (x->len != y->len)
+        return y->len - x->len;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static void upper(FILE *fp, enum opcode op)
+{
+    for (const char *p = op_to_string(op); *p; p++)
+        fputc(toupper((unsigned char)*p), fp);
+}
+
+/* Writes the name of a superinstruction. Returns its length. */
+static int name(FILE *fp, const struct fusion *f)
+{
+    int len = fprintf(fp, "OP_FUSED");
+
+    for (int i = 0; i < f->len; i++) {
+        fputc('_', fp);
+        upper(fp, f->ops[i]);
+        len += 1 + strlen(op_to_string(f->ops[i]));
+    }
+    return len;
+}
+
+static void comment(FILE *fp, const struct fusion *f)
+{
+    fputs("/*", fp);
+    for (int i = 0; i < f->len; i++)
+        fprintf(fp, " %s", op_to_string(f->ops[i]));
+    fprintf(fp, ", %llu times in the profile */", f->count);
+}
+
+static FILE *create(const char *path)
+{
+    FILE *fp;
+
+    if (!(fp = fopen(path, "w"))) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(fp, "/* Generated by fusegen.c, do not edit */\n");
+    return fp;
+}
+
+static void finish(FILE *fp, const char *path)
+{
+    if (ferror(fp) | fclose(fp)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+static void write_header(const char *path)
+{
+    FILE *fp = create(path);
+    int len;
+
+    fprintf(fp, "#ifndef SYNACOR_FUSED_H__\n#define SYNACOR_FUSED_H__\n\n");
+    fprintf(fp, "#define NUM_FUSED %d\n#define FUSED_MAX_INSNS %d\n\n",
+        num_fusions, FUSED_MAX_INSNS);
+
+    if (num_fusions) {
+        fprintf(fp, "enum {\n");
+        for (int i = 0; i < num_fusions; i++) {
+            len = fprintf(fp, "    ") + name(fp, &fusions[i]);
+            len += fprintf(fp, "%s,", i ? "" : " = OP_FUSED");
+            fprintf(fp, "%*s", len < 40 ? 40 - len : 1, "");
+            comment(fp, &fusions[i]);
+            fputc('\n', fp);
+        }
+        fprintf(fp, "};\n\n");
+    }
+
+    fprintf(fp, "/* Applies X() to every superinstruction */\n#define FUSED_OPS(X)");
+    for (int i = 0; i < num_fusions; i++) {
+        fputs(" X(", fp);
+        name(fp, &fusions[i]);
+        fputc(')', fp);
+    }
+
+    /* An extra row of NUM_OP_CODES keeps the table from being empty */
+    fprintf(fp, "\n\n#ifdef FUSED_PATTERNS\n"
+        "/* The op codes of each, NUM_OP_CODES after the last of a short one */\n"
+        "static const uint8_t fused_ops[NUM_FUSED + 1][FUSED_MAX_INSNS] = {\n");
+    for (int i = 0; i <= num_fusions; i++) {
+        fputs("    {", fp);
+        for (int j = 0; j < FUSED_MAX_INSNS; j++) {
+            fputs(j ? ", " : " ", fp);
+            if (i < num_fusions && j < fusions[i].len)
+                upper(fp, fusions[i].ops[j]);
+            else
+                fputs("NUM_OP_CODES", fp);
+        }
+        fputs(" },\n", fp);
+    }
+    fprintf(fp, "};\n#endif\n\n#endif /* SYNACOR_FUSED_H__ */\n");
+
+    finish(fp, path);
+}
+
+static void write_handlers(const char *path)
+{
+    FILE *fp = create(path);
+    const struct fusion *f;
+
+    for (int i = 0; i < num_fusions; i++) {
+        f = &fusions[i];
+        fputc('\n', fp);
+        comment(fp, f);
+        fputs("\nTARGET(", fp);
+        name(fp, f);
+        fputs(") {\n", fp);
+        for (int j = 0; j < f->len - 1; j++) {
+            fputs("    DO_", fp);
+            upper(fp, f->ops[j]);
+            fputs("();\n    FUSED_NEXT();\n", fp);
+        }
+        fputs("    FUSED_TAIL(", fp);
+        upper(fp, f->ops[f->len - 1]);
+        fputs(");\n}\n", fp);
+    }
+
+    finish(fp, path);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4) {
+        printf("Usage: %s <profile> <fused.h> <fused_handlers.h>\n", argv[0]);
+        exit(1);
+    }
+
+    read_profile(argv[1]);
+    pick();
+    qsort(fusions, num_fusions, sizeof *fusions, by_len);
+    write_header(argv[2]);
+    write_handlers(argv[3]);
+    return 0;
+}
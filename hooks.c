@@ -0,0 +1,229 @@
+/*
+ * Native hooks for guest routines. A `call` to a hooked address runs the
+ * hook instead of the routine and continues right after the `call`, as if
+ * the routine had returned. The whole routine then counts as the one `call`
+ * against the instruction budget.
+ *
+ * In verify mode every hooked call also runs the guest routine, on a copy
+ * of the VM, and stops with SYN_TRAP_HOOK unless both leave registers,
+ * stack and memory the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "vm.h"
+
+struct hook {
+    syn_hook_fn fn;
+    void *ctx;
+};
+
+/*
+ * The teleporter confirmation routine of challenge.bin (6027): a variant of
+ * the Ackermann function in 15-bit arithmetic, with r7 taking the place of
+ * 1 in A(m, 0) = A(m - 1, 1). The routine leaves its result in r0, and r1
+ * one below it, as the last thing it runs is `add r0 r1 1`.
+ */
+static int hook_ackermann(syn_vm *vm, void *ctx)
+{
+    uint16_t m = syn_reg(vm, 0), n = syn_reg(vm, 1), k = syn_reg(vm, 7);
+    uint16_t *prev, *row, *tmp, result;
+
+    (void)ctx;
+
+    if (!(prev = malloc(2 * (MAX_INT + 1) * sizeof *prev)))
+        return -1;
+    row = prev + MAX_INT + 1;
+
+    for (uint32_t i = 0; i <= MAX_INT; i++)
+        prev[i] = (i + 1) & MAX_INT;
+
+    /* row[i] = A(level, i), computed from prev[i] = A(level - 1, i) */
+    for (uint16_t level = 1; level <= m; level++) {
+        row[0] = prev[k];
+        for (uint32_t i = 1; i <= MAX_INT; i++)
+            row[i] = prev[row[i - 1]];
+        tmp = prev;
+        prev = row;
+        row = tmp;
+    }
+
+    result = prev[n];
+    free(prev < row ? prev : row);
+
+    syn_set_reg(vm, 0, result);
+    syn_set_reg(vm, 1, (result - 1) & MAX_INT);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    syn_hook_fn fn;
+} builtin_hooks[] = {
+    { "ackermann", hook_ackermann },
+};
+
+void hooks_free(struct vm *vm)
+{
+    if (vm->hooks)
+        for (uint32_t addr = 0; addr <= MAX_INT; addr++)
+            free(vm->hooks[addr]);
+    free(vm->hooks);
+    vm_free(vm->verify_vm);
+}
+
+/* Runs the guest routine on a copy of the VM as it was before the hook */
+static bool guest_agrees(struct vm *vm, const syn_snapshot *before, uint16_t target)
+{
+    struct vm *g = vm->verify_vm;
+
+    if (!g) {
+        if (!(g = vm->verify_vm = vm_new()))
+            return false;
+        syn_output_memory(g);
+        syn_input_memory(g, "", 0);
+    }
+
+    /* Returning to MAX_INT ends the run with SYN_END */
+    syn_set_engine(g, vm->engine);
+    if (syn_snapshot_restore(g, before) || syn_push(g, MAX_INT))
+        return false;
+    g->mem_offset = target;
+    g->status = SYN_OK;
+
+    if (syn_run(g, SYN_RUN_FOREVER) != SYN_END || g->mem_offset != MAX_INT)
+        return false;
+    syn_output_clear(g);
+
+    return !memcmp(g->memory, vm->memory, VM_MEMORY_SIZE) &&
+        !memcmp(g->regs, vm->regs, REG_NUM * sizeof *vm->regs) &&
+        g->prog_stack->count == vm->prog_stack->count &&
+        !memcmp(g->prog_stack->buffer, vm->prog_stack->buffer,
+            vm->prog_stack->count * sizeof *vm->prog_stack->buffer);
+}
+
+bool vm_hook(struct vm *vm, uint16_t target, uint16_t next)
+{
+    struct hook *h;
+    syn_snapshot *before;
+
+    /* A target from a register may be past memory, where the engine stops */
+    if (target > MAX_INT)
+        return false;
+
+    h = vm->hooks ? vm->hooks[target] : NULL;
+    if (!h)
+        return vm->memo && memo_call(vm, target, next);
+
+    vm->mem_offset = next;
+    if (!vm->verify_hooks)
+        return !h->fn(vm, h->ctx);
+
+    if (!(before = syn_snapshot_take(vm)))
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+
+    if (h->fn(vm, h->ctx)) {
+        syn_snapshot_free(before);
+        return false;
+    }
+
+    if (!guest_agrees(vm, before, target)) {
+        syn_snapshot_free(before);
+        vm_stop(vm, SYN_TRAP_HOOK, target);
+    }
+
+    syn_snapshot_free(before);
+    return true;
+}
+
+bool vm_call_hooked(struct vm *vm, uint16_t addr)
+{
+    if (addr > MAX_INT)
+        return false;
+    return (vm->hooks && vm->hooks[addr]) || (vm->memo && memo_pure(vm, addr));
+}
+
+/* Public interface */
+
+int syn_hook(syn_vm *vm, uint16_t addr, syn_hook_fn fn, void *ctx)
+{
+    struct hook *h;
+
+    if (addr > MAX_INT) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!vm->hooks && !(vm->hooks = calloc(MAX_INT + 1, sizeof *vm->hooks)))
+        return -1;
+
+    if (!fn) {
+        h = NULL;
+    } else if (!(h = malloc(sizeof *h))) {
+        return -1;
+    } else {
+        h->fn = fn;
+        h->ctx = ctx;
+    }
+
+    free(vm->hooks[addr]);
+    vm->hooks[addr] = h;
+
+    /* Translated code calls routines directly */
+    vm_drop_caches(vm);
+    return 0;
+}
+
+syn_hook_fn syn_builtin_hook(const char *name)
+{
+    for (size_t i = 0; i < sizeof builtin_hooks / sizeof *builtin_hooks; i++)
+        if (!strcmp(builtin_hooks[i].name, name))
+            return builtin_hooks[i].fn;
+    return NULL;
+}
+
+int syn_load_hooks(syn_vm *vm, const char *path)
+{
+    char line[256], name[64];
+    unsigned long addr;
+    syn_hook_fn fn;
+    int lineno = 0;
+    char *p, *end;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r")))
+        return -1;
+
+    while (fgets(line, sizeof line, fp)) {
+        lineno++;
+
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        for (p = line; isspace((unsigned char)*p); p++)
+            ;
+        if (!*p)
+            continue;
+
+        addr = strtoul(p, &end, 0);
+        if (end == p || addr > MAX_INT || sscanf(end, "%63s", name) != 1 ||
+                !(fn = syn_builtin_hook(name)) || syn_hook(vm, addr, fn, NULL)) {
+            fclose(fp);
+            return lineno;
+        }
+    }
+
+    if (ferror(fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+void syn_verify_hooks(syn_vm *vm, int on)
+{
+    vm->verify_hooks = on;
+}
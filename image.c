@@ -0,0 +1,149 @@
+/*
+ * Shared memory images. Every distinct image the VMs of a process load or
+ * restore is kept once, in an anonymous file (memfd), which the VMs map
+ * privately over their memory: reads go to the file's pages, and the
+ * kernel copies a page for a VM the first time it writes there. A VM's own
+ * memory is then only the pages its guest has written, however many VMs run
+ * the same image.
+ *
+ * Images are found by their words, through a hash, and counted: the last
+ * reference to go removes one from the list. Mappings hold on to the file
+ * themselves, so they outlive it.
+ */
+#define _GNU_SOURCE             /* memfd_create() */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vm.h"
+#include "image.h"
+
+struct image {
+    uint64_t hash;
+    int fd;
+    const uint16_t *words;      /* a shared read-only mapping, to compare */
+    unsigned refs;
+    struct image *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct image *images;
+static bool unavailable;        /* memfd_create() does not work here */
+
+/* FNV-1a, a word of 64 bits at a time */
+static uint64_t hash(const uint16_t *memory)
+{
+    uint64_t h = 0xcbf29ce484222325, w;
+
+    for (size_t i = 0; i < VM_MEMORY_SIZE; i += sizeof w) {
+        memcpy(&w, (const char *)memory + i, sizeof w);
+        h = (h ^ w) * 0x100000001b3;
+    }
+    return h;
+}
+
+static struct image *create(const uint16_t *memory, uint64_t h)
+{
+    struct image *img;
+    void *words = MAP_FAILED;
+    int fd;
+
+    if ((fd = memfd_create("synacor-image", MFD_CLOEXEC)) == -1) {
+        if (errno == ENOSYS || errno == EINVAL)
+            unavailable = true;
+        return NULL;
+    }
+    if (write(fd, memory, VM_MEMORY_SIZE) != (ssize_t)VM_MEMORY_SIZE ||
+            (words = mmap(NULL, VM_MEMORY_SIZE, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+            !(img = malloc(sizeof *img))) {
+        if (words != MAP_FAILED)
+            munmap(words, VM_MEMORY_SIZE);
+        close(fd);
+        return NULL;
+    }
+
+    img->hash = h;
+    img->fd = fd;
+    img->words = words;
+    img->refs = 0;
+    img->next = images;
+    images = img;
+    return img;
+}
+
+/* image_get() with the lock held */
+static struct image *get(const uint16_t *memory)
+{
+    struct image *img;
+    uint64_t h;
+
+    if (unavailable)
+        return NULL;
+
+    h = hash(memory);
+    for (img = images; img; img = img->next)
+        if (img->hash == h && !memcmp(img->words, memory, VM_MEMORY_SIZE))
+            break;
+    if (!img && !(img = create(memory, h)))
+        return NULL;
+
+    img->refs++;
+    return img;
+}
+
+struct image *image_get(const uint16_t *memory)
+{
+    struct image *img;
+
+    pthread_mutex_lock(&lock);
+    img = get(memory);
+    pthread_mutex_unlock(&lock);
+    return img;
+}
+
+struct image *image_get_once(struct image **slot, const uint16_t *memory)
+{
+    struct image *img;
+
+    pthread_mutex_lock(&lock);
+    if ((img = *slot))
+        img->refs++;
+    else if ((img = *slot = get(memory)))
+        img->refs++;
+    pthread_mutex_unlock(&lock);
+    return img;
+}
+
+void image_put(struct image *img)
+{
+    struct image **p;
+
+    if (!img)
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (--img->refs) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    for (p = &images; *p != img; p = &(*p)->next)
+        ;
+    *p = img->next;
+    pthread_mutex_unlock(&lock);
+
+    munmap((void *)img->words, VM_MEMORY_SIZE);
+    close(img->fd);
+    free(img);
+}
+
+int image_map(const struct image *img, uint16_t *memory)
+{
+    if (mmap(memory, VM_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, img->fd, 0) == MAP_FAILED)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef SYNACOR_IMAGE_H__
+#define SYNACOR_IMAGE_H__
+
+#include <stdint.h>
+
+/*
+ * Memory images shared by all VMs of the process (image.c). An image is a
+ * full memory's worth of words, held once however many VMs map it; a VM's
+ * pages stay the image's until the VM writes them.
+ */
+struct image;
+
+/*
+ * Returns a reference to the image holding `memory`, MAX_INT + 1 words,
+ * which is created unless one with the same words is held already. Returns
+ * NULL if images cannot be shared here.
+ */
+struct image *image_get(const uint16_t *memory);
+
+/*
+ * Like image_get() for `*slot`, which keeps the image it gets: the first
+ * call fills it in, later ones share what it holds. Returns a reference of
+ * the caller's own, or NULL. Safe to call from any thread.
+ */
+struct image *image_get_once(struct image **slot, const uint16_t *memory);
+
+/* Drops a reference. NULL is ignored. */
+void image_put(struct image *img);
+
+/*
+ * Maps the image over `memory`, MAX_INT + 1 words, privately: the first
+ * write to a page copies it. Returns 0, or -1 with errno set.
+ */
+int image_map(const struct image *img, uint16_t *memory);
+
+#endif /* SYNACOR_IMAGE_H__ */
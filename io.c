@@ -0,0 +1,226 @@
+/*
+ * Guest I/O. `out` only appends to a buffer in the VM, which goes to the
+ * sink when it is full, when the guest waits for input and when a run
+ * returns. `in` takes characters from the input queue, which is refilled
+ * from the source a chunk at a time, i.e. a line from a terminal or up to
+ * VM_IO_SIZE bytes of a file or pipe per read().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "vm.h"
+
+static void write_fd(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        if ((n = write(fd, data, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return;             /* dropped, like putchar() did */
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+int vm_write(struct vm *vm, const char *data, size_t len)
+{
+    char *output;
+    size_t size;
+
+    switch (vm->sink) {
+        case IO_FD:
+            write_fd(vm->sink_fd, data, len);
+            break;
+        case IO_MEMORY:
+            if (vm->output_len + len > vm->output_size) {
+                size = vm->output_size ? vm->output_size : VM_IO_SIZE;
+                while (size < vm->output_len + len)
+                    size *= 2;
+                if (!(output = realloc(vm->output, size)))
+                    return -1;
+                vm->output = output;
+                vm->output_size = size;
+            }
+            memcpy(vm->output + vm->output_len, data, len);
+            vm->output_len += len;
+            break;
+        case IO_CALLBACK:
+            vm->write(vm->write_ctx, data, len);
+            break;
+    }
+
+    return 0;
+}
+
+int vm_flush(struct vm *vm)
+{
+    if (!vm->out_len)
+        return 0;
+    if (vm_write(vm, vm->out_buf, vm->out_len))
+        return -1;
+    vm->stats.output_bytes += vm->out_len;
+    vm->out_len = 0;
+    return 0;
+}
+
+/* Reads the next chunk of the source into the empty queue. Returns its size. */
+static size_t fill(struct vm *vm, uint16_t pc)
+{
+    size_t n = 0;
+    ssize_t got;
+    char *input;
+
+    if (vm->input_size < VM_IO_SIZE) {
+        if (!(input = realloc(vm->input, VM_IO_SIZE))) {
+            vm->mem_offset = pc;
+            vm_stop(vm, SYN_TRAP_NOMEM, 0);
+        }
+        vm->input = input;
+        vm->input_size = VM_IO_SIZE;
+    }
+
+    switch (vm->source) {
+        case IO_FD:
+            while ((got = read(vm->source_fd, vm->input, vm->input_size)) == -1 &&
+                    errno == EINTR)
+                ;
+            n = got > 0 ? got : 0;
+            break;
+        case IO_MEMORY:
+            n = vm->script_len - vm->script_pos;
+            if (n > vm->input_size)
+                n = vm->input_size;
+            memcpy(vm->input, vm->script + vm->script_pos, n);
+            vm->script_pos += n;
+            break;
+        case IO_CALLBACK:
+            n = vm->read(vm->read_ctx, vm->input, vm->input_size);
+            break;
+    }
+
+    vm->input_pos = 0;
+    vm->input_len = n;
+    return n;
+}
+
+uint16_t vm_input(struct vm *vm, uint16_t pc)
+{
+    size_t n;
+
+    if (vm->input_pos == vm->input_len) {
+        if (vm->stop_at_input) {
+            vm->mem_offset = pc;
+            vm_stop(vm, SYN_INPUT, 0);
+        }
+
+        if (vm_flush(vm)) {
+            vm->mem_offset = pc;
+            vm_stop(vm, SYN_TRAP_NOMEM, 0);
+        }
+
+        /* Reading may take a while, for a player to type a line */
+        stats_pause(vm);
+        n = fill(vm, pc);
+        stats_resume(vm);
+
+        /* The end of input reads as getchar()'s EOF */
+        if (!n)
+            return (uint16_t)EOF;
+    }
+
+    vm->stats.input_bytes++;
+    return (unsigned char)vm->input[vm->input_pos++];
+}
+
+/* Public interface */
+
+int syn_input(syn_vm *vm, const char *data, size_t len)
+{
+    size_t left = vm->input_len - vm->input_pos;
+    char *input;
+
+    /* Consumed input is dropped first */
+    if (vm->input_pos) {
+        memmove(vm->input, vm->input + vm->input_pos, left);
+        vm->input_pos = 0;
+        vm->input_len = left;
+    }
+
+    if (left + len > vm->input_size) {
+        if (!(input = realloc(vm->input, left + len)))
+            return -1;
+        vm->input = input;
+        vm->input_size = left + len;
+    }
+
+    memcpy(vm->input + left, data, len);
+    vm->input_len += len;
+    return 0;
+}
+
+void syn_input_fd(syn_vm *vm, int fd)
+{
+    vm->source = IO_FD;
+    vm->source_fd = fd;
+}
+
+int syn_input_memory(syn_vm *vm, const char *data, size_t len)
+{
+    char *script;
+
+    if (!(script = malloc(len ? len : 1)))
+        return -1;
+    memcpy(script, data, len);
+
+    free(vm->script);
+    vm->script = script;
+    vm->script_len = len;
+    vm->script_pos = 0;
+    vm->source = IO_MEMORY;
+    return 0;
+}
+
+void syn_input_callback(syn_vm *vm, syn_read_fn read, void *ctx)
+{
+    vm->source = IO_CALLBACK;
+    vm->read = read;
+    vm->read_ctx = ctx;
+}
+
+void syn_output_fd(syn_vm *vm, int fd)
+{
+    vm_flush(vm);
+    vm->sink = IO_FD;
+    vm->sink_fd = fd;
+}
+
+void syn_output_memory(syn_vm *vm)
+{
+    vm_flush(vm);
+    vm->sink = IO_MEMORY;
+}
+
+void syn_output_callback(syn_vm *vm, syn_write_fn write, void *ctx)
+{
+    vm_flush(vm);
+    vm->sink = IO_CALLBACK;
+    vm->write = write;
+    vm->write_ctx = ctx;
+}
+
+const char *syn_output_data(const syn_vm *vm, size_t *len)
+{
+    *len = vm->output_len;
+    return vm->output;
+}
+
+void syn_output_clear(syn_vm *vm)
+{
+    vm->output_len = 0;
+}
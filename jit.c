@@ -0,0 +1,1062 @@
+/*
+ * Basic-block JIT for x86-64 hosts.
+ *
+ * Blocks are discovered lazily from the program counter the dispatcher asks
+ * for and end at the first jump, call, ret, at an instruction the JIT leaves
+ * to the interpreter (halt, in, out and anything that would fault), or after
+ * MAX_BLOCK_INSNS instructions. While translated code runs, the eight guest
+ * registers live in host registers; they are loaded from and stored back to
+ * the interpreter's register file on every entry and exit.
+ *
+ * Each VM has its own struct jit with its own code cache, and the generated
+ * code refers to that VM's memory, stack and tables by absolute address.
+ *
+ * Every block exit with a known target is a `jmp rel32` which first points
+ * at a small stub returning the target to the dispatcher. Once a block
+ * exists for the target the jump is patched to go there directly, and it is
+ * patched back when that block is discarded. Indirect jumps (ret, or jmp,
+ * call, jt and jf through a register) go through the entry[] table, which
+ * holds the code of the live block at each address or the common exit.
+ *
+ * The code cache is never writable and executable at the same time. wmem
+ * goes through jit_wmem(), which discards all blocks covering the written
+ * word; the block doing the write then returns to the dispatcher.
+ *
+ * Every block stores its start in vm->live_pc as it is entered, which is
+ * where the sampler finds the guest while translated code runs.
+ *
+ * The VM's instruction budget lives in r10 while translated code runs. A
+ * block takes all of its instructions from it on entry and gives back
+ * whatever it did not run when it leaves early. A block which does not fit
+ * into the budget has the dispatcher interpret its first instruction
+ * instead.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arch.h"
+#include "decode.h"
+#include "jit.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define CODE_CACHE_SIZE (8 << 20)
+#define MAX_BLOCK_INSNS 64
+#define MAX_BLOCK_WORDS (MAX_BLOCK_INSNS * 4)
+#define MAX_BLOCK_EXITS (2 * MAX_BLOCK_INSNS + 1)
+#define MAX_INSN_BYTES  256     /* generous upper bound for one instruction */
+#define MAX_BLOCKS      65536
+
+enum host_reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/*
+ * Only six callee-saved registers exist, so r6 and r7 live in r8 and r9 and
+ * are saved around calls into C, as is the budget in r10.
+ */
+static const uint8_t host_reg[REG_NUM] = { RBX, RBP, R12, R13, R14, R15, R8, R9 };
+#define BUDGET R10
+
+/* Condition codes */
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_BE 0x6
+#define CC_A  0x7
+
+/* Group 1 ALU opcode extensions */
+#define ALU_ADD 0
+#define ALU_OR  1
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_CMP 7
+
+/* Two-operand ALU opcodes, r/m32 <- r/m32 op r32 */
+#define OPC_ADD  0x01
+#define OPC_OR   0x09
+#define OPC_AND  0x21
+#define OPC_XOR  0x31
+#define OPC_CMP  0x39
+#define OPC_MOV  0x89
+#define OPC_TEST 0x85
+
+struct block {
+    uint8_t *code;
+    uint16_t start;
+    uint16_t end;
+    bool live;
+};
+
+struct exit {
+    uint8_t *site;      /* rel32 of the exit's jmp */
+    uint8_t *stub;      /* returns `target` to the dispatcher */
+    int next;           /* next exit to the same target, or -1 */
+};
+
+typedef uint32_t (*enter_fn)(uint16_t *regs, void *code);
+
+/* An early exit giving back the instructions of its block it did not run */
+struct refund {
+    uint8_t *imm;
+    int ran;            /* instructions of the block run before leaving */
+};
+
+/* Everything one VM's JIT owns; the generated code points into it */
+struct jit {
+    struct vm *vm;
+    uint16_t *memory;
+    uint16_t *regs;
+    stack *prog_stack;
+    uint64_t *budget;
+
+    uint8_t *code_base, *code_ptr, *code_end;
+    enter_fn enter;
+    uint8_t *common_exit;
+    uint8_t *blocks_start;      /* everything before this survives a flush */
+
+    void *entry[ICACHE_SIZE];
+    struct block *block_at[ICACHE_SIZE];
+    uint16_t code_cover[ICACHE_SIZE];
+
+    struct block blocks[MAX_BLOCKS];
+    size_t num_blocks;
+
+    struct exit *exits;
+    size_t num_exits, max_exits;
+    int exit_head[ICACHE_SIZE];
+
+    /*
+     * Set once mprotect() or realloc() fails. The code cache may then be
+     * neither executable nor writable, and the next jit_lookup() stops the
+     * run instead of entering it.
+     */
+    bool failed;
+
+    /* The block being translated */
+    int done;                   /* instructions before the current one */
+    struct refund refunds[2 * MAX_BLOCK_INSNS];
+    size_t num_refunds;
+};
+
+/* Instruction encoding */
+
+static void emit8(struct jit *j, uint8_t b)
+{
+    *j->code_ptr++ = b;
+}
+
+static void emit32(struct jit *j, uint32_t v)
+{
+    memcpy(j->code_ptr, &v, sizeof v);
+    j->code_ptr += sizeof v;
+}
+
+static void emit64(struct jit *j, uint64_t v)
+{
+    memcpy(j->code_ptr, &v, sizeof v);
+    j->code_ptr += sizeof v;
+}
+
+static void rex(struct jit *j, bool w, int reg, int index, int base)
+{
+    uint8_t prefix = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+
+    if (prefix != 0x40)
+        emit8(j, prefix);
+}
+
+static void modrm(struct jit *j, int mod, int reg, int rm)
+{
+    emit8(j, mod << 6 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void sib(struct jit *j, int scale, int index, int base)
+{
+    emit8(j, scale << 6 | (index & 7) << 3 | (base & 7));
+}
+
+/* <op> dst32, src32 */
+static void alu_rr(struct jit *j, uint8_t opc, int dst, int src)
+{
+    rex(j, false, src, 0, dst);
+    emit8(j, opc);
+    modrm(j, 3, src, dst);
+}
+
+/* <op> dst32, imm32 */
+static void alu_ri(struct jit *j, int ext, int dst, uint32_t imm)
+{
+    rex(j, false, 0, 0, dst);
+    emit8(j, 0x81);
+    modrm(j, 3, ext, dst);
+    emit32(j, imm);
+}
+
+static void mov_rr(struct jit *j, int dst, int src)
+{
+    if (dst != src)
+        alu_rr(j, OPC_MOV, dst, src);
+}
+
+static void mov_ri(struct jit *j, int dst, uint32_t imm)
+{
+    rex(j, false, 0, 0, dst);
+    emit8(j, 0xb8 + (dst & 7));
+    emit32(j, imm);
+}
+
+static void mov_ri64(struct jit *j, int dst, uint64_t imm)
+{
+    rex(j, true, 0, 0, dst);
+    emit8(j, 0xb8 + (dst & 7));
+    emit64(j, imm);
+}
+
+static void imul_rr(struct jit *j, int dst, int src)
+{
+    rex(j, false, dst, 0, src);
+    emit8(j, 0x0f);
+    emit8(j, 0xaf);
+    modrm(j, 3, dst, src);
+}
+
+/* not (ext 2) and div (ext 6) */
+static void unary(struct jit *j, int ext, int reg)
+{
+    rex(j, false, 0, 0, reg);
+    emit8(j, 0xf7);
+    modrm(j, 3, ext, reg);
+}
+
+/* set<cc> al; movzx dst32, al */
+static void setcc(struct jit *j, uint8_t cc, int dst)
+{
+    emit8(j, 0x0f);
+    emit8(j, 0x90 + cc);
+    modrm(j, 3, 0, RAX);
+    rex(j, false, dst, 0, RAX);
+    emit8(j, 0x0f);
+    emit8(j, 0xb6);
+    modrm(j, 3, dst, RAX);
+}
+
+/* movzx dst32, word [base + index * 2] */
+static void load16_idx(struct jit *j, int dst, int base, int index)
+{
+    rex(j, false, dst, index, base);
+    emit8(j, 0x0f);
+    emit8(j, 0xb7);
+    modrm(j, 0, dst, RSP);
+    sib(j, 1, index, base);
+}
+
+/* mov word [base + index * 2], src16 */
+static void store16_idx(struct jit *j, int src, int base, int index)
+{
+    emit8(j, 0x66);
+    rex(j, false, src, index, base);
+    emit8(j, 0x89);
+    modrm(j, 0, src, RSP);
+    sib(j, 1, index, base);
+}
+
+/* movzx dst32, word [base + disp8] */
+static void load16_disp(struct jit *j, int dst, int base, int8_t disp)
+{
+    rex(j, false, dst, 0, base);
+    emit8(j, 0x0f);
+    emit8(j, 0xb7);
+    modrm(j, 1, dst, base);
+    emit8(j, disp);
+}
+
+/* mov word [base + disp8], src16 */
+static void store16_disp(struct jit *j, int src, int base, int8_t disp)
+{
+    emit8(j, 0x66);
+    rex(j, false, src, 0, base);
+    emit8(j, 0x89);
+    modrm(j, 1, src, base);
+    emit8(j, disp);
+}
+
+/* mov word [addr], imm16, through r11 */
+static void store16_abs(struct jit *j, const volatile void *addr, uint16_t imm)
+{
+    mov_ri64(j, R11, (uintptr_t)addr);
+    emit8(j, 0x66);
+    rex(j, false, 0, 0, R11);
+    emit8(j, 0xc7);
+    modrm(j, 0, 0, R11);
+    emit8(j, imm & 0xff);
+    emit8(j, imm >> 8);
+}
+
+/* mov dst64, [base + disp8] (load) or mov [base + disp8], dst64 (store) */
+static void mov64_mem(struct jit *j, bool store, int reg, int base, int8_t disp)
+{
+    rex(j, true, reg, 0, base);
+    emit8(j, store ? 0x89 : 0x8b);
+    modrm(j, 1, reg, base);
+    emit8(j, disp);
+}
+
+/* cmp reg64, [base + disp8] */
+static void cmp64_mem(struct jit *j, int reg, int base, int8_t disp)
+{
+    rex(j, true, reg, 0, base);
+    emit8(j, 0x3b);
+    modrm(j, 1, reg, base);
+    emit8(j, disp);
+}
+
+/* <op> reg64, imm32. Returns where the immediate lives. */
+static uint8_t *alu64_ri(struct jit *j, int ext, int reg, uint32_t imm)
+{
+    rex(j, true, 0, 0, reg);
+    emit8(j, 0x81);
+    modrm(j, 3, ext, reg);
+    emit32(j, imm);
+    return j->code_ptr - 4;
+}
+
+/* add reg64, imm8 */
+static void add64_i8(struct jit *j, int reg, int8_t imm)
+{
+    rex(j, true, 0, 0, reg);
+    emit8(j, 0x83);
+    modrm(j, 3, 0, reg);
+    emit8(j, imm);
+}
+
+static void push_r(struct jit *j, int reg)
+{
+    rex(j, false, 0, 0, reg);
+    emit8(j, 0x50 + (reg & 7));
+}
+
+static void pop_r(struct jit *j, int reg)
+{
+    rex(j, false, 0, 0, reg);
+    emit8(j, 0x58 + (reg & 7));
+}
+
+static void call_r(struct jit *j, int reg)
+{
+    rex(j, false, 0, 0, reg);
+    emit8(j, 0xff);
+    modrm(j, 3, 2, reg);
+}
+
+/* jmp qword [base + index * 8] */
+static void jmp_table(struct jit *j, int base, int index)
+{
+    rex(j, false, 0, index, base);
+    emit8(j, 0xff);
+    modrm(j, 0, 4, RSP);
+    sib(j, 3, index, base);
+}
+
+/* Emits a jump with a zero displacement and returns where the rel32 lives */
+static uint8_t *jmp32(struct jit *j)
+{
+    emit8(j, 0xe9);
+    emit32(j, 0);
+    return j->code_ptr - 4;
+}
+
+static uint8_t *jcc32(struct jit *j, uint8_t cc)
+{
+    emit8(j, 0x0f);
+    emit8(j, 0x80 + cc);
+    emit32(j, 0);
+    return j->code_ptr - 4;
+}
+
+static void patch_rel32(uint8_t *site, const uint8_t *target)
+{
+    int32_t rel = target - (site + 4);
+
+    memcpy(site, &rel, sizeof rel);
+}
+
+static void patch_imm32(uint8_t *site, uint32_t imm)
+{
+    memcpy(site, &imm, sizeof imm);
+}
+
+/* Code cache management */
+
+/* Returns false if the JIT has failed, see struct jit */
+static bool set_writable(struct jit *j, bool writable)
+{
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+
+    if (!j->failed && mprotect(j->code_base, CODE_CACHE_SIZE, prot))
+        j->failed = true;
+    return !j->failed;
+}
+
+/* Drops every block. Only called from the dispatcher, never from JIT code. */
+static void flush(struct jit *j)
+{
+    for (uint32_t pc = 0; pc < ICACHE_SIZE; pc++) {
+        j->entry[pc] = j->common_exit;
+        j->block_at[pc] = NULL;
+        j->code_cover[pc] = 0;
+        j->exit_head[pc] = -1;
+    }
+
+    j->num_blocks = 0;
+    j->num_exits = 0;
+    j->code_ptr = j->blocks_start;
+}
+
+/* Doubles the room of `array`. Returns NULL if out of memory, leaving it be. */
+static void *grow(void *array, size_t *max, size_t size)
+{
+    size_t n = *max ? *max * 2 : 1024;
+
+    if (!(array = realloc(array, n * size)))
+        return NULL;
+    *max = n;
+    return array;
+}
+
+/*
+ * Generates the entry trampoline, j->enter(regs, code), and the common exit,
+ * which expects the next program counter in eax.
+ */
+static void emit_trampolines(struct jit *j)
+{
+    static const uint8_t saved[] = { RBX, RBP, R12, R13, R14, R15, RDI };
+
+    j->enter = (enter_fn)j->code_ptr;
+    for (size_t i = 0; i < sizeof saved; i++)
+        push_r(j, saved[i]);
+    for (int r = 0; r < REG_NUM; r++)
+        load16_disp(j, host_reg[r], RDI, 2 * r);
+    mov_ri64(j, R11, (uintptr_t)j->budget);
+    mov64_mem(j, false, BUDGET, R11, 0);
+    emit8(j, 0xff);
+    modrm(j, 3, 4, RSI);                   /* jmp rsi */
+
+    j->common_exit = j->code_ptr;
+    rex(j, true, RDI, 0, RSP);
+    emit8(j, 0x8b);
+    modrm(j, 0, RDI, RSP);
+    sib(j, 0, RSP, RSP);                   /* mov rdi, [rsp] */
+    for (int r = 0; r < REG_NUM; r++)
+        store16_disp(j, host_reg[r], RDI, 2 * r);
+    mov_ri64(j, R11, (uintptr_t)j->budget);
+    mov64_mem(j, true, BUDGET, R11, 0);
+    for (size_t i = sizeof saved; i-- > 0; )
+        pop_r(j, saved[i]);
+    emit8(j, 0xc3);
+
+    j->blocks_start = j->code_ptr;
+}
+
+/* Helpers called from translated code */
+
+static int jit_wmem(uint32_t addr, uint32_t val, struct jit *j);
+
+/* Returns nonzero if out of memory, for the interpreter to report */
+static int jit_push(uint32_t val, struct vm *vm)
+{
+    return !vm_push(vm, val);
+}
+
+/* Calls a C helper with up to three arguments already in rdi, rsi and rdx */
+static void emit_call(struct jit *j, void *fn)
+{
+    push_r(j, R8);
+    push_r(j, R9);
+    push_r(j, BUDGET);
+    push_r(j, R11);                         /* keeps the stack aligned */
+    mov_ri64(j, RAX, (uintptr_t)fn);
+    call_r(j, RAX);
+    pop_r(j, R11);
+    pop_r(j, BUDGET);
+    pop_r(j, R9);
+    pop_r(j, R8);
+}
+
+/* Operands */
+
+static int guest_reg(const struct insn *in, int n)
+{
+#ifdef FOLDED_REGS
+    return host_reg[in->arg[n] - MIN_REG];
+#else
+    return host_reg[in->arg[n]];
+#endif
+}
+
+static bool is_reg_arg(const struct insn *in, int n)
+{
+    return in->kinds & (1 << n);
+}
+
+static void load_operand(struct jit *j, const struct insn *in, int n, int dst)
+{
+    if (is_reg_arg(in, n))
+        mov_rr(j, dst, guest_reg(in, n));
+    else
+        mov_ri(j, dst, in->arg[n]);
+}
+
+/* dst32 <op>= operand n */
+static void alu_operand(struct jit *j, uint8_t opc, int ext, int dst, const struct insn *in, int n)
+{
+    if (is_reg_arg(in, n))
+        alu_rr(j, opc, dst, guest_reg(in, n));
+    else
+        alu_ri(j, ext, dst, in->arg[n]);
+}
+
+/* Exits */
+
+/*
+ * Gives back the instructions of the block after the current one, and the
+ * current one too unless it `ran`. The amount is patched in once the block
+ * is complete.
+ */
+static void emit_refund(struct jit *j, bool ran)
+{
+    struct refund *r = &j->refunds[j->num_refunds++];
+
+    r->imm = alu64_ri(j, ALU_ADD, BUDGET, 0);
+    r->ran = j->done + ran;
+}
+
+/* Returns to the dispatcher at `pc`, never chained to a block */
+static void emit_leave(struct jit *j, uint16_t pc)
+{
+    mov_ri(j, RAX, pc);
+    patch_rel32(jmp32(j), j->common_exit);
+}
+
+/* Has the interpreter run the instruction at `pc`, which is about to fault */
+static void emit_fault(struct jit *j, uint16_t pc)
+{
+    emit_refund(j, false);
+    mov_ri(j, RAX, pc | JIT_INTERPRET);
+    patch_rel32(jmp32(j), j->common_exit);
+}
+
+/*
+ * emit_fault() if the flags give `cc`: a `mod` by 0, an address past memory
+ * or a push the stack has no room for
+ */
+static void emit_fault_if(struct jit *j, uint8_t cc, uint16_t pc)
+{
+    uint8_t *ok = jcc32(j, cc ^ 1);
+
+    emit_fault(j, pc);
+    patch_rel32(ok, j->code_ptr);
+}
+
+/*
+ * Continues at `target`, directly if a block for it exists. translate() has
+ * made room for the exit.
+ */
+static void emit_exit(struct jit *j, uint16_t target)
+{
+    struct block *b = j->block_at[target];
+    struct exit *e = &j->exits[j->num_exits];
+
+    e->site = jmp32(j);
+    e->stub = j->code_ptr;
+    emit_leave(j, target);
+    patch_rel32(e->site, b ? b->code : e->stub);
+
+    e->next = j->exit_head[target];
+    j->exit_head[target] = j->num_exits++;
+}
+
+/* Continues at the program counter in eax */
+static void emit_indirect(struct jit *j)
+{
+    mov_ri64(j, R11, (uintptr_t)j->entry);
+    jmp_table(j, R11, RAX);
+}
+
+/* Continues at operand n, which is either a register or a fixed address */
+static void emit_jump(struct jit *j, const struct insn *in, int n)
+{
+    if (is_reg_arg(in, n)) {
+        load_operand(j, in, n, RAX);
+        emit_indirect(j);
+    } else {
+        emit_exit(j, in->arg[n]);
+    }
+}
+
+/* Translation */
+
+/*
+ * Pushes operand n, or `ret_addr` for the `call` at `pc`. A stack which
+ * cannot grow leaves to the interpreter at `pc`.
+ */
+static void emit_push(struct jit *j, const struct insn *in, int n, uint16_t ret_addr,
+        uint16_t pc)
+{
+    uint8_t *slow, *lower, *done;
+
+    mov_ri64(j, RDI, (uintptr_t)j->prog_stack);
+    mov64_mem(j, false, RAX, RDI, offsetof(stack, count));
+    cmp64_mem(j, RAX, RDI, offsetof(stack, capacity));
+    slow = jcc32(j, CC_AE);
+    mov64_mem(j, false, RDX, RDI, offsetof(stack, buffer));
+    if (in)
+        load_operand(j, in, n, RCX);
+    else
+        mov_ri(j, RCX, ret_addr);
+    store16_idx(j, RCX, RDX, RAX);
+    add64_i8(j, RAX, 1);
+    mov64_mem(j, true, RAX, RDI, offsetof(stack, count));
+    mov_ri64(j, RDX, (uintptr_t)&j->vm->stats.stack_max);
+    cmp64_mem(j, RAX, RDX, 0);
+    lower = jcc32(j, CC_BE);
+    mov64_mem(j, true, RAX, RDX, 0);
+    patch_rel32(lower, j->code_ptr);
+    done = jmp32(j);
+
+    patch_rel32(slow, j->code_ptr);
+    if (in)
+        load_operand(j, in, n, RDI);
+    else
+        mov_ri(j, RDI, ret_addr);
+    mov_ri64(j, RSI, (uintptr_t)j->vm);
+    emit_call(j, (void *)jit_push);
+    alu_rr(j, OPC_TEST, RAX, RAX);
+    emit_fault_if(j, CC_NE, pc);
+    patch_rel32(done, j->code_ptr);
+}
+
+/*
+ * Pops the top of the guest stack into eax. An empty stack leaves to the
+ * interpreter at `pc`, which reports the underflow.
+ */
+static void emit_pop(struct jit *j, uint16_t pc)
+{
+    uint8_t *ok;
+
+    mov_ri64(j, RDI, (uintptr_t)j->prog_stack);
+    mov64_mem(j, false, RCX, RDI, offsetof(stack, count));
+    rex(j, true, RCX, 0, RCX);
+    emit8(j, OPC_TEST);
+    modrm(j, 3, RCX, RCX);
+    ok = jcc32(j, CC_NE);
+    emit_fault(j, pc);
+
+    patch_rel32(ok, j->code_ptr);
+    add64_i8(j, RCX, -1);
+    mov64_mem(j, true, RCX, RDI, offsetof(stack, count));
+    mov64_mem(j, false, RDX, RDI, offsetof(stack, buffer));
+    load16_idx(j, RAX, RDX, RCX);
+    alu_rr(j, OPC_XOR, RSI, RSI);
+    store16_idx(j, RSI, RDX, RCX);
+}
+
+/*
+ * Emits one instruction. Returns false if the block ends with it, in which
+ * case control has already been transferred.
+ */
+static bool emit_insn(struct jit *j, const struct insn *in, uint16_t pc)
+{
+    uint16_t next = pc + in->len;
+    int dst = op_has_dest_reg(in->op) ? guest_reg(in, 0) : -1;
+    uint8_t *skip;
+
+    switch (in->op) {
+        case SET:
+            load_operand(j, in, 1, dst);
+            return true;
+
+        case PUSH:
+            emit_push(j, in, 0, 0, pc);
+            return true;
+
+        case POP:
+            emit_pop(j, pc);
+            mov_rr(j, dst, RAX);
+            return true;
+
+        case EQ:
+        case GT:
+            load_operand(j, in, 1, RCX);
+            alu_operand(j, OPC_CMP, ALU_CMP, RCX, in, 2);
+            setcc(j, in->op == EQ ? CC_E : CC_A, dst);
+            return true;
+
+        case ADD:
+        case AND:
+        case OR:
+            load_operand(j, in, 1, RAX);
+            if (in->op == ADD)
+                alu_operand(j, OPC_ADD, ALU_ADD, RAX, in, 2);
+            else if (in->op == AND)
+                alu_operand(j, OPC_AND, ALU_AND, RAX, in, 2);
+            else
+                alu_operand(j, OPC_OR, ALU_OR, RAX, in, 2);
+            if (in->op == ADD)
+                alu_ri(j, ALU_AND, RAX, MAX_INT);
+            mov_rr(j, dst, RAX);
+            return true;
+
+        case MULT:
+            load_operand(j, in, 1, RAX);
+            load_operand(j, in, 2, RCX);
+            imul_rr(j, RAX, RCX);
+            alu_ri(j, ALU_AND, RAX, MAX_INT);
+            mov_rr(j, dst, RAX);
+            return true;
+
+        case MOD:
+            if (!is_reg_arg(in, 2) && !in->arg[2]) {
+                emit_fault(j, pc);
+                return false;
+            }
+            load_operand(j, in, 1, RAX);
+            load_operand(j, in, 2, RCX);
+            if (is_reg_arg(in, 2)) {
+                alu_rr(j, OPC_TEST, RCX, RCX);
+                emit_fault_if(j, CC_E, pc);
+            }
+            alu_rr(j, OPC_XOR, RDX, RDX);
+            unary(j, 6, RCX);
+            mov_rr(j, dst, RDX);
+            return true;
+
+        case NOT:
+            load_operand(j, in, 1, RAX);
+            unary(j, 2, RAX);
+            alu_ri(j, ALU_AND, RAX, MAX_INT);
+            mov_rr(j, dst, RAX);
+            return true;
+
+        case RMEM:
+            load_operand(j, in, 1, RCX);
+            if (is_reg_arg(in, 1)) {
+                alu_ri(j, ALU_CMP, RCX, MAX_INT);
+                emit_fault_if(j, CC_A, pc);
+            }
+            mov_ri64(j, R11, (uintptr_t)j->memory);
+            load16_idx(j, dst, R11, RCX);
+            return true;
+
+        case WMEM:
+            load_operand(j, in, 0, RDI);
+            if (is_reg_arg(in, 0)) {
+                alu_ri(j, ALU_CMP, RDI, MAX_INT);
+                emit_fault_if(j, CC_A, pc);
+            }
+            load_operand(j, in, 1, RSI);
+            mov_ri64(j, RDX, (uintptr_t)j);
+            emit_call(j, (void *)jit_wmem);
+            alu_rr(j, OPC_TEST, RAX, RAX);
+            skip = jcc32(j, CC_E);
+            emit_refund(j, true);
+            emit_leave(j, next);
+            patch_rel32(skip, j->code_ptr);
+            return true;
+
+        case NOOP:
+            return true;
+
+        case JMP:
+            emit_jump(j, in, 0);
+            return false;
+
+        case JT:
+        case JF:
+            if (!is_reg_arg(in, 0)) {
+                if (!in->arg[0] == (in->op == JF))
+                    emit_jump(j, in, 1);
+                else
+                    emit_exit(j, next);
+                return false;
+            }
+            alu_rr(j, OPC_TEST, guest_reg(in, 0), guest_reg(in, 0));
+            skip = jcc32(j, in->op == JT ? CC_E : CC_NE);
+            emit_jump(j, in, 1);
+            patch_rel32(skip, j->code_ptr);
+            emit_exit(j, next);
+            return false;
+
+        case CALL:
+            emit_push(j, NULL, 0, next, pc);
+            emit_jump(j, in, 0);
+            return false;
+
+        case RET:
+            emit_pop(j, pc);
+            emit_indirect(j);
+            return false;
+
+        default:
+            fprintf(stderr, "INTERNAL ERROR in %s! Cannot translate '%s'\n",
+                __func__, op_to_string(in->op));
+            exit(1);
+    }
+}
+
+/* Hooked and memoized calls are left to the interpreter */
+static bool translatable(const struct jit *j, const struct insn *in)
+{
+    if (in->op == CALL && (j->vm->hooks || j->vm->memo))
+        return !is_reg_arg(in, 0) && !vm_call_hooked(j->vm, in->arg[0]);
+    return in->op != HALT && in->op != IN && in->op != OUT;
+}
+
+/*
+ * Translates the block starting at `start`. Returns NULL if it is empty, or
+ * if the JIT fails.
+ */
+static struct block *translate(struct jit *j, uint16_t start)
+{
+    struct insn in;
+    struct block *b;
+    struct exit *exits;
+    uint16_t pc = start;
+    int count = 0;
+    bool open = true;
+    uint8_t *charge, *short_of_budget;
+    int e;
+
+    if (start >= MAX_INT || !decode_insn(j->memory, start, &in) || !translatable(j, &in))
+        return NULL;
+
+    if (j->num_blocks == MAX_BLOCKS || j->code_end - j->code_ptr < MAX_BLOCK_INSNS * MAX_INSN_BYTES)
+        flush(j);
+
+    while (j->max_exits - j->num_exits < MAX_BLOCK_EXITS) {
+        if (!(exits = grow(j->exits, &j->max_exits, sizeof *exits))) {
+            j->failed = true;
+            return NULL;
+        }
+        j->exits = exits;
+    }
+
+    if (!set_writable(j, true))
+        return NULL;
+
+    b = &j->blocks[j->num_blocks++];
+    b->code = j->code_ptr;
+    b->start = start;
+
+    /* For the sampler, which sees the whole block at its start */
+    store16_abs(j, &j->vm->live_pc, start);
+
+    /* sub budget, count; jb short_of_budget */
+    charge = alu64_ri(j, ALU_SUB, BUDGET, 0);
+    short_of_budget = jcc32(j, CC_B);
+    j->num_refunds = 0;
+
+    while (open) {
+        if (pc >= MAX_INT || count == MAX_BLOCK_INSNS ||
+                !decode_insn(j->memory, pc, &in) || !translatable(j, &in)) {
+            emit_exit(j, pc);
+            break;
+        }
+        j->done = count;
+        open = emit_insn(j, &in, pc);
+        pc += in.len;
+        count++;
+    }
+
+    /* Undoes the charge and has the dispatcher run the first instruction */
+    patch_rel32(short_of_budget, j->code_ptr);
+    alu64_ri(j, ALU_ADD, BUDGET, count);
+    mov_ri(j, RAX, start | JIT_INTERPRET);
+    patch_rel32(jmp32(j), j->common_exit);
+
+    patch_imm32(charge, count);
+    for (size_t i = 0; i < j->num_refunds; i++)
+        patch_imm32(j->refunds[i].imm, count - j->refunds[i].ran);
+
+    b->end = pc;
+    b->live = true;
+
+    j->block_at[start] = b;
+    j->entry[start] = b->code;
+    for (uint32_t addr = start; addr < b->end; addr++)
+        j->code_cover[addr]++;
+    for (e = j->exit_head[start]; e != -1; e = j->exits[e].next)
+        patch_rel32(j->exits[e].site, b->code);
+
+    return set_writable(j, false) ? b : NULL;
+}
+
+static void discard(struct jit *j, struct block *b)
+{
+    b->live = false;
+    j->block_at[b->start] = NULL;
+    j->entry[b->start] = j->common_exit;
+
+    for (uint32_t addr = b->start; addr < b->end; addr++)
+        j->code_cover[addr]--;
+    for (int e = j->exit_head[b->start]; e != -1; e = j->exits[e].next)
+        patch_rel32(j->exits[e].site, j->exits[e].stub);
+}
+
+/*
+ * wmem for translated code: returns nonzero if the write hit translated
+ * code, in which case the affected j->blocks are gone and the caller must
+ * return to the dispatcher.
+ */
+static int jit_wmem(uint32_t addr, uint32_t val, struct jit *j)
+{
+    vm_store(j->vm, addr, val);
+    if (!j->code_cover[addr])
+        return 0;
+
+    jit_invalidate(j, addr);
+    return 1;
+}
+
+/* Public interface */
+
+bool jit_available(void)
+{
+    return true;
+}
+
+/* Discards all blocks covering `addr`, which was written behind the JIT's back */
+void jit_invalidate(struct jit *j, uint16_t addr)
+{
+    int first = addr >= MAX_BLOCK_WORDS ? addr - MAX_BLOCK_WORDS + 1 : 0;
+
+    if (!j->code_cover[addr] || !set_writable(j, true))
+        return;
+
+    for (uint32_t start = first; start <= addr; start++) {
+        struct block *b = j->block_at[start];
+
+        if (b && b->end > addr)
+            discard(j, b);
+    }
+    set_writable(j, false);
+}
+
+/*
+ * Returns a JIT running on the given VM, or NULL with errno set. The VM
+ * must outlive the JIT.
+ */
+struct jit *jit_new(struct vm *vm)
+{
+    struct jit *j;
+
+    if (!(j = calloc(1, sizeof *j)))
+        return NULL;
+
+    j->vm = vm;
+    j->memory = vm->memory;
+    j->regs = vm->regs;
+    j->prog_stack = vm->prog_stack;
+    j->budget = &vm->budget;
+
+    j->code_base = mmap(NULL, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code_base == MAP_FAILED) {
+        free(j);
+        return NULL;
+    }
+
+    j->code_ptr = j->code_base;
+    j->code_end = j->code_base + CODE_CACHE_SIZE;
+    emit_trampolines(j);
+    flush(j);
+    if (!set_writable(j, false)) {
+        jit_free(j);
+        return NULL;
+    }
+
+    return j;
+}
+
+void jit_free(struct jit *j)
+{
+    if (!j)
+        return;
+
+    munmap(j->code_base, CODE_CACHE_SIZE);
+    free(j->exits);
+    free(j);
+}
+
+/*
+ * Returns the code for the block at `pc`, translating it if need be, or NULL
+ * for the interpreter. Stops the run at `pc` once the JIT has failed.
+ */
+void *jit_lookup(struct jit *j, uint16_t pc)
+{
+    struct block *b = j->block_at[pc];
+
+    if (!b && !j->failed)
+        b = translate(j, pc);
+    if (j->failed) {
+        j->vm->mem_offset = pc;
+        vm_stop(j->vm, SYN_TRAP_NOMEM, 0);
+    }
+    return b ? b->code : NULL;
+}
+
+uint32_t jit_run(struct jit *j, void *code)
+{
+    return j->enter(j->regs, code);
+}
+
+#else
+
+#include <errno.h>
+
+bool jit_available(void)
+{
+    return false;
+}
+
+struct jit *jit_new(struct vm *vm)
+{
+    (void)vm;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void jit_free(struct jit *j)
+{
+    (void)j;
+}
+
+void jit_invalidate(struct jit *j, uint16_t addr)
+{
+    (void)j;
+    (void)addr;
+}
+
+void *jit_lookup(struct jit *j, uint16_t pc)
+{
+    (void)j;
+    (void)pc;
+    return NULL;
+}
+
+uint32_t jit_run(struct jit *j, void *code)
+{
+    (void)j;
+    (void)code;
+    return JIT_INTERPRET;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef SYNACOR_JIT_H__
+#define SYNACOR_JIT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Set in the result of jit_run() when the instruction at the returned address
+ * has to be run by the interpreter, e.g. because it faults.
+ */
+#define JIT_INTERPRET 0x10000
+
+struct jit;
+struct vm;
+
+bool jit_available(void);
+struct jit *jit_new(struct vm *vm);
+void jit_free(struct jit *j);
+void jit_invalidate(struct jit *j, uint16_t addr);
+void *jit_lookup(struct jit *j, uint16_t pc);
+uint32_t jit_run(struct jit *j, void *code);
+
+#endif /* SYNACOR_JIT_H__ */
@@ -0,0 +1,329 @@
+/*
+ * Lockstep (SPMD) execution of many instances of one program which differ
+ * in their registers, as in a sweep. Every register holds one 16-bit lane
+ * per instance in a vector, so that the lanes which are at the same
+ * instruction run it together: the arithmetic as single vector operations
+ * under a mask of those lanes. Where a `jt` or `jf` sends the lanes apart,
+ * the lanes with the lowest program counter go on first, which has the
+ * others catch up with them at the join.
+ *
+ * Memory stays shared, so only instructions which keep it that way run in
+ * lockstep. A lane stops at the first `wmem`, `in`, `out`, `halt`, fault or
+ * hooked call, for the caller to go on with it in a VM of its own.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm.h"
+#include "decode.h"
+#include "lockstep.h"
+
+#define LOCKSTEP_STACK 1024     /* words a lane's stack may hold */
+
+typedef uint16_t lanes __attribute__((vector_size(2 * LOCKSTEP_LANES)));
+
+struct lockstep {
+    lanes regs[REG_NUM];
+    lanes pcs;
+    lanes running;              /* 0xffff for the lanes still running */
+    lanes recent;               /* instructions run since the last fold */
+    uint32_t since_fold;
+    uint64_t done[LOCKSTEP_LANES];
+
+    /* The lanes at the instruction to run next */
+    uint16_t pc;
+    lanes mask;
+
+    uint16_t stack[LOCKSTEP_LANES][LOCKSTEP_STACK];
+    uint16_t depth[LOCKSTEP_LANES];
+
+    /* Memory does not change while lanes run, so neither does its decoding */
+    bool decoded[MAX_INT];
+    bool valid[MAX_INT];
+    struct insn code[MAX_INT];
+};
+
+static bool any(lanes m)
+{
+    uint64_t words[sizeof m / 8], all = 0;
+
+    memcpy(words, &m, sizeof m);
+    for (size_t i = 0; i < sizeof m / 8; i++)
+        all |= words[i];
+    return all;
+}
+
+static int reg_num(const struct insn *in, int n)
+{
+#ifdef FOLDED_REGS
+    return in->arg[n] - MIN_REG;
+#else
+    return in->arg[n];
+#endif
+}
+
+static lanes val(const struct lockstep *ls, const struct insn *in, int n)
+{
+    if (in->kinds & (1 << n))
+        return ls->regs[reg_num(in, n)];
+    return (lanes){ 0 } + in->arg[n];
+}
+
+/* Sets the destination register of the lanes in `m` */
+static void assign(struct lockstep *ls, const struct insn *in, lanes v, lanes m)
+{
+    lanes *dest = &ls->regs[reg_num(in, 0)];
+
+    *dest = (v & m) | (*dest & ~m);
+}
+
+static const struct insn *decode(struct lockstep *ls, const struct vm *vm, uint16_t pc)
+{
+    if (!ls->decoded[pc]) {
+        ls->valid[pc] = decode_insn(vm->memory, pc, &ls->code[pc]);
+        ls->decoded[pc] = true;
+    }
+    return ls->valid[pc] ? &ls->code[pc] : NULL;
+}
+
+/* Picks the lanes to run next: those at the lowest program counter */
+static void regroup(struct lockstep *ls)
+{
+    uint16_t pc = UINT16_MAX;
+
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+        if (ls->running[i] && ls->pcs[i] < pc)
+            pc = ls->pcs[i];
+
+    ls->pc = pc;
+    ls->mask = (lanes)(ls->pcs == pc) & ls->running;
+}
+
+static void fold(struct lockstep *ls)
+{
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+        ls->done[i] += ls->recent[i];
+    ls->recent = (lanes){ 0 };
+    ls->since_fold = 0;
+}
+
+struct lockstep *lockstep_new(void)
+{
+    /* Vectors want an alignment malloc() does not give */
+    size_t size = (sizeof(struct lockstep) + sizeof(lanes) - 1) / sizeof(lanes) * sizeof(lanes);
+    struct lockstep *ls;
+
+    if ((ls = aligned_alloc(sizeof(lanes), size)))
+        memset(ls, 0, size);
+    return ls;
+}
+
+void lockstep_free(struct lockstep *ls)
+{
+    free(ls);
+}
+
+void lockstep_start(struct lockstep *ls, const struct vm *vm, int reg,
+    const uint16_t *values, int n)
+{
+    const stack *s = vm->prog_stack;
+
+    for (int r = 0; r < REG_NUM; r++)
+        ls->regs[r] = (lanes){ 0 } + vm->regs[r];
+    ls->pcs = (lanes){ 0 } + vm->mem_offset;
+    ls->running = (lanes){ 0 };
+    ls->recent = (lanes){ 0 };
+    ls->since_fold = 0;
+
+    for (int i = 0; i < n; i++) {
+        ls->regs[reg][i] = values[i];
+        ls->done[i] = 0;
+        ls->running[i] = vm->status < SYN_HALT && s->count <= LOCKSTEP_STACK ? 0xffff : 0;
+        if (ls->running[i]) {
+            memcpy(ls->stack[i], s->buffer, s->count * sizeof *s->buffer);
+            ls->depth[i] = s->count;
+        }
+    }
+    regroup(ls);
+}
+
+void lockstep_stop(struct lockstep *ls, int lane)
+{
+    ls->running[lane] = 0;
+    ls->mask[lane] = 0;
+}
+
+/* Stops the lanes in `m` at the current instruction */
+static void stop(struct lockstep *ls, lanes m)
+{
+    ls->running &= ~m;
+    ls->mask &= ~m;
+}
+
+bool lockstep_run(struct lockstep *ls, struct vm *vm, uint64_t steps)
+{
+    const struct insn *in;
+    lanes m, b, c, zero, target;
+    uint16_t pc, next;
+    bool together;
+
+    while (steps-- && any(ls->running)) {
+        pc = ls->pc;
+        if (pc >= MAX_INT || !(in = decode(ls, vm, pc))) {
+            stop(ls, ls->mask);
+            regroup(ls);
+            continue;
+        }
+
+        next = pc + in->len;
+        together = true;
+
+        switch (in->op) {
+            case SET:
+                assign(ls, in, val(ls, in, 1), ls->mask);
+                break;
+            case EQ:
+                assign(ls, in, (lanes)(val(ls, in, 1) == val(ls, in, 2)) & 1, ls->mask);
+                break;
+            case GT:
+                assign(ls, in, (lanes)(val(ls, in, 1) > val(ls, in, 2)) & 1, ls->mask);
+                break;
+            case ADD:
+                assign(ls, in, (val(ls, in, 1) + val(ls, in, 2)) & MAX_INT, ls->mask);
+                break;
+            case MULT:
+                assign(ls, in, (val(ls, in, 1) * val(ls, in, 2)) & MAX_INT, ls->mask);
+                break;
+            case MOD:
+                /* Whatever dividing by 0 does, it does not do it here */
+                c = val(ls, in, 2);
+                zero = (lanes)(c == 0);
+                stop(ls, zero & ls->mask);
+                assign(ls, in, val(ls, in, 1) % (c | (zero & 1)), ls->mask);
+                break;
+            case AND:
+                assign(ls, in, val(ls, in, 1) & val(ls, in, 2), ls->mask);
+                break;
+            case OR:
+                assign(ls, in, val(ls, in, 1) | val(ls, in, 2), ls->mask);
+                break;
+            case NOT:
+                assign(ls, in, ~val(ls, in, 1) & MAX_INT, ls->mask);
+                break;
+            case RMEM:
+                b = val(ls, in, 1);
+                c = ls->regs[reg_num(in, 0)];
+                for (int i = 0; i < LOCKSTEP_LANES; i++) {
+                    if (!ls->mask[i])
+                        continue;
+                    /* Past the end, what the engines read is their business */
+                    if (b[i] > MAX_INT)
+                        lockstep_stop(ls, i);
+                    else
+                        c[i] = vm->memory[b[i]];
+                }
+                ls->regs[reg_num(in, 0)] = c;
+                break;
+            case PUSH:
+                b = val(ls, in, 0);
+                for (int i = 0; i < LOCKSTEP_LANES; i++) {
+                    if (!ls->mask[i])
+                        continue;
+                    if (ls->depth[i] == LOCKSTEP_STACK)
+                        lockstep_stop(ls, i);
+                    else
+                        ls->stack[i][ls->depth[i]++] = b[i];
+                }
+                break;
+            case POP:
+                c = ls->regs[reg_num(in, 0)];
+                for (int i = 0; i < LOCKSTEP_LANES; i++) {
+                    if (!ls->mask[i])
+                        continue;
+                    if (!ls->depth[i])
+                        lockstep_stop(ls, i);
+                    else
+                        c[i] = ls->stack[i][--ls->depth[i]];
+                }
+                ls->regs[reg_num(in, 0)] = c;
+                break;
+            case JMP:
+                ls->pcs = (val(ls, in, 0) & ls->mask) | (ls->pcs & ~ls->mask);
+                together = false;
+                break;
+            case JT:
+            case JF:
+                m = (lanes)(val(ls, in, 0) != 0);
+                if (in->op == JF)
+                    m = ~m;
+                target = (val(ls, in, 1) & m) | (((lanes){ 0 } + next) & ~m);
+                ls->pcs = (target & ls->mask) | (ls->pcs & ~ls->mask);
+                together = false;
+                break;
+            case CALL:
+                target = val(ls, in, 0);
+                for (int i = 0; i < LOCKSTEP_LANES; i++) {
+                    if (!ls->mask[i])
+                        continue;
+                    /* Past the end, where the call goes is the engines' business */
+                    if (target[i] > MAX_INT || ls->depth[i] == LOCKSTEP_STACK ||
+                            vm_call_hooked(vm, target[i]))
+                        lockstep_stop(ls, i);
+                    else
+                        ls->stack[i][ls->depth[i]++] = next;
+                }
+                ls->pcs = (target & ls->mask) | (ls->pcs & ~ls->mask);
+                together = false;
+                break;
+            case RET:
+                target = ls->pcs;
+                for (int i = 0; i < LOCKSTEP_LANES; i++) {
+                    if (!ls->mask[i])
+                        continue;
+                    if (!ls->depth[i])
+                        lockstep_stop(ls, i);
+                    else
+                        target[i] = ls->stack[i][--ls->depth[i]];
+                }
+                ls->pcs = target;
+                together = false;
+                break;
+            case NOOP:
+                break;
+            default:
+                stop(ls, ls->mask);
+                break;
+        }
+
+        ls->recent += ls->mask & 1;
+        if (++ls->since_fold == UINT16_MAX)
+            fold(ls);
+
+        if (together) {
+            ls->pcs = (((lanes){ 0 } + next) & ls->mask) | (ls->pcs & ~ls->mask);
+            /* Nothing to regroup while all lanes run the same code */
+            if (!any(ls->mask ^ ls->running)) {
+                ls->pc = next;
+                continue;
+            }
+        }
+        regroup(ls);
+    }
+
+    fold(ls);
+    return any(ls->running);
+}
+
+int64_t lockstep_lane(struct lockstep *ls, int lane, struct vm *vm)
+{
+    s_clear(vm->prog_stack);
+    for (int i = 0; i < ls->depth[lane]; i++)
+        if (!s_push(vm->prog_stack, ls->stack[lane][i]))
+            return -1;
+
+    for (int r = 0; r < REG_NUM; r++)
+        vm->regs[r] = ls->regs[r][lane];
+    vm->mem_offset = ls->pcs[lane];
+    return ls->done[lane];
+}
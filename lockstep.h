@@ -0,0 +1,44 @@
+#ifndef SYNACOR_LOCKSTEP_H__
+#define SYNACOR_LOCKSTEP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* One 16-bit lane per instance, as many as fit a vector register */
+#if defined(__AVX512BW__)
+    #define LOCKSTEP_LANES 32
+#elif defined(__AVX2__)
+    #define LOCKSTEP_LANES 16
+#else
+    #define LOCKSTEP_LANES 8
+#endif
+
+struct lockstep;
+struct vm;
+
+struct lockstep *lockstep_new(void);
+void lockstep_free(struct lockstep *ls);
+
+/*
+ * Starts n <= LOCKSTEP_LANES copies of the state of `vm`, lane i with
+ * values[i] in register `reg`. The memory of `vm` is theirs as long as they
+ * run and must stay the same from one start to the next.
+ */
+void lockstep_start(struct lockstep *ls, const struct vm *vm, int reg,
+    const uint16_t *values, int n);
+
+/*
+ * Runs at most `steps` instructions per lane. Lanes stop at every instruction
+ * they cannot run in lockstep. Returns whether any lane is still running.
+ */
+bool lockstep_run(struct lockstep *ls, struct vm *vm, uint64_t steps);
+
+void lockstep_stop(struct lockstep *ls, int lane);
+
+/*
+ * Puts the registers, stack and program counter of a lane into `vm` and
+ * returns how many instructions the lane ran, or -1 if out of memory
+ */
+int64_t lockstep_lane(struct lockstep *ls, int lane, struct vm *vm);
+
+#endif /* SYNACOR_LOCKSTEP_H__ */
@@ -1,479 +1,219 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
-#include <stdint.h>
-#include <endian.h>
-#include <inttypes.h>
-#include <ctype.h>
-#include "cmc/stack.h"
-#include "arch.h"
-
-#define MAX_ADDR MAX_INT
-#define REG_NUM  8
-
-#ifdef DEBUG
-    #define dprintf(f, ...) printf("*** DEBUG (%s): " f, __func__, ## __VA_ARGS__)
-    #define dpf() dprintf("\n")
-#else
-    #define dprintf(f, ...)
-    #define dpf()
-#endif
-
-#define READ1(var) \
-    uint16_t var; \
-    if (readU16(&var) == -1) { \
-        fprintf(stderr, "Not enough arguments to op '%s'!", __func__); \
-        exit(1); \
-    }
-
-#define READ2(var1, var2) \
-    uint16_t var1, var2; \
-    if (readU16(&var1) == -1 || readU16(&var2) == -1) { \
-        fprintf(stderr, "Not enough arguments to op '%s'!", __func__); \
-        exit(1); \
+#include <signal.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "synacor.h"
+
+/* Runs return this often, to bring the counters up to date */
+#define RUN_SLICE (1 << 24)
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-e call|switch|threaded|decoded|jit] [-c <cache dir>] "
+        "[-H <hooks file> [-V]] [-m]\n"
+        "       [-s <samples per second>] [-p <profile file>] [-f <folded stacks file>]\n"
+        "       [--stats] [--stats-shm <shared memory name>] <exe>\n",
+        prog);
+    exit(1);
+}
+
+static enum syn_engine parse_engine(const char *name, const char *prog)
+{
+    if (!strcmp(name, "call"))
+        return SYN_ENGINE_CALL;
+    if (!strcmp(name, "switch"))
+        return SYN_ENGINE_SWITCH;
+    if (!strcmp(name, "threaded")) {
+        if (!syn_engine_available(SYN_ENGINE_THREADED)) {
+            fprintf(stderr, "ERROR: The threaded engine is not available with this compiler!\n");
+            exit(1);
+        }
+        return SYN_ENGINE_THREADED;
     }
-
-#define READ3(var1, var2, var3) \
-    uint16_t var1, var2, var3; \
-    if (readU16(&var1) == -1 || readU16(&var2) == -1 || readU16(&var3) == -1 ) { \
-        fprintf(stderr, "Not enough arguments to op '%s'!", __func__); \
-        exit(1); \
+    if (!strcmp(name, "decoded"))
+        return SYN_ENGINE_DECODED;
+    if (!strcmp(name, "jit")) {
+        if (!syn_engine_available(SYN_ENGINE_JIT)) {
+            fprintf(stderr, "ERROR: The JIT is only available on x86-64!\n");
+            exit(1);
+        }
+        return SYN_ENGINE_JIT;
     }
 
-uint16_t memory[MAX_ADDR + 1];
-uint16_t mem_offset = 0;
-
-STACK_GENERATE(s, stack, /* func modifier */, uint16_t)
-
-static stack *prog_stack;
-static uint16_t regs[REG_NUM] = {0};
-
-void halt(void);
-void set(void);
-void push(void);
-void pop(void);
-void eq(void);
-void gt(void);
-void jmp(void);
-void jt(void);
-void jf(void);
-void add(void);
-void mult(void);
-void mod(void);
-void and(void);
-void or(void);
-void not(void);
-void rmem(void);
-void wmem(void);
-void call(void);
-void ret(void);
-void out(void);
-void in(void);
-void noop(void);
-
-void (*op_functions[NUM_OP_CODES])() = {
-    halt,
-    set,
-    push,
-    pop,
-    eq,
-    gt,
-    jmp,
-    jt,
-    jf,
-    add,
-    mult,
-    mod,
-    and,
-    or,
-    not,
-    rmem,
-    wmem,
-    call,
-    ret,
-    out,
-    in,
-    noop
-};
-
-void execute_file(void);
+    fprintf(stderr, "ERROR: Unknown engine '%s'\n", name);
+    usage(prog);
+    return SYN_ENGINE_CALL;
+}
 
-int main(int argc, char **argv)
+static void write_profile(syn_vm *vm, const char *path,
+    int (*write)(const syn_vm *, FILE *))
 {
-    if (argc != 2) {
-        printf("Usage: %s <exe>\n", argv[0]);
-        exit(1);
-    }
-
     FILE *fp;
 
-    if (!(fp = fopen(argv[1], "r"))) {
-        perror("fopen");
-        exit(1);
-    }
-
-    clearerr(fp);
-    fread(memory, sizeof *memory, sizeof memory / sizeof *memory, fp);
+    if (!path)
+        return;
 
-    if (ferror(fp)) {
-        perror("");
+    if (!(fp = fopen(path, "w")) || write(vm, fp) || fclose(fp)) {
+        perror(path);
         exit(1);
     }
+}
 
-    fclose(fp);
+/* Prints the counters whenever SIGUSR1 arrives, which only this thread takes */
+static void *stats_thread(void *arg)
+{
+    struct syn_stats stats;
+    syn_vm *vm = arg;
+    sigset_t set;
+    int sig;
 
-    if (!(prog_stack = s_new(128))) {
-        perror("stack");
-        exit(1);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (!sigwait(&set, &sig)) {
+        syn_stats(vm, &stats);
+        syn_stats_report(&stats, stderr);
     }
-
-    execute_file();
-
-    return 0;
+    return NULL;
 }
 
-/* Helper functions */
-
-uint16_t get_reg_val(uint16_t reg)
+static void report_stats_on_signal(syn_vm *vm)
 {
-    if (!is_reg(reg)) {
-        fprintf(stderr, "INTERNAL ERROR: Attempting to read a register which doesn't exist!\n");
+    pthread_t thread;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL)) ||
+            (errno = pthread_create(&thread, NULL, stats_thread, vm))) {
+        perror("stats");
         exit(1);
     }
-    return regs[addr_to_reg_num(reg)];
+    pthread_detach(thread);
 }
 
-void verify_int_or_die(uint16_t i)
+int main(int argc, char **argv)
 {
-    if (i > MAX_INT) {
-        fprintf(stderr, "ERROR: Number is out of range: %u\n"
-            "Numbers are from 0 through %u\n", i, MAX_INT);
-        exit(1);
+    static const struct option long_opts[] = {
+        { "stats", no_argument, NULL, 'S' },
+        { "stats-shm", required_argument, NULL, 'M' },
+        { NULL, 0, NULL, 0 }
+    };
+    enum syn_engine engine = SYN_ENGINE_DECODED;
+    const char *cache_dir = NULL;
+    const char *hooks = NULL;
+    const char *report = NULL, *folded = NULL;
+    const char *stats_shm = NULL;
+    struct syn_stats stats;
+    int sample_hz = 0, show_stats = 0;
+    int verify = 0, memoize = 0;
+    enum syn_status status;
+    syn_vm *vm;
+    int opt, line;
+
+    while ((opt = getopt_long(argc, argv, "e:c:H:Vms:p:f:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'e':
+                engine = parse_engine(optarg, argv[0]);
+                break;
+            case 'c':
+                cache_dir = optarg;
+                break;
+            case 'H':
+                hooks = optarg;
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            case 'm':
+                memoize = 1;
+                break;
+            case 's':
+                sample_hz = atoi(optarg);
+                break;
+            case 'p':
+                report = optarg;
+                break;
+            case 'f':
+                folded = optarg;
+                break;
+            case 'S':
+                show_stats = 1;
+                break;
+            case 'M':
+                stats_shm = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
-}
 
-void verify_reg_or_die(uint16_t addr)
-{
-    if (!is_reg(addr)) {
-        fprintf(stderr, "ERROR: Address expected to be a register, "
-            "but its value is out of range! The accused: 0x%02x\n", addr);
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (!(vm = syn_create())) {
+        perror("vm");
         exit(1);
     }
-}
 
-void verify_reg_or_int_and_get_val_or_die(uint16_t *i)
-{
-    if (is_reg(*i))
-        *i = get_reg_val(*i);
-    else
-        verify_int_or_die(*i);
-}
+    syn_set_engine(vm, engine);
 
-void execute_file()
-{
-    uint16_t op;
-    while (readU16(&op) != -1) {
-        if (op >= NUM_OP_CODES) {
-            fprintf(stderr, "ERROR: Op code out of range! Valid codes are from "
-            "0 through %u. Offending op code: %u\n", NUM_OP_CODES - 1, op);
+    if (hooks) {
+        if ((line = syn_load_hooks(vm, hooks)) == -1) {
+            perror("hooks");
             exit(1);
         }
-        op_functions[op]();
+        if (line) {
+            fprintf(stderr, "ERROR: %s:%d: Expected '<address> <hook>'\n", hooks, line);
+            exit(1);
+        }
+        syn_verify_hooks(vm, verify);
     }
 
-    if (mem_offset >= MAX_INT) {
-        exit(0);
-    } else {
-        perror("ERROR: Error reading!");
+    if (memoize && syn_memoize(vm, 1)) {
+        perror("memoize");
         exit(1);
     }
-}
-
-/* op code implementations */
-
-void halt()
-{
-    dpf();
-    exit(0);
-}
-
-void set()
-{
-    READ2(reg, val)
-
-    verify_reg_or_die(reg);
-    verify_reg_or_int_and_get_val_or_die(&val);
-
-    dprintf("Setting register %d to 0x%02x |%c|\n", reg - MIN_REG,
-        val, isprint(val) ? val : '.');
-
-    regs[addr_to_reg_num(reg)] = val;
-}
 
-void push()
-{
-    READ1(val);
-    verify_reg_or_int_and_get_val_or_die(&val);
-    s_push(prog_stack, val);
-
-}
-
-void pop()
-{
-    READ1(dest_reg);
-    verify_reg_or_die(dest_reg);
-
-    if (s_empty(prog_stack)) {
-        fprintf(stderr, "ERROR: Stack underflow!\n");
+    if (sample_hz ? syn_sample(vm, sample_hz) : (report || folded) && syn_profile(vm, 1)) {
+        perror("profile");
         exit(1);
     }
 
-    regs[addr_to_reg_num(dest_reg)] = s_top(prog_stack);
-    s_pop(prog_stack);
-}
-
-void eq()
-{
-    READ3(dest_reg, val1, val2)
-    
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&val1);
-    verify_reg_or_int_and_get_val_or_die(&val2);
-
-    dprintf("val1: 0x%02x, val2: 0x%02x\n", val1, val2);
-
-    if (val1 == val2) {
-        dprintf("Values equal. Setting reg %d to 1\n", dest_reg - MIN_REG);
-        regs[addr_to_reg_num(dest_reg)] = 1;
-    } else {
-        dprintf("Values NOT equal. Setting reg %d to 0\n", dest_reg - MIN_REG);
-        regs[addr_to_reg_num(dest_reg)] = 0;
+    if (stats_shm && syn_stats_share(vm, stats_shm)) {
+        perror(stats_shm);
+        exit(1);
     }
-}
 
-void gt()
-{
-    READ3(dest_reg, val1, val2)
-    
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&val1);
-    verify_reg_or_int_and_get_val_or_die(&val2);
+    if (show_stats)
+        report_stats_on_signal(vm);
 
-    dprintf("val1: 0x%02x, val2: 0x%02x\n", val1, val2);
-
-    if (val1 > val2) {
-        dprintf("val 1 > val2. Setting reg %d to 1\n", dest_reg - MIN_REG);
-        regs[addr_to_reg_num(dest_reg)] = 1;
-    } else {
-        dprintf("val 1 is <= val2. Setting reg %d to 0\n", dest_reg - MIN_REG);
-        regs[addr_to_reg_num(dest_reg)] = 0;
+    if ((cache_dir ? syn_load_warm(vm, argv[optind], cache_dir) :
+            syn_load(vm, argv[optind])) == -1) {
+        perror("fopen");
+        exit(1);
     }
-}
 
-void jmp()
-{
-    READ1(addr)
-    verify_reg_or_int_and_get_val_or_die(&addr);
-    
-    dprintf("current word-wise file offset: %u\n", mem_offset - 1);
-    dprintf("jump addr: %u\n", addr);
-    
-    mem_offset = addr;
-}
-
-void jt()
-{
-    READ2(boolean, addr)
-    
-    verify_reg_or_int_and_get_val_or_die(&boolean);
-    verify_reg_or_int_and_get_val_or_die(&addr);
-
-    dprintf("boolean val: '%c'\tjump addr: %u\n", boolean != 0 ? 'T' : 'F', addr);
-    dprintf("current word-wise file offset: %u\n", mem_offset - 3);
-
-    if (boolean)
-        mem_offset = addr;
-}
-
-void jf()
-{
-    READ2(boolean, addr)
-    
-    verify_reg_or_int_and_get_val_or_die(&boolean);
-    verify_reg_or_int_and_get_val_or_die(&addr);
-    
-    dprintf("boolean val: '%c'\tjump addr: %u\n", boolean != 0 ? 'T' : 'F', addr);
-    dprintf("current word-wise file offset: %u\n", mem_offset - 3);
-
-    if (!boolean)
-        mem_offset = addr;
-}
-
-void add()
-{
-    READ3(dest_reg, addend1, addend2)
-
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&addend1);
-    verify_reg_or_int_and_get_val_or_die(&addend2);
-    
-    uint16_t sum = (addend1 + addend2) % (MAX_INT + 1);
-
-    dprintf("Setting register %d to (0x%02x + 0x%02x) %% MAX_INT+1 = 0x%02x\n", dest_reg - MIN_REG,
-        addend1, addend2, sum);
-
-    regs[addr_to_reg_num(dest_reg)] = sum;
-}
-
-void mult()
-{
-    READ3(dest_reg, factor1, factor2)
-
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&factor1);
-    verify_reg_or_int_and_get_val_or_die(&factor2);
-    
-    uint16_t product = (factor1 * factor2) % (MAX_INT + 1);
-
-    dprintf("Setting register %d to (0x%02x * 0x%02x) %% MAX_INT+1 = 0x%02x\n", dest_reg - MIN_REG,
-        factor1, factor2, product);
-
-    regs[addr_to_reg_num(dest_reg)] = product;
-}
-
-void mod()
-{
-    READ3(dest_reg, val1, val2)
-
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&val1);
-    verify_reg_or_int_and_get_val_or_die(&val2);
-    
-    uint16_t res = val1 % val2;
-
-    dprintf("Setting register %d to (0x%02x %% 0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
-        val1, val2, res);
-
-    regs[addr_to_reg_num(dest_reg)] = res;
-}
-
-void and()
-{
-    READ3(dest_reg, val1, val2)
-
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&val1);
-    verify_reg_or_int_and_get_val_or_die(&val2);
-    
-    uint16_t res = val1 & val2;
-
-    dprintf("Setting register %d to (0x%02x & 0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
-        val1, val2, res);
-
-    regs[addr_to_reg_num(dest_reg)] = res;
-}
-
-void or()
-{
-    READ3(dest_reg, val1, val2)
+    while ((status = syn_run(vm, RUN_SLICE)) == SYN_OK)
+        ;
 
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&val1);
-    verify_reg_or_int_and_get_val_or_die(&val2);
-    
-    uint16_t res = val1 | val2;
+    write_profile(vm, report, sample_hz ? syn_sample_report : syn_profile_report);
+    write_profile(vm, folded, sample_hz ? syn_sample_folded : syn_profile_folded);
 
-    dprintf("Setting register %d to (0x%02x | 0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
-        val1, val2, res);
-
-    regs[addr_to_reg_num(dest_reg)] = res;
-}
-
-void not()
-{
-    READ2(dest_reg, val1)
-
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&val1);
-    
-    uint16_t res = ~val1 & MAX_INT;
-
-    dprintf("Setting register %d to (~0x%02x %% MAX_INT+1) = 0x%02x\n", dest_reg - MIN_REG,
-        val1, res);
-
-    regs[addr_to_reg_num(dest_reg)] = res;
-}
-
-void rmem()
-{
-    READ2(dest_reg, addr)
-
-    verify_reg_or_die(dest_reg);
-    verify_reg_or_int_and_get_val_or_die(&addr);
-    
-    uint16_t res = memory[addr];
-
-    dprintf("Setting register %d to value of mem location (0x%02x) = 0x%02x\n", dest_reg - MIN_REG,
-        addr, res);
-
-    regs[addr_to_reg_num(dest_reg)] = res;
-}
-
-void wmem()
-{
-    READ2(addr, val)
-
-    verify_reg_or_int_and_get_val_or_die(&addr);
-    verify_reg_or_int_and_get_val_or_die(&val);
-    
-    memory[addr] = val;
-
-    dprintf("Setting mem loc %u to value of %02x\n", addr, memory[addr]);
-}
-
-void call()
-{
-    READ1(addr)
-    verify_reg_or_int_and_get_val_or_die(&addr);
-    
-    dprintf("current word-wise file offset: %u\n", mem_offset - 2);
-    dprintf("jump addr: %u\n", addr);
-    
-    s_push(prog_stack, mem_offset);
-    mem_offset = addr;
-}
+    if (show_stats) {
+        syn_stats(vm, &stats);
+        syn_stats_report(&stats, stderr);
+    }
 
-void ret()
-{
-    if (s_empty(prog_stack)) {
-        fprintf(stderr, "ERROR: Stack underflow!\n");
+    if (status != SYN_HALT && status != SYN_END) {
+        syn_print_trap(vm, stderr);
+        syn_destroy(vm);
         exit(1);
     }
 
-    mem_offset = s_top(prog_stack);
-    s_pop(prog_stack);
-    
-    dprintf("current word-wise file offset: %u\n", mem_offset - 1);
-    dprintf("jump addr: %u\n", mem_offset);
-}
-
-void out()
-{
-    READ1(ch)
-    verify_reg_or_int_and_get_val_or_die(&ch);
-    putchar(ch);
-}
-
-void in()
-{
-    READ1(reg)
-    verify_reg_or_die(reg);
-
-    regs[addr_to_reg_num(reg)] = getchar();
-}
-
-void noop()
-{
-    dpf();
+    syn_destroy(vm);
+    return 0;
 }
-
@@ -0,0 +1,479 @@
+/*
+ * Memoization of pure guest routines. A routine is pure if everything it
+ * can run, itself and the routines it calls, only computes on registers and
+ * on its own part of the stack: no `rmem`, `wmem`, `in`, `out` or `halt`, no
+ * jumps or calls through registers, no hooked calls, and every path pops
+ * what it pushed before it returns. What such a routine does is then fully
+ * determined by the registers it uses, and a call with the same values in
+ * them as an earlier one can take that one's results.
+ *
+ * Calls to pure routines are run here, by a small interpreter which looks
+ * up every call it makes as well, so that recursive routines like the
+ * teleporter check compute every distinct call only once. It keeps the
+ * guest's state exactly as the engines would, return addresses on the stack
+ * included, and simply hands back to the engine wherever it cannot go on,
+ * or where the budget of the run is used up.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm.h"
+#include "decode.h"
+
+#define MEMO_MAX_INSNS  4096        /* instructions a pure routine may cover */
+#define MEMO_MAX_DEPTH  256         /* words it may push */
+#define MEMO_MAX_STEPS  (1 << 20)   /* instructions run before handing back */
+#define MEMO_MIN_SIZE   1024        /* table slots */
+#define MEMO_MAX_SIZE   (1 << 22)
+
+enum purity {
+    UNKNOWN,
+    PURE,
+    IMPURE
+};
+
+struct memo_entry {
+    uint16_t entry;
+    bool used;
+    uint16_t in[REG_NUM];       /* registers the routine uses, others 0 */
+    uint16_t out[REG_NUM];      /* registers it writes */
+};
+
+/* A call the interpreter is in */
+struct frame {
+    uint16_t entry;
+    uint16_t in[REG_NUM];
+};
+
+struct walk {
+    uint16_t pc;
+    uint16_t depth;
+};
+
+struct memo {
+    uint8_t purity[MAX_INT + 1];
+    uint8_t uses[MAX_INT + 1];      /* bit r: register r is read or written */
+    uint8_t writes[MAX_INT + 1];    /* bit r: register r is written */
+    bool code[MAX_INT + 1];         /* words some pure routine runs */
+
+    struct memo_entry *table;
+    size_t size, count;
+
+    struct frame *frames;
+    size_t num_frames, max_frames;
+
+    /* Scratch space of analyze() */
+    uint32_t stamp;
+    uint32_t seen[MAX_INT + 1];     /* == stamp: visited in this walk */
+    uint16_t depth[MAX_INT + 1];    /* words pushed when it got there */
+    uint32_t listed[MAX_INT + 1];   /* == stamp of the analysis: routine listed */
+    uint16_t routines[MAX_INT + 1];
+    struct walk work[2 * MEMO_MAX_INSNS + 2];
+    uint16_t insns[MEMO_MAX_INSNS];
+};
+
+static int reg_num(const struct insn *in, int n)
+{
+#ifdef FOLDED_REGS
+    return in->arg[n] - MIN_REG;
+#else
+    return in->arg[n];
+#endif
+}
+
+static bool is_reg_arg(const struct insn *in, int n)
+{
+    return in->kinds & (1 << n);
+}
+
+static bool hooked(const struct vm *vm, uint16_t addr)
+{
+    return vm->hooks && vm->hooks[addr];
+}
+
+/*
+ * Walks the routine at `entry` and everything it calls, and records whether
+ * it is pure and which registers it uses
+ */
+static void analyze(struct vm *vm, uint16_t entry)
+{
+    struct memo *m = vm->memo;
+    uint32_t analysis = ++m->stamp;
+    size_t num_routines = 0, num_insns = 0, num_work;
+    uint8_t uses = 0, writes = 0;
+    struct insn in;
+    uint16_t pc, d;
+
+    m->purity[entry] = IMPURE;
+    m->listed[entry] = analysis;
+    m->routines[num_routines++] = entry;
+
+    for (size_t r = 0; r < num_routines; r++) {
+        uint32_t walk = ++m->stamp;
+
+        num_work = 0;
+        m->work[num_work++] = (struct walk){ m->routines[r], 0 };
+
+        while (num_work) {
+            pc = m->work[--num_work].pc;
+            d = m->work[num_work].depth;
+
+            if (m->seen[pc] == walk) {
+                if (m->depth[pc] != d)
+                    return;
+                continue;
+            }
+            m->seen[pc] = walk;
+            m->depth[pc] = d;
+
+            if (num_insns == MEMO_MAX_INSNS || !decode_insn(vm->memory, pc, &in))
+                return;
+            m->insns[num_insns++] = pc;
+
+            for (int n = 0; n < op_num_args(in.op); n++) {
+                if (!is_reg_arg(&in, n))
+                    continue;
+                uses |= 1 << reg_num(&in, n);
+                if (n == 0 && op_has_dest_reg(in.op))
+                    writes |= 1 << reg_num(&in, n);
+            }
+
+            switch (in.op) {
+                case HALT:
+                case RMEM:
+                case WMEM:
+                case OUT:
+                case IN:
+                    return;
+                case JMP:
+                    if (is_reg_arg(&in, 0))
+                        return;
+                    m->work[num_work++] = (struct walk){ in.arg[0], d };
+                    continue;
+                case JT:
+                case JF:
+                    if (is_reg_arg(&in, 1))
+                        return;
+                    m->work[num_work++] = (struct walk){ in.arg[1], d };
+                    break;
+                case CALL:
+                    if (is_reg_arg(&in, 0) || hooked(vm, in.arg[0]))
+                        return;
+                    if (m->listed[in.arg[0]] != analysis) {
+                        m->listed[in.arg[0]] = analysis;
+                        m->routines[num_routines++] = in.arg[0];
+                    }
+                    break;
+                case RET:
+                    if (d)
+                        return;
+                    continue;
+                case PUSH:
+                    if (d == MEMO_MAX_DEPTH)
+                        return;
+                    d++;
+                    break;
+                case POP:
+                    if (!d)
+                        return;
+                    d--;
+                    break;
+                default:
+                    break;
+            }
+            m->work[num_work++] = (struct walk){ pc + in.len, d };
+        }
+    }
+
+    /* Writing to any of its words can change what the routine does */
+    for (size_t i = 0; i < num_insns; i++) {
+        decode_insn(vm->memory, m->insns[i], &in);
+        memset(&m->code[m->insns[i]], true, in.len);
+    }
+
+    m->purity[entry] = PURE;
+    m->uses[entry] = uses;
+    m->writes[entry] = writes;
+}
+
+static bool pure(struct vm *vm, uint16_t entry)
+{
+    if (entry > MAX_INT)        /* a target from a register, past memory */
+        return false;
+    if (vm->memo->purity[entry] == UNKNOWN)
+        analyze(vm, entry);
+    return vm->memo->purity[entry] == PURE;
+}
+
+static size_t hash(uint16_t entry, const uint16_t *in)
+{
+    uint64_t h = 0xcbf29ce484222325;
+
+    h = (h ^ entry) * 0x100000001b3;
+    for (int r = 0; r < REG_NUM; r++)
+        h = (h ^ in[r]) * 0x100000001b3;
+    return h ^ h >> 32;
+}
+
+/* Returns the slot of a call, which is unused if the call is not in the table */
+static struct memo_entry *lookup(struct memo *m, uint16_t entry, const uint16_t *in)
+{
+    size_t i = hash(entry, in) & (m->size - 1);
+    struct memo_entry *e;
+
+    for (;; i = (i + 1) & (m->size - 1)) {
+        e = &m->table[i];
+        if (!e->used || (e->entry == entry && !memcmp(e->in, in, sizeof e->in)))
+            return e;
+    }
+}
+
+/* Makes room for one more entry, forgetting all of them once the table is full */
+static void reserve(struct memo *m)
+{
+    struct memo_entry *old = m->table, *table;
+    size_t old_size = m->size;
+
+    if (m->count + 1 <= m->size / 2)
+        return;
+
+    if (m->size == MEMO_MAX_SIZE || !(table = calloc(2 * m->size, sizeof *table))) {
+        memset(m->table, 0, m->size * sizeof *m->table);
+        m->count = 0;
+        return;
+    }
+
+    m->table = table;
+    m->size *= 2;
+    for (size_t i = 0; i < old_size; i++)
+        if (old[i].used)
+            *lookup(m, old[i].entry, old[i].in) = old[i];
+    free(old);
+}
+
+/*
+ * Takes a call of the pure routine at `entry` from the table and returns
+ * true, or returns false once the call is made, i.e. a frame is started and
+ * the return address pushed
+ */
+static bool enter(struct vm *vm, uint16_t entry, uint16_t next)
+{
+    struct memo *m = vm->memo;
+    struct memo_entry *e;
+    struct frame *frames, *f;
+    uint16_t in[REG_NUM];
+
+    for (int r = 0; r < REG_NUM; r++)
+        in[r] = m->uses[entry] & (1 << r) ? vm->regs[r] : 0;
+
+    e = lookup(m, entry, in);
+    if (e->used) {
+        for (int r = 0; r < REG_NUM; r++)
+            if (m->writes[entry] & (1 << r))
+                vm->regs[r] = e->out[r];
+        return true;
+    }
+
+    if (m->num_frames == m->max_frames) {
+        if (!(frames = realloc(m->frames, 2 * m->max_frames * sizeof *frames)))
+            vm_stop(vm, SYN_TRAP_NOMEM, 0);
+        m->frames = frames;
+        m->max_frames *= 2;
+    }
+    if (!vm_push(vm, next))
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+
+    f = &m->frames[m->num_frames++];
+    f->entry = entry;
+    memcpy(f->in, in, sizeof in);
+    return false;
+}
+
+/* Ends the innermost frame, recording its results */
+static void leave(struct vm *vm)
+{
+    struct memo *m = vm->memo;
+    struct frame *f = &m->frames[--m->num_frames];
+    struct memo_entry *e;
+
+    reserve(m);
+    e = lookup(m, f->entry, f->in);
+    e->used = true;
+    e->entry = f->entry;
+    memcpy(e->in, f->in, sizeof e->in);
+    for (int r = 0; r < REG_NUM; r++)
+        e->out[r] = vm->regs[r];
+    m->count++;
+}
+
+static uint16_t val(const struct vm *vm, const struct insn *in, int n)
+{
+    return is_reg_arg(in, n) ? vm->regs[reg_num(in, n)] : in->arg[n];
+}
+
+bool memo_call(struct vm *vm, uint16_t target, uint16_t next)
+{
+    struct memo *m = vm->memo;
+    struct insn in;
+    uint16_t pc;
+
+    if (!pure(vm, target))
+        return false;
+
+    /* Frames left by a run which stopped in here are stale */
+    m->num_frames = 0;
+
+    vm->mem_offset = next;
+    if (enter(vm, target, next))
+        return true;
+
+    pc = target;
+    for (long steps = 0; steps < MEMO_MAX_STEPS && vm->budget; steps++) {
+        vm->budget--;
+        vm->mem_offset = pc;
+        VM_PUBLISH(vm, pc);
+        decode_insn(vm->memory, pc, &in);
+        next = pc + in.len;
+
+#define DEST vm->regs[reg_num(&in, 0)]
+
+        switch (in.op) {
+            case SET:
+                DEST = val(vm, &in, 1);
+                break;
+            case PUSH:
+                if (!vm_push(vm, val(vm, &in, 0)))
+                    vm_stop(vm, SYN_TRAP_NOMEM, 0);
+                break;
+            case POP:
+                DEST = s_top(vm->prog_stack);
+                s_pop(vm->prog_stack);
+                break;
+            case EQ:
+                DEST = val(vm, &in, 1) == val(vm, &in, 2);
+                break;
+            case GT:
+                DEST = val(vm, &in, 1) > val(vm, &in, 2);
+                break;
+            case JMP:
+                next = in.arg[0];
+                break;
+            case JT:
+                if (val(vm, &in, 0))
+                    next = in.arg[1];
+                break;
+            case JF:
+                if (!val(vm, &in, 0))
+                    next = in.arg[1];
+                break;
+            case ADD:
+                DEST = (val(vm, &in, 1) + val(vm, &in, 2)) % (MAX_INT + 1);
+                break;
+            case MULT:
+                DEST = (val(vm, &in, 1) * val(vm, &in, 2)) % (MAX_INT + 1);
+                break;
+            case MOD:
+                if (!val(vm, &in, 2))
+                    goto hand_back;     /* to do whatever the engine does */
+                DEST = val(vm, &in, 1) % val(vm, &in, 2);
+                break;
+            case AND:
+                DEST = val(vm, &in, 1) & val(vm, &in, 2);
+                break;
+            case OR:
+                DEST = val(vm, &in, 1) | val(vm, &in, 2);
+                break;
+            case NOT:
+                DEST = ~val(vm, &in, 1) & MAX_INT;
+                break;
+            case CALL:
+                if (!pure(vm, in.arg[0]))
+                    goto hand_back;
+                if (!enter(vm, in.arg[0], next))
+                    next = in.arg[0];
+                break;
+            case RET:
+                next = s_top(vm->prog_stack);
+                s_pop(vm->prog_stack);
+                leave(vm);
+                if (!m->num_frames) {
+                    vm->mem_offset = next;
+                    return true;
+                }
+                break;
+            default:
+                break;
+        }
+#undef DEST
+        pc = next;
+    }
+    vm->mem_offset = pc;
+    goto done;
+
+hand_back:
+    /* The engine runs the instruction at pc itself, and counts it then */
+    vm->budget++;
+done:
+    /* The engine goes on from here; the open calls just are not recorded */
+    m->num_frames = 0;
+    return true;
+}
+
+bool memo_pure(struct vm *vm, uint16_t addr)
+{
+    return pure(vm, addr);
+}
+
+void memo_invalidate(struct memo *m, uint16_t addr)
+{
+    if (m->code[addr])
+        memo_reset(m);
+}
+
+void memo_reset(struct memo *m)
+{
+    if (!m)
+        return;
+
+    memset(m->purity, UNKNOWN, sizeof m->purity);
+    memset(m->code, false, sizeof m->code);
+    memset(m->table, 0, m->size * sizeof *m->table);
+    m->count = 0;
+}
+
+void memo_free(struct memo *m)
+{
+    if (!m)
+        return;
+
+    free(m->table);
+    free(m->frames);
+    free(m);
+}
+
+/* Public interface */
+
+int syn_memoize(syn_vm *vm, int on)
+{
+    struct memo *m;
+
+    if (!on) {
+        memo_free(vm->memo);
+        vm->memo = NULL;
+    } else if (!vm->memo) {
+        if (!(m = calloc(1, sizeof *m)) ||
+                !(m->table = calloc(MEMO_MIN_SIZE, sizeof *m->table)) ||
+                !(m->frames = malloc(16 * sizeof *m->frames))) {
+            memo_free(m);
+            return -1;
+        }
+        m->size = MEMO_MIN_SIZE;
+        m->max_frames = 16;
+        vm->memo = m;
+    }
+
+    /* The JIT translates calls it need not stop at */
+    vm_drop_caches(vm);
+    return 0;
+}
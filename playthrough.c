@@ -0,0 +1,344 @@
+/*
+ * A macro benchmark: plays an image through a recorded transcript, from
+ * boot to the end of the game, and times every phase of it. The transcript
+ * is the input the guest reads, one command per line, split into phases by
+ * directives:
+ *
+ *   @phase <name>          starts a phase; the lines before the first one
+ *                          belong to a phase named "boot"
+ *   @reg <reg> <value>     sets a register once the guest waits for input
+ *   # ...                  is a comment, and empty lines are skipped
+ *
+ * A phase queues all of its input and runs until the guest wants more, so
+ * its time is the guest's alone. The guest's output is hashed rather than
+ * shown, and the results are written as JSON.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "synacor.h"
+
+#define MAX_PHASES 32
+#define MAX_REGS 8              /* register settings per phase */
+
+/* A phase which takes more is stuck, most likely in the teleporter's check */
+#define DEFAULT_MAX_INSNS 1000000000ull
+
+struct phase {
+    char name[32];
+    char *input;
+    size_t input_len;
+    int num_regs;
+    struct { int reg; uint16_t value; } regs[MAX_REGS];
+
+    /* Of the fastest run */
+    uint64_t ns;
+    uint64_t insns;
+    uint64_t output_bytes;
+    uint64_t output_hash;
+};
+
+struct output {
+    uint64_t hash;
+    uint64_t bytes;
+    FILE *fp;                   /* also written here, or NULL */
+};
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-e call|switch|threaded|decoded|jit] [-H <hooks file>] [-m]\n"
+        "       [-n <max insns per phase>] [-r <runs>] [-O <output file>] [-p <profile file>]\n"
+        "       <transcript> <exe>\n", prog);
+    exit(1);
+}
+
+static enum syn_engine parse_engine(const char *name, const char *prog)
+{
+    static const char *names[] = { "call", "switch", "threaded", "decoded", "jit" };
+
+    for (size_t i = 0; i < sizeof names / sizeof *names; i++) {
+        if (strcmp(name, names[i]))
+            continue;
+        if (!syn_engine_available(i)) {
+            fprintf(stderr, "ERROR: The %s engine is not available here!\n", name);
+            exit(1);
+        }
+        return i;
+    }
+
+    fprintf(stderr, "ERROR: Unknown engine '%s'\n", name);
+    usage(prog);
+    return SYN_ENGINE_DECODED;
+}
+
+static struct phase *new_phase(struct phase *phases, int *num, const char *name,
+        const char *path, int line)
+{
+    struct phase *ph;
+
+    if (*num == MAX_PHASES) {
+        fprintf(stderr, "ERROR: %s:%d: More than %d phases\n", path, line, MAX_PHASES);
+        exit(1);
+    }
+    ph = &phases[(*num)++];
+    memset(ph, 0, sizeof *ph);
+    snprintf(ph->name, sizeof ph->name, "%s", name);
+    return ph;
+}
+
+/* Reads a transcript into phases, or exits. Returns the number of phases. */
+static int read_transcript(const char *path, struct phase *phases)
+{
+    struct phase *ph = NULL;
+    char buf[256], name[32], *p;
+    unsigned reg, value;
+    int num = 0, line = 0;
+    bool named;
+    size_t len;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r"))) {
+        perror(path);
+        exit(1);
+    }
+
+    ph = new_phase(phases, &num, "boot", path, 0);
+    named = false;
+    while (fgets(buf, sizeof buf, fp)) {
+        line++;
+        if (buf[0] == '#' || buf[0] == '\n')
+            continue;
+
+        if (sscanf(buf, "@phase %31s", name) == 1) {
+            /* A phase named before any input replaces the boot phase's name */
+            if (!named && !ph->input_len && !ph->num_regs)
+                snprintf(ph->name, sizeof ph->name, "%s", name);
+            else
+                ph = new_phase(phases, &num, name, path, line);
+            named = true;
+            continue;
+        }
+
+        if (buf[0] == '@') {
+            if (sscanf(buf, "@reg %u %u", &reg, &value) != 2 || reg > 7 ||
+                    value > 32767 || ph->num_regs == MAX_REGS) {
+                fprintf(stderr, "ERROR: %s:%d: Expected '@phase <name>' or "
+                    "'@reg <reg> <value>'\n", path, line);
+                exit(1);
+            }
+            ph->regs[ph->num_regs].reg = reg;
+            ph->regs[ph->num_regs++].value = value;
+            continue;
+        }
+
+        len = strlen(buf);
+        if (!(p = realloc(ph->input, ph->input_len + len))) {
+            perror("transcript");
+            exit(1);
+        }
+        ph->input = p;
+        memcpy(ph->input + ph->input_len, buf, len);
+        ph->input_len += len;
+    }
+
+    fclose(fp);
+    return num;
+}
+
+/* FNV-1a of the guest's output */
+static void hash_output(void *ctx, const char *data, size_t len)
+{
+    struct output *out = ctx;
+
+    for (size_t i = 0; i < len; i++)
+        out->hash = (out->hash ^ (unsigned char)data[i]) * 0x100000001b3u;
+    out->bytes += len;
+    if (out->fp)
+        fwrite(data, 1, len, out->fp);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Plays the whole transcript on a new VM, keeping the fastest time of every
+ * phase. Returns the status the guest stopped with.
+ */
+static enum syn_status play(const char *image, enum syn_engine engine,
+        const char *hooks, int memoize, uint64_t max_insns, FILE *out_fp,
+        const char *profile, struct phase *phases, int num)
+{
+    enum syn_status status = SYN_INPUT;
+    struct output out;
+    struct syn_stats before, after;
+    uint64_t start, ns;
+    syn_vm *vm;
+    FILE *fp;
+    int line;
+
+    if (!(vm = syn_create())) {
+        perror("vm");
+        exit(1);
+    }
+    syn_set_engine(vm, engine);
+    if (hooks && (line = syn_load_hooks(vm, hooks))) {
+        if (line == -1)
+            perror("hooks");
+        else
+            fprintf(stderr, "ERROR: %s:%d: Expected '<address> <hook>'\n", hooks, line);
+        exit(1);
+    }
+    if (memoize && syn_memoize(vm, 1)) {
+        perror("memoize");
+        exit(1);
+    }
+    if (profile && syn_profile(vm, 1)) {
+        perror("profile");
+        exit(1);
+    }
+    if (syn_load(vm, image)) {
+        perror(image);
+        exit(1);
+    }
+    syn_output_callback(vm, hash_output, &out);
+
+    for (int i = 0; i < num && status == SYN_INPUT; i++) {
+        struct phase *ph = &phases[i];
+
+        for (int r = 0; r < ph->num_regs; r++)
+            syn_set_reg(vm, ph->regs[r].reg, ph->regs[r].value);
+        if (ph->input_len && syn_input(vm, ph->input, ph->input_len)) {
+            perror("input");
+            exit(1);
+        }
+
+        out = (struct output){ 0xcbf29ce484222325u, 0, out_fp };
+        syn_stats(vm, &before);
+        start = now_ns();
+        status = syn_run_until_input(vm, max_insns);
+        ns = now_ns() - start;
+        syn_stats(vm, &after);
+
+        if (!ph->ns || ns < ph->ns)
+            ph->ns = ns;
+        ph->insns = after.instructions - before.instructions;
+        ph->output_bytes = out.bytes;
+        ph->output_hash = out.hash;
+    }
+
+    if (profile && (!(fp = fopen(profile, "w")) ||
+            syn_profile_report(vm, fp) || fclose(fp))) {
+        perror(profile);
+        exit(1);
+    }
+
+    if (status == SYN_OK)
+        fprintf(stderr, "ERROR: A phase ran past %llu instructions\n",
+            (unsigned long long)max_insns);
+    else if (status != SYN_INPUT && status != SYN_HALT && status != SYN_END)
+        syn_print_trap(vm, stderr);
+    syn_destroy(vm);
+    return status;
+}
+
+static void print_json(FILE *fp, const char *image, const char *engine,
+        int runs, enum syn_status status, const struct phase *phases, int num)
+{
+    uint64_t ns = 0, insns = 0;
+
+    fprintf(fp, "{\n  \"image\": \"%s\",\n  \"engine\": \"%s\",\n  \"runs\": %d,\n"
+        "  \"status\": \"%s\",\n  \"phases\": [\n", image, engine, runs,
+        syn_status_string(status));
+    for (int i = 0; i < num; i++) {
+        fprintf(fp, "    { \"name\": \"%s\", \"ns\": %llu, \"instructions\": %llu, "
+            "\"output_bytes\": %llu, \"output_hash\": \"%016llx\" }%s\n",
+            phases[i].name, (unsigned long long)phases[i].ns,
+            (unsigned long long)phases[i].insns,
+            (unsigned long long)phases[i].output_bytes,
+            (unsigned long long)phases[i].output_hash, i + 1 < num ? "," : "");
+        ns += phases[i].ns;
+        insns += phases[i].insns;
+    }
+    fprintf(fp, "  ],\n  \"total\": { \"ns\": %llu, \"instructions\": %llu }\n}\n",
+        (unsigned long long)ns, (unsigned long long)insns);
+}
+
+int main(int argc, char **argv)
+{
+    static struct phase phases[MAX_PHASES];
+    enum syn_engine engine = SYN_ENGINE_DECODED;
+    enum syn_status status = SYN_INPUT;
+    const char *hooks = NULL, *engine_name = "decoded", *profile = NULL;
+    FILE *out_fp = NULL;
+    uint64_t max_insns = DEFAULT_MAX_INSNS;
+    int memoize = 0, runs = 1;
+    int opt, num;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "e:H:mn:r:O:p:")) != -1) {
+        switch (opt) {
+            case 'e':
+                engine = parse_engine(optarg, argv[0]);
+                engine_name = optarg;
+                break;
+            case 'H':
+                hooks = optarg;
+                break;
+            case 'm':
+                memoize = 1;
+                break;
+            case 'n':
+                max_insns = strtoull(optarg, &end, 0);
+                if (*end || !max_insns)
+                    usage(argv[0]);
+                break;
+            case 'r':
+                runs = strtol(optarg, &end, 10);
+                if (*end || runs < 1)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                profile = optarg;
+                break;
+            case 'O':
+                if (!(out_fp = fopen(optarg, "w"))) {
+                    perror(optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 2)
+        usage(argv[0]);
+
+    num = read_transcript(argv[optind], phases);
+    for (int i = 0; i < runs; i++) {
+        status = play(argv[optind + 1], engine, hooks, memoize, max_insns, out_fp,
+            profile, phases, num);
+        /* The output and the profile only need writing once */
+        if (out_fp) {
+            fclose(out_fp);
+            out_fp = NULL;
+        }
+        profile = NULL;
+    }
+
+    print_json(stdout, argv[optind + 1], engine_name, runs, status, phases, num);
+
+    for (int i = 0; i < num; i++)
+        free(phases[i].input);
+    return status == SYN_INPUT || status == SYN_HALT ? 0 : 1;
+}
@@ -0,0 +1,350 @@
+/*
+ * The profiler. While vm->profile is set, run() uses the profiling engine in
+ * exec.c, which counts every instruction by address and op code here and
+ * reports its calls and returns, so the instructions can be attributed to
+ * guest routines as well: exclusively to the routine running, inclusively
+ * to every routine on the (shadow) call stack.
+ *
+ * The call tree behind the folded stacks collapses direct recursion into
+ * one node and stops growing at PROFILE_MAX_DEPTH, where the deeper calls
+ * count for the deepest node, so recursive routines like the teleporter
+ * check keep it small.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include "vm.h"
+#include "profile.h"
+#include "decode.h"
+
+#define PROFILE_MAX_DEPTH 256       /* of the call tree */
+#define PROFILE_MAX_NODES (1 << 20)
+#define PROFILE_RET_SEARCH 64       /* frames searched for a return address */
+#define PROFILE_TOP_ADDRS 20        /* hottest addresses reported */
+#define PROFILE_TOP_SEQS 24         /* and sequences of op codes */
+
+/* Sequences of op codes are numbered in base SEQ_BASE, SEQ_NONE ending short ones */
+#define SEQ_NONE NUM_OP_CODES
+#define SEQ_BASE (NUM_OP_CODES + 1)
+#define NUM_SEQS (SEQ_BASE * SEQ_BASE * SEQ_BASE)
+
+const char *profile_func_name(uint16_t func, char buf[8])
+{
+    if (func == PROFILE_TOP)
+        return "(top)";
+    snprintf(buf, 8, "%u", func);
+    return buf;
+}
+
+/* Returns the node for a call to `func` from `parent`, creating it if need be */
+static uint32_t child_node(struct profile *p, uint32_t parent, uint16_t func)
+{
+    struct profile_node *n, *nodes;
+    uint32_t i;
+
+    if (p->nodes[parent].func == func)
+        return parent;
+    for (i = p->nodes[parent].child; i; i = p->nodes[i].sibling)
+        if (p->nodes[i].func == func)
+            return i;
+
+    if (p->nodes[parent].depth == PROFILE_MAX_DEPTH)
+        return parent;
+
+    if (p->num_nodes == p->max_nodes) {
+        if (p->max_nodes == PROFILE_MAX_NODES ||
+                !(nodes = realloc(p->nodes, 2 * p->max_nodes * sizeof *nodes)))
+            return parent;
+        p->nodes = nodes;
+        p->max_nodes *= 2;
+    }
+
+    i = p->num_nodes++;
+    n = &p->nodes[i];
+    memset(n, 0, sizeof *n);
+    n->func = func;
+    n->depth = p->nodes[parent].depth + 1;
+    n->parent = parent;
+    n->sibling = p->nodes[parent].child;
+    p->nodes[parent].child = i;
+    return i;
+}
+
+bool profile_call(struct vm *vm, uint16_t target, uint16_t next)
+{
+    struct profile *p = vm->profile;
+    struct profile_frame *f;
+
+    /* Past the end of memory, the run ends with the call */
+    if (target > MAX_INT)
+        return false;
+
+    p->calls[target]++;
+    if ((vm->hooks || vm->memo) && vm_hook(vm, target, next))
+        return true;
+
+    if (p->depth == p->max_depth) {
+        if (!(f = realloc(p->frames, 2 * p->max_depth * sizeof *f))) {
+            vm->mem_offset = next - 2;
+            vm_stop(vm, SYN_TRAP_NOMEM, 0);
+        }
+        p->frames = f;
+        p->max_depth *= 2;
+    }
+
+    f = &p->frames[p->depth++];
+    f->entered = p->total;
+    f->caller_node = p->node;
+    f->caller_func = p->func;
+    f->func = target;
+    f->ret = next;
+
+    p->active[target]++;
+    p->func = target;
+    p->node = child_node(p, p->node, target);
+    return false;
+}
+
+/*
+ * Returns from the frame the `ret` goes back to, and from every frame above
+ * it. A `ret` to anywhere else (the guest can push any address) stays in the
+ * same routine.
+ */
+void profile_ret(struct profile *p, uint16_t target)
+{
+    struct profile_frame *f;
+    size_t i, end;
+
+    end = p->depth > PROFILE_RET_SEARCH ? p->depth - PROFILE_RET_SEARCH : 0;
+    for (i = p->depth; i > end && p->frames[i - 1].ret != target; i--)
+        ;
+    if (i == end)
+        return;
+
+    while (p->depth >= i) {
+        f = &p->frames[--p->depth];
+        if (!--p->active[f->func])
+            p->inclusive[f->func] += p->total - f->entered;
+        p->func = f->caller_func;
+        p->node = f->caller_node;
+    }
+}
+
+void profile_free(struct profile *p)
+{
+    if (!p)
+        return;
+
+    free(p->frames);
+    free(p->nodes);
+    free(p);
+}
+
+/* Sorts routines or addresses by their count, largest first */
+struct ranked {
+    uint64_t count;
+    uint16_t what;
+};
+
+static int by_count(const void *a, const void *b)
+{
+    const struct ranked *x = a, *y = b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->what < y->what ? -1 : x->what > y->what;
+}
+
+static double share(uint64_t count, uint64_t total)
+{
+    return total ? 100.0 * count / total : 0.0;
+}
+
+/* Whether execution always goes on with the instruction after one with `op` */
+static bool falls_through(uint8_t op)
+{
+    return op != HALT && op != JMP && op != JT && op != JF && op != CALL && op != RET;
+}
+
+/*
+ * Counts the sequences of two and three instructions which run one after
+ * the other as they are in memory now: every run of an instruction which
+ * falls through is one of the sequence it starts. Fills `ranked` and
+ * returns how many there are.
+ */
+static size_t count_seqs(const syn_vm *vm, struct ranked *ranked)
+{
+    const struct profile *p = vm->profile;
+    struct insn in[3];
+    uint64_t *counts;
+    uint16_t pc;
+    size_t n = 0;
+
+    if (!(counts = calloc(NUM_SEQS, sizeof *counts)))
+        return 0;
+
+    for (uint32_t addr = 0; addr < MAX_INT; addr++) {
+        if (!p->addrs[addr] || !decode_insn(vm->memory, addr, &in[0]) ||
+                !falls_through(in[0].op))
+            continue;
+        pc = addr + in[0].len;
+        if (!decode_insn(vm->memory, pc, &in[1]))
+            continue;
+        counts[(in[0].op * SEQ_BASE + in[1].op) * SEQ_BASE + SEQ_NONE] += p->addrs[addr];
+        pc += in[1].len;
+        if (falls_through(in[1].op) && decode_insn(vm->memory, pc, &in[2]))
+            counts[(in[0].op * SEQ_BASE + in[1].op) * SEQ_BASE + in[2].op] += p->addrs[addr];
+    }
+
+    for (int i = 0; i < NUM_SEQS; i++)
+        if (counts[i])
+            ranked[n++] = (struct ranked){ counts[i], i };
+    free(counts);
+    return n;
+}
+
+/* Public interface */
+
+int syn_profile(syn_vm *vm, int on)
+{
+    struct profile *p;
+
+    profile_free(vm->profile);
+    vm->profile = NULL;
+    if (!on)
+        return 0;
+
+    if (!(p = calloc(1, sizeof *p)) ||
+            !(p->frames = malloc(64 * sizeof *p->frames)) ||
+            !(p->nodes = malloc(1024 * sizeof *p->nodes))) {
+        profile_free(p);
+        return -1;
+    }
+    p->max_depth = 64;
+    p->max_nodes = 1024;
+
+    memset(&p->nodes[0], 0, sizeof *p->nodes);
+    p->nodes[0].func = PROFILE_TOP;
+    p->num_nodes = 1;
+    p->func = PROFILE_TOP;
+
+    vm->profile = p;
+    return 0;
+}
+
+int syn_profile_report(const syn_vm *vm, FILE *fp)
+{
+    const struct profile *p = vm->profile;
+    struct ranked *ranked;
+    uint64_t inclusive;
+    uint16_t op;
+    size_t n = 0;
+    char name[8];
+
+    if (!p) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(ranked = malloc((PROFILE_TOP + 1) * sizeof *ranked)))
+        return -1;
+
+    fprintf(fp, "Instructions: %llu\n\n", (unsigned long long)p->total);
+
+    fprintf(fp, "%-8s %14s %7s\n", "op", "count", "share");
+    for (int i = 0; i < NUM_OP_CODES; i++)
+        ranked[i] = (struct ranked){ p->ops[i], i };
+    qsort(ranked, NUM_OP_CODES, sizeof *ranked, by_count);
+    for (int i = 0; i < NUM_OP_CODES && ranked[i].count; i++)
+        fprintf(fp, "%-8s %14llu %6.2f%%\n", op_to_string(ranked[i].what),
+            (unsigned long long)ranked[i].count, share(ranked[i].count, p->total));
+
+    fprintf(fp, "\n%-8s %14s %7s  %s\n", "address", "count", "share", "op");
+    for (int i = 0; i <= MAX_INT; i++)
+        ranked[i] = (struct ranked){ p->addrs[i], i };
+    qsort(ranked, MAX_INT + 1, sizeof *ranked, by_count);
+    for (int i = 0; i < PROFILE_TOP_ADDRS && ranked[i].count; i++) {
+        op = vm->memory[ranked[i].what];
+        fprintf(fp, "%-8u %14llu %6.2f%%  %s\n", ranked[i].what,
+            (unsigned long long)ranked[i].count, share(ranked[i].count, p->total),
+            op < NUM_OP_CODES ? op_to_string(op) : "-");
+    }
+
+    /* The format fusegen.c reads its superinstructions from */
+    n = count_seqs(vm, ranked);
+    qsort(ranked, n, sizeof *ranked, by_count);
+    fprintf(fp, "\n%-17s %14s %7s\n", "sequence", "count", "share");
+    for (size_t i = 0; i < n && i < PROFILE_TOP_SEQS; i++) {
+        uint16_t seq = ranked[i].what;
+
+        fprintf(fp, "%-5s %-5s %-5s %14llu %6.2f%%\n", op_to_string(seq / SEQ_BASE / SEQ_BASE),
+            op_to_string(seq / SEQ_BASE % SEQ_BASE),
+            seq % SEQ_BASE == SEQ_NONE ? "" : op_to_string(seq % SEQ_BASE),
+            (unsigned long long)ranked[i].count, share(ranked[i].count, p->total));
+    }
+
+    n = 0;
+    for (int i = 0; i <= PROFILE_TOP; i++)
+        if (p->exclusive[i] || p->calls[i])
+            ranked[n++] = (struct ranked){ p->exclusive[i], i };
+    qsort(ranked, n, sizeof *ranked, by_count);
+
+    fprintf(fp, "\n%-8s %12s %14s %7s %14s %7s\n", "routine", "calls",
+        "exclusive", "share", "inclusive", "share");
+    for (size_t i = 0; i < n; i++) {
+        uint16_t func = ranked[i].what;
+
+        /* Calls which have not returned yet count up to now, the outermost one */
+        if (func == PROFILE_TOP) {
+            inclusive = p->total;
+        } else {
+            inclusive = p->inclusive[func];
+            for (size_t j = 0; j < p->depth; j++) {
+                if (p->frames[j].func == func) {
+                    inclusive += p->total - p->frames[j].entered;
+                    break;
+                }
+            }
+        }
+        fprintf(fp, "%-8s %12llu %14llu %6.2f%% %14llu %6.2f%%\n",
+            profile_func_name(func, name), (unsigned long long)p->calls[func],
+            (unsigned long long)p->exclusive[func], share(p->exclusive[func], p->total),
+            (unsigned long long)inclusive, share(inclusive, p->total));
+    }
+
+    free(ranked);
+    return ferror(fp) ? -1 : 0;
+}
+
+int syn_profile_folded(const syn_vm *vm, FILE *fp)
+{
+    const struct profile *p = vm->profile;
+    uint32_t path[PROFILE_MAX_DEPTH + 1];
+    char name[8];
+    int len;
+
+    if (!p) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < p->num_nodes; i++) {
+        if (!p->nodes[i].self)
+            continue;
+
+        len = 0;
+        for (uint32_t n = i; ; n = p->nodes[n].parent) {
+            path[len++] = n;
+            if (!n)
+                break;
+        }
+        while (len--)
+            fprintf(fp, "%s%c", profile_func_name(p->nodes[path[len]].func, name), len ? ';' : ' ');
+        fprintf(fp, "%llu\n", (unsigned long long)p->nodes[i].self);
+    }
+
+    return ferror(fp) ? -1 : 0;
+}
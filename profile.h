@@ -0,0 +1,123 @@
+#ifndef SYNACOR_PROFILE_H__
+#define SYNACOR_PROFILE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+#include "arch.h"
+#include "vm.h"
+
+/* Stands for the code outside of any call in the per-routine counts */
+#define PROFILE_TOP (MAX_INT + 1)
+
+/*
+ * A node of the call tree: one routine reached along one path of calls.
+ * Nodes are indexes into profile.nodes; node 0 is PROFILE_TOP.
+ */
+struct profile_node {
+    uint64_t self;              /* instructions run here */
+    uint32_t parent, child, sibling;
+    uint16_t func;
+    uint16_t depth;
+};
+
+/* A call the guest has not returned from yet */
+struct profile_frame {
+    uint64_t entered;           /* profile.total at the call */
+    uint32_t caller_node;
+    uint16_t caller_func;
+    uint16_t func;
+    uint16_t ret;               /* the return address the `call` pushed */
+};
+
+struct profile {
+    uint64_t total;
+    uint64_t ops[NUM_OP_CODES];
+    uint64_t addrs[MAX_INT + 1];
+
+    /* Per routine, by entry address */
+    uint64_t calls[PROFILE_TOP + 1];
+    uint64_t exclusive[PROFILE_TOP + 1];
+    uint64_t inclusive[PROFILE_TOP + 1];   /* of the calls returned from */
+    uint32_t active[PROFILE_TOP + 1];      /* frames of the routine */
+
+    uint16_t func;              /* the routine running */
+    uint32_t node;
+
+    struct profile_frame *frames;
+    size_t depth, max_depth;
+
+    struct profile_node *nodes;
+    uint32_t num_nodes, max_nodes;
+};
+
+/* The profiling engine (exec.c) calls these for every instruction and call */
+bool profile_call(struct vm *vm, uint16_t target, uint16_t next);
+void profile_ret(struct profile *p, uint16_t target);
+void profile_free(struct profile *p);
+
+/* Names a routine in reports: its address, or "(top)" for PROFILE_TOP */
+const char *profile_func_name(uint16_t func, char buf[8]);
+
+static inline void profile_step(struct vm *vm, uint16_t pc, uint16_t op)
+{
+    struct profile *p = vm->profile;
+
+    p->total++;
+    p->addrs[pc]++;
+    p->exclusive[p->func]++;
+    p->nodes[p->node].self++;
+    if (op < NUM_OP_CODES)
+        p->ops[op]++;
+    if (op == RET && !s_empty(vm->prog_stack))
+        profile_ret(p, s_top(vm->prog_stack));
+}
+
+/*
+ * The sampling profiler (sample.c). Every engine publishes its program
+ * counter (vm->live_pc); a timer signal takes samples of it and of the
+ * return addresses on the guest stack into a ring buffer, which is emptied
+ * after every run and before the guest's input is read.
+ */
+#define SAMPLE_DEPTH     8          /* routines recorded with a sample */
+#define SAMPLE_SCAN      256        /* stack words looked at for them */
+#define SAMPLE_RING      4096       /* samples waiting to be counted */
+
+struct sample {
+    uint32_t weight;            /* timer periods it stands for */
+    uint16_t pc;
+    uint16_t depth;             /* of the calls, up to SAMPLE_DEPTH */
+    bool truncated;             /* there were more */
+    uint16_t calls[SAMPLE_DEPTH];   /* the routines, innermost first */
+};
+
+struct sample_stack;
+
+struct sampler {
+    const struct vm *vm;        /* whose pc and stack the handler reads */
+    volatile bool running;
+
+    /* The handler fills the ring at head, sample_drain() empties it at tail */
+    struct sample ring[SAMPLE_RING];
+    atomic_uint head, tail;
+    atomic_ulong dropped;
+
+    long interval;              /* between samples, ns of CPU time */
+    timer_t timer;
+    pid_t tid;                  /* the thread the timer is for, or 0 */
+
+    /* The samples counted so far */
+    uint64_t total;
+    uint64_t addrs[MAX_INT + 1];
+    struct sample_stack *stacks;
+    size_t num_stacks, max_stacks;
+};
+
+void sample_enter(struct sampler *s);
+void sample_leave(struct sampler *s);
+void sample_drain(struct sampler *s);
+void sample_free(struct sampler *s);
+
+#endif /* SYNACOR_PROFILE_H__ */
@@ -0,0 +1,24 @@
+#ifndef SYNACOR_PROG_STACK_H__
+#define SYNACOR_PROG_STACK_H__
+
+#include <stdint.h>
+
+/*
+ * cmc_string.h defines its format strings right in the header, so it may only
+ * be included by the one file generating the stack functions (exec.c, which
+ * includes cmc/stack.h first). Everybody else only needs the type.
+ */
+#ifndef CMC_STRING_H
+#define CMC_STRING_H
+typedef struct cmc_string_s
+{
+    char s[200];
+} cmc_string;
+#endif
+
+#include "cmc/stack.h"
+
+/* The guest's stack. The functions are generated in exec.c. */
+STACK_GENERATE_HEADER(s, stack, /* func modifier */, uint16_t)
+
+#endif /* SYNACOR_PROG_STACK_H__ */
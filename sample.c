@@ -0,0 +1,399 @@
+/*
+ * The sampling profiler. A timer on the CPU time of the thread running the
+ * VM raises SIGPROF at a fixed rate, and the handler copies the program
+ * counter the engine has published and the innermost routines on the guest
+ * stack into a ring buffer. It takes no locks and calls nothing, so it is
+ * safe wherever the signal lands. After every run and before input is
+ * read, sample_drain() counts the samples in the ring by address and by
+ * stack of routines.
+ *
+ * The engines publish their program counter only where control moves (see
+ * VM_PUBLISH()), so an address stands for the instructions after it up to
+ * the next jump. A sample takes far less than a microsecond, so sampling
+ * can stay on for whole sessions, with whatever engine is set.
+ *
+ * The routines are the targets of the `call`s just before the return
+ * addresses on the stack. Nothing but the stack is kept to tell those from
+ * pushed values which happen to look like one, so once in a while a sample
+ * may show a routine it is not in.
+ */
+#define _GNU_SOURCE             /* gettid() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "vm.h"
+#include "profile.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define SAMPLE_TOP_ADDRS 20         /* hottest addresses reported */
+
+/* Samples counted per stack of routines */
+struct sample_stack {
+    uint64_t count;             /* 0 for an empty slot */
+    uint16_t depth;
+    bool truncated;
+    uint16_t calls[SAMPLE_DEPTH];
+};
+
+/* The sampler of the VM running on this thread */
+static __thread struct sampler *current __attribute__((tls_model("initial-exec")));
+
+/* What SIGPROF did before sampling took it, for the signals of others */
+static struct sigaction previous;
+
+/* The value our timers send along, to tell their signals from others' */
+static char timer_tag;
+
+/* Passes a SIGPROF which is not from our timers on, as if we were not here */
+static void forward(int sig, siginfo_t *info, void *context)
+{
+    if (previous.sa_flags & SA_SIGINFO)
+        previous.sa_sigaction(sig, info, context);
+    else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+        previous.sa_handler(sig);
+}
+
+/* Records the routines on the stack of `vm`, innermost first */
+static void take_calls(struct sample *sample, const struct vm *vm)
+{
+    const stack *st = vm->prog_stack;
+    size_t n, end;
+    uint16_t ret, func;
+
+    sample->depth = 0;
+    sample->truncated = true;
+    if (vm->stack_moving)
+        return;
+    atomic_signal_fence(memory_order_acquire);
+
+    /* Recursive calls count once, and calls too deep to be kept as the deepest one */
+    n = st->count < st->capacity ? st->count : st->capacity;
+    end = n > SAMPLE_SCAN ? n - SAMPLE_SCAN : 0;
+    while (n > end && sample->depth < SAMPLE_DEPTH) {
+        ret = st->buffer[--n];
+        if (ret < 2 || ret > MAX_INT || vm->memory[ret - 2] != CALL ||
+                (func = vm->memory[ret - 1]) > MAX_INT)
+            continue;
+        if (!sample->depth || sample->calls[sample->depth - 1] != func)
+            sample->calls[sample->depth++] = func;
+    }
+    sample->truncated = n > 0;
+}
+
+static void on_timer(int sig, siginfo_t *info, void *context)
+{
+    struct sampler *s = current;
+    struct sample *sample;
+    unsigned head;
+
+    if (info->si_code != SI_TIMER || info->si_value.sival_ptr != &timer_tag) {
+        forward(sig, info, context);
+        return;
+    }
+    if (!s || !s->running)
+        return;
+
+    head = atomic_load_explicit(&s->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&s->tail, memory_order_acquire) == SAMPLE_RING) {
+        atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    /* CPU time timers only fire on a scheduler tick, often late */
+    sample = &s->ring[head % SAMPLE_RING];
+    sample->weight = 1 + info->si_overrun;
+    sample->pc = s->vm->live_pc;
+    take_calls(sample, s->vm);
+
+    atomic_store_explicit(&s->head, head + 1, memory_order_release);
+}
+
+static void install_handler(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = on_timer;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, &previous);
+}
+
+/* Starts a timer on the CPU time of the calling thread. Returns 0 or -1. */
+static int start_timer(struct sampler *s)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct itimerspec spec = { 0 };
+    struct sigevent event;
+
+    pthread_once(&once, install_handler);
+
+    if (s->tid) {
+        timer_delete(s->timer);
+        s->tid = 0;
+    }
+
+    memset(&event, 0, sizeof event);
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = &timer_tag;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &s->timer))
+        return -1;
+
+    spec.it_interval.tv_sec = s->interval / 1000000000;
+    spec.it_interval.tv_nsec = s->interval % 1000000000;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(s->timer, 0, &spec, NULL)) {
+        timer_delete(s->timer);
+        return -1;
+    }
+
+    s->tid = gettid();
+    return 0;
+}
+
+static size_t hash_stack(const struct sample *sample)
+{
+    size_t h = sample->depth * 2 + sample->truncated;
+
+    for (int i = 0; i < sample->depth; i++)
+        h = h * 31 + sample->calls[i];
+    return h * 0x9e3779b97f4a7c15u;
+}
+
+/* Returns the slot counting the stack of `sample`, or NULL if out of memory */
+static struct sample_stack *find_stack(struct sampler *s, const struct sample *sample)
+{
+    struct sample_stack *slot, *old = s->stacks;
+    size_t size = s->max_stacks;
+    struct sample key;
+
+    if (2 * (s->num_stacks + 1) > size) {
+        if (!(s->stacks = calloc(size ? 2 * size : 256, sizeof *s->stacks))) {
+            s->stacks = old;
+            return NULL;
+        }
+        s->max_stacks = size ? 2 * size : 256;
+        s->num_stacks = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (!old[i].count)
+                continue;
+            key.depth = old[i].depth;
+            key.truncated = old[i].truncated;
+            memcpy(key.calls, old[i].calls, sizeof key.calls);
+            find_stack(s, &key)->count = old[i].count;
+        }
+        free(old);
+    }
+
+    for (size_t i = hash_stack(sample) % s->max_stacks; ; i = (i + 1) % s->max_stacks) {
+        slot = &s->stacks[i];
+        if (!slot->count) {
+            slot->depth = sample->depth;
+            slot->truncated = sample->truncated;
+            memcpy(slot->calls, sample->calls, sample->depth * sizeof *sample->calls);
+            s->num_stacks++;
+            return slot;
+        }
+        if (slot->depth == sample->depth && slot->truncated == sample->truncated &&
+                !memcmp(slot->calls, sample->calls, sample->depth * sizeof *sample->calls))
+            return slot;
+    }
+}
+
+/* Counts the samples in the ring */
+void sample_drain(struct sampler *s)
+{
+    unsigned tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&s->head, memory_order_acquire);
+    struct sample_stack *slot;
+    const struct sample *sample;
+
+    for (; tail != head; tail++) {
+        sample = &s->ring[tail % SAMPLE_RING];
+        s->total += sample->weight;
+        if (sample->pc <= MAX_INT)
+            s->addrs[sample->pc] += sample->weight;
+        if ((slot = find_stack(s, sample)))
+            slot->count += sample->weight;
+        else
+            atomic_fetch_add_explicit(&s->dropped, sample->weight, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&s->tail, tail, memory_order_release);
+}
+
+void sample_enter(struct sampler *s)
+{
+    /* The timer only sees the CPU time of the thread it was started on */
+    if (s->tid != gettid())
+        start_timer(s);
+
+    current = s;
+    s->running = true;
+}
+
+void sample_leave(struct sampler *s)
+{
+    s->running = false;
+    current = NULL;
+    sample_drain(s);
+}
+
+void sample_free(struct sampler *s)
+{
+    if (!s)
+        return;
+
+    if (s->tid)
+        timer_delete(s->timer);
+    free(s->stacks);
+    free(s);
+}
+
+/* Writes the routines of a stack outermost first, separated by `sep` */
+static void print_stack(FILE *fp, const struct sample_stack *stack, char sep)
+{
+    char name[8];
+
+    fputs(stack->truncated ? "..." : profile_func_name(PROFILE_TOP, name), fp);
+    for (int i = stack->depth; i--; )
+        fprintf(fp, "%c%s", sep, profile_func_name(stack->calls[i], name));
+}
+
+/* Public interface */
+
+int syn_sample(syn_vm *vm, int hz)
+{
+    struct sampler *s;
+
+    sample_free(vm->sampler);
+    vm->sampler = NULL;
+    if (!hz)
+        return 0;
+
+    if (hz < 0 || hz > 1000000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(s = calloc(1, sizeof *s)))
+        return -1;
+    s->vm = vm;
+    s->interval = 1000000000 / hz;
+    atomic_init(&s->head, 0);
+    atomic_init(&s->tail, 0);
+    atomic_init(&s->dropped, 0);
+
+    if (start_timer(s)) {
+        sample_free(s);
+        return -1;
+    }
+
+    vm->sampler = s;
+    return 0;
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const struct sample_stack *x = *(const struct sample_stack *const *)a;
+    const struct sample_stack *y = *(const struct sample_stack *const *)b;
+
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/* Sorts addresses by their samples, most first */
+struct ranked {
+    uint64_t count;
+    uint16_t addr;
+};
+
+static int by_samples(const void *a, const void *b)
+{
+    const struct ranked *x = a, *y = b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+int syn_sample_report(const syn_vm *vm, FILE *fp)
+{
+    const struct sampler *s = vm->sampler;
+    const struct sample_stack **stacks;
+    struct ranked *addrs;
+    uint16_t op;
+    size_t n = 0;
+
+    if (!s) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(addrs = malloc((MAX_INT + 1) * sizeof *addrs)))
+        return -1;
+    if (!(stacks = malloc((s->num_stacks + 1) * sizeof *stacks))) {
+        free(addrs);
+        return -1;
+    }
+
+    fprintf(fp, "Samples: %llu, one per %ldus of CPU time (%lu dropped)\n\n",
+        (unsigned long long)s->total, s->interval / 1000,
+        (unsigned long)atomic_load((atomic_ulong *)&s->dropped));
+
+    for (int i = 0; i <= MAX_INT; i++)
+        addrs[i] = (struct ranked){ s->addrs[i], i };
+    qsort(addrs, MAX_INT + 1, sizeof *addrs, by_samples);
+    fprintf(fp, "%-8s %10s %7s  %s\n", "address", "samples", "share", "op");
+    for (int i = 0; i < SAMPLE_TOP_ADDRS && addrs[i].count; i++) {
+        op = vm->memory[addrs[i].addr];
+        fprintf(fp, "%-8u %10llu %6.2f%%  %s\n", addrs[i].addr,
+            (unsigned long long)addrs[i].count, 100.0 * addrs[i].count / s->total,
+            op < NUM_OP_CODES ? op_to_string(op) : "-");
+    }
+
+    for (size_t i = 0; i < s->max_stacks; i++)
+        if (s->stacks[i].count)
+            stacks[n++] = &s->stacks[i];
+    qsort(stacks, n, sizeof *stacks, by_count);
+    fprintf(fp, "\n%10s %7s  %s\n", "samples", "share", "routines");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(fp, "%10llu %6.2f%%  ", (unsigned long long)stacks[i]->count,
+            100.0 * stacks[i]->count / s->total);
+        print_stack(fp, stacks[i], ' ');
+        fputc('\n', fp);
+    }
+
+    free(stacks);
+    free(addrs);
+    return ferror(fp) ? -1 : 0;
+}
+
+int syn_sample_folded(const syn_vm *vm, FILE *fp)
+{
+    const struct sampler *s = vm->sampler;
+
+    if (!s) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < s->max_stacks; i++) {
+        if (!s->stacks[i].count)
+            continue;
+        print_stack(fp, &s->stacks[i], ';');
+        fprintf(fp, " %llu\n", (unsigned long long)s->stacks[i].count);
+    }
+
+    return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Snapshots of the complete machine state: memory, registers, program
+ * counter, stack and how the last run ended.
+ *
+ * A snapshot file is a header followed by memory and stack, all of it
+ * little-endian 16-bit words:
+ *
+ *   magic "SYNS", version, pc, status, trap value, r0-r7,
+ *   number of memory words (2 words), number of stack words (2 words),
+ *   memory, stack
+ *
+ * Memory is stored up to its last nonzero word only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include "vm.h"
+#include "image.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC   "SYNS"
+#define SNAPSHOT_VERSION 1
+
+struct syn_snapshot {
+    uint16_t memory[MAX_INT + 1];
+    uint16_t regs[REG_NUM];
+    uint16_t pc;
+    enum syn_status status;
+    uint16_t trap_value;
+    struct image *image;        /* memory, shared once it is first restored */
+    size_t stack_len;
+    uint16_t stack[];
+};
+
+struct snapshot_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t pc;
+    uint16_t status;
+    uint16_t trap_value;
+    uint16_t regs[REG_NUM];
+    uint16_t memory_len[2];
+    uint16_t stack_len[2];
+};
+
+static struct syn_snapshot *snapshot_new(size_t stack_len)
+{
+    struct syn_snapshot *snap;
+
+    if (!(snap = malloc(sizeof *snap + stack_len * sizeof *snap->stack)))
+        return NULL;
+    snap->image = NULL;
+    snap->stack_len = stack_len;
+    return snap;
+}
+
+syn_snapshot *syn_snapshot_take(const syn_vm *vm)
+{
+    const stack *s = vm->prog_stack;
+    struct syn_snapshot *snap;
+
+    if (!(snap = snapshot_new(s->count)))
+        return NULL;
+
+    memcpy(snap->memory, vm->memory, sizeof snap->memory);
+    memcpy(snap->regs, vm->regs, sizeof snap->regs);
+    memcpy(snap->stack, s->buffer, s->count * sizeof *snap->stack);
+    snap->pc = vm->mem_offset;
+    snap->status = vm->status;
+    snap->trap_value = vm->trap_value;
+
+    return snap;
+}
+
+void syn_snapshot_free(syn_snapshot *snap)
+{
+    if (snap)
+        image_put(snap->image);
+    free(snap);
+}
+
+/*
+ * Restores memory. A VM with nothing cached maps the snapshot's image, which
+ * all VMs it is restored to share, unless it has that mapped already.
+ * Otherwise only the words which differ are written, so that the pages
+ * which do not change stay shared and the engines' caches keep what they
+ * hold for them. Returns 0, or -1 if out of memory.
+ */
+static int restore_memory(struct vm *vm, const struct syn_snapshot *snap)
+{
+    /* The image is created on demand, under image.c's lock */
+    struct image **slot = &((struct syn_snapshot *)snap)->image;
+    struct image *img;
+
+    if (!vm->icache && !vm->jit && !vm->verified && !vm->memo) {
+        img = image_get_once(slot, snap->memory);
+        if (!img || img != vm->image)
+            return vm_set_memory(vm, img, snap->memory);
+        image_put(img);
+    }
+
+    for (uint32_t addr = 0; addr <= MAX_INT; addr++)
+        vm_poke(vm, addr, snap->memory[addr]);
+    return 0;
+}
+
+int syn_snapshot_restore(syn_vm *vm, const syn_snapshot *snap)
+{
+    stack *s = vm->prog_stack;
+    uint16_t *buffer;
+
+    if (snap->stack_len > s->capacity) {
+        if (!(buffer = realloc(s->buffer, snap->stack_len * sizeof *buffer)))
+            return -1;
+        s->buffer = buffer;
+        s->capacity = snap->stack_len;
+    }
+
+    if (restore_memory(vm, snap))
+        return -1;
+    memcpy(s->buffer, snap->stack, snap->stack_len * sizeof *snap->stack);
+    s->count = snap->stack_len;
+    for (int r = 0; r < REG_NUM; r++)
+        vm->regs[r] = snap->regs[r];
+    vm->mem_offset = snap->pc;
+    vm->status = snap->status;
+    vm->trap_value = snap->trap_value;
+    vm->input_len = vm->input_pos = 0;
+    vm->out_len = 0;            /* only left over if the sink refused it */
+
+    return 0;
+}
+
+static void put32(uint16_t words[2], uint32_t v)
+{
+    words[0] = htole16(v & 0xffff);
+    words[1] = htole16(v >> 16);
+}
+
+static uint32_t get32(const uint16_t words[2])
+{
+    return le16toh(words[0]) | (uint32_t)le16toh(words[1]) << 16;
+}
+
+void snapshot_write(const struct syn_snapshot *snap, FILE *fp)
+{
+    struct snapshot_header h;
+    uint32_t memory_len = MAX_INT + 1;
+    uint16_t word;
+
+    while (memory_len && !snap->memory[memory_len - 1])
+        memory_len--;
+
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+    h.version = htole16(SNAPSHOT_VERSION);
+    h.pc = htole16(snap->pc);
+    h.status = htole16(snap->status);
+    h.trap_value = htole16(snap->trap_value);
+    for (int r = 0; r < REG_NUM; r++)
+        h.regs[r] = htole16(snap->regs[r]);
+    put32(h.memory_len, memory_len);
+    put32(h.stack_len, snap->stack_len);
+
+    fwrite(&h, sizeof h, 1, fp);
+    for (size_t i = 0; i < memory_len; i++) {
+        word = htole16(snap->memory[i]);
+        fwrite(&word, sizeof word, 1, fp);
+    }
+    for (size_t i = 0; i < snap->stack_len; i++) {
+        word = htole16(snap->stack[i]);
+        fwrite(&word, sizeof word, 1, fp);
+    }
+}
+
+struct syn_snapshot *snapshot_read(FILE *fp)
+{
+    struct syn_snapshot *snap = NULL;
+    struct snapshot_header h;
+    uint32_t memory_len, stack_len;
+    int err = EINVAL;
+
+    if (fread(&h, sizeof h, 1, fp) != 1 ||
+            memcmp(h.magic, SNAPSHOT_MAGIC, sizeof h.magic) ||
+            le16toh(h.version) != SNAPSHOT_VERSION ||
+            le16toh(h.status) > SYN_TRAP_ADDR)
+        goto fail;
+
+    memory_len = get32(h.memory_len);
+    stack_len = get32(h.stack_len);
+    if (memory_len > MAX_INT + 1)
+        goto fail;
+
+    if (!(snap = snapshot_new(stack_len))) {
+        err = errno;
+        goto fail;
+    }
+
+    memset(snap->memory, 0, sizeof snap->memory);
+    if (fread(snap->memory, sizeof *snap->memory, memory_len, fp) != memory_len ||
+            fread(snap->stack, sizeof *snap->stack, stack_len, fp) != stack_len)
+        goto fail;
+
+    for (size_t i = 0; i < memory_len; i++)
+        snap->memory[i] = le16toh(snap->memory[i]);
+    for (size_t i = 0; i < stack_len; i++)
+        snap->stack[i] = le16toh(snap->stack[i]);
+    for (int r = 0; r < REG_NUM; r++)
+        snap->regs[r] = le16toh(h.regs[r]);
+    snap->pc = le16toh(h.pc);
+    snap->status = le16toh(h.status);
+    snap->trap_value = le16toh(h.trap_value);
+
+    return snap;
+
+fail:
+    if (ferror(fp))
+        err = errno;
+    free(snap);
+    errno = err;
+    return NULL;
+}
+
+int syn_snapshot_save(const syn_snapshot *snap, const char *path)
+{
+    FILE *fp;
+    int err;
+
+    if (!(fp = fopen(path, "wb")))
+        return -1;
+
+    snapshot_write(snap, fp);
+    err = ferror(fp) ? errno : 0;
+    if (fclose(fp) && !err)
+        err = errno;
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+syn_snapshot *syn_snapshot_load(const char *path)
+{
+    struct syn_snapshot *snap;
+    FILE *fp;
+    int err;
+
+    if (!(fp = fopen(path, "rb")))
+        return NULL;
+
+    snap = snapshot_read(fp);
+    err = errno;
+    fclose(fp);
+    errno = err;
+    return snap;
+}
@@ -0,0 +1,14 @@
+#ifndef SYNACOR_SNAPSHOT_H__
+#define SYNACOR_SNAPSHOT_H__
+
+#include <stdio.h>
+#include "synacor.h"
+
+/*
+ * The snapshot file format on an open stream, for files which embed a
+ * snapshot. Errors are left in the stream's error indicator and in errno.
+ */
+void snapshot_write(const struct syn_snapshot *snap, FILE *fp);
+struct syn_snapshot *snapshot_read(FILE *fp);
+
+#endif /* SYNACOR_SNAPSHOT_H__ */
@@ -0,0 +1,198 @@
+/*
+ * Runtime statistics. The counters live in the VM and cost next to nothing:
+ * the instructions of a run are what it took of its budget, `wmem`, pushes
+ * and I/O bump a counter each. The instructions and the time are counted
+ * when a run ends and before the guest's input is read, which may block for
+ * long and does not count as running. Published, the counters are copied to
+ * a page of shared memory each time, under a sequence count, which a
+ * monitor in another process can map and read while the VM goes on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vm.h"
+#include "profile.h"
+
+_Static_assert(SYN_NUM_OPS == NUM_OP_CODES, "SYN_NUM_OPS is out of date");
+
+/* The whole page, so that a monitor can map it without knowing the struct's size */
+static size_t page_size(void)
+{
+    long size = sysconf(_SC_PAGESIZE);
+
+    return size > (long)sizeof(struct syn_stats) ? (size_t)size : sizeof(struct syn_stats);
+}
+
+/*
+ * Copies the counters to the shared page under its sequence count (see
+ * syn_stats_share()). The count is the page's own, so that one left odd by
+ * a process which died while publishing still comes out right.
+ */
+static void publish(struct vm *vm)
+{
+    struct syn_stats *shared = vm->shared;
+    uint32_t seq;
+
+    if (!shared)
+        return;
+
+    seq = __atomic_load_n(&shared->seq, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&shared->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vm->stats.seq = seq;
+    memcpy(shared, &vm->stats, sizeof vm->stats);
+    vm->stats.seq = ++seq;
+    __atomic_store_n(&shared->seq, seq, __ATOMIC_RELEASE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_start(struct vm *vm)
+{
+    vm->counted = vm->budget;
+    vm->counted_at = now_ns();
+    vm->stats.running = 1;
+    publish(vm);
+}
+
+/* Counts the instructions of the run up to `left` of its budget */
+static void count(struct vm *vm, uint64_t left)
+{
+    uint64_t now = now_ns();
+
+    vm->stats.instructions += vm->counted - left;
+    vm->stats.run_ns += now - vm->counted_at;
+    vm->counted = left;
+    vm->counted_at = now;
+}
+
+void stats_pause(struct vm *vm)
+{
+    count(vm, vm->budget);
+    publish(vm);
+    if (vm->sampler)
+        sample_drain(vm->sampler);
+}
+
+void stats_resume(struct vm *vm)
+{
+    vm->counted_at = now_ns();
+}
+
+void stats_stop(struct vm *vm)
+{
+    uint64_t left = vm->budget;
+
+    /* Other than `halt`, the instruction a run stops at has not run */
+    if (left < vm->counted && vm->status != SYN_OK && vm->status != SYN_HALT)
+        left++;
+
+    count(vm, left);
+    vm->stats.runs++;
+    vm->stats.running = 0;
+    if (vm->profile)
+        memcpy(vm->stats.ops, vm->profile->ops, sizeof vm->stats.ops);
+    publish(vm);
+}
+
+/* Public interface */
+
+void syn_stats(const syn_vm *vm, struct syn_stats *stats)
+{
+    *stats = vm->stats;
+}
+
+void syn_stats_read(const struct syn_stats *shared, struct syn_stats *stats)
+{
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        memcpy(stats, (const void *)shared, sizeof *stats);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq % 2 || seq != __atomic_load_n(&shared->seq, __ATOMIC_RELAXED));
+}
+
+int syn_stats_report(const struct syn_stats *stats, FILE *fp)
+{
+    double secs = stats->run_ns / 1e9;
+    uint64_t total = 0;
+
+    fprintf(fp, "Runs:          %llu\n", (unsigned long long)stats->runs);
+    fprintf(fp, "Instructions:  %llu\n", (unsigned long long)stats->instructions);
+    fprintf(fp, "Run time:      %.3fs\n", secs);
+    if (stats->instructions && stats->run_ns)
+        fprintf(fp, "Speed:         %.1f MIPS, %.2fns per instruction\n",
+            stats->instructions / secs / 1e6, (double)stats->run_ns / stats->instructions);
+    fprintf(fp, "wmem:          %llu\n", (unsigned long long)stats->wmem);
+    fprintf(fp, "Stack depth:   %llu words at most\n", (unsigned long long)stats->stack_max);
+    fprintf(fp, "Input:         %llu bytes\n", (unsigned long long)stats->input_bytes);
+    fprintf(fp, "Output:        %llu bytes\n", (unsigned long long)stats->output_bytes);
+    fprintf(fp, "Memory:        %llu of %d pages written, the rest shared\n",
+        (unsigned long long)stats->pages, VM_PAGES);
+    if (stats->fused)
+        fprintf(fp, "Fused:         %llu dispatches saved\n", (unsigned long long)stats->fused);
+
+    for (int i = 0; i < SYN_NUM_OPS; i++)
+        total += stats->ops[i];
+    if (total) {
+        fprintf(fp, "\n%-8s %14s %7s\n", "op", "count", "share");
+        for (int i = 0; i < SYN_NUM_OPS; i++)
+            if (stats->ops[i])
+                fprintf(fp, "%-8s %14llu %6.2f%%\n", op_to_string(i),
+                    (unsigned long long)stats->ops[i], 100.0 * stats->ops[i] / total);
+    }
+
+    return ferror(fp) ? -1 : 0;
+}
+
+int syn_stats_share(syn_vm *vm, const char *name)
+{
+    struct syn_stats *shared;
+    char *copy;
+    int fd, err;
+
+    if (vm->shared) {
+        munmap(vm->shared, page_size());
+        shm_unlink(vm->shared_name);
+        free(vm->shared_name);
+        vm->shared = NULL;
+        vm->shared_name = NULL;
+    }
+    if (!name)
+        return 0;
+
+    if (!(copy = strdup(name)))
+        return -1;
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0644)) == -1) {
+        free(copy);
+        return -1;
+    }
+    if (ftruncate(fd, page_size()) ||
+            (shared = mmap(NULL, page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        err = errno;
+        close(fd);
+        shm_unlink(name);
+        free(copy);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+
+    vm->shared = shared;
+    vm->shared_name = copy;
+    publish(vm);
+    return 0;
+}
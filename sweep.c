@@ -0,0 +1,306 @@
+/*
+ * Parameter sweeps: the same starting state run once for every value of a
+ * register, spread over worker threads, each with its own VM. Workers take
+ * the values in increasing order from a shared counter, and a match cancels
+ * every larger value, runs in progress included, so the sweep ends with the
+ * smallest matching value no matter how the threads are scheduled.
+ *
+ * Runs stop at an address by way of a breakpoint: an op code which is out of
+ * range, written over the instruction there. The engines trap on it without
+ * checking anything on the way.
+ *
+ * With `lockstep` set, a worker takes a batch of values at a time and runs
+ * them side by side (see lockstep.c) until each of them comes to something
+ * the lanes cannot do, then goes on with them one by one as above.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "vm.h"
+#include "lockstep.h"
+
+#define SWEEP_BREAK  0xffff     /* breakpoint op code */
+#define SWEEP_SLICE  (1 << 16)  /* instructions run between cancellation checks */
+
+struct sweep {
+    const syn_snapshot *start;
+    const struct syn_sweep *params;
+    atomic_uint_fast32_t next;  /* the next value to try */
+    atomic_uint_fast32_t best;  /* the smallest match so far, or last + 1 */
+    atomic_int err;             /* errno of the first failure */
+};
+
+struct worker {
+    struct sweep *sweep;
+    syn_vm *vm;
+    struct lockstep *ls;        /* NULL unless the sweep runs in lockstep */
+    pthread_t thread;
+};
+
+static bool contains(const char *data, size_t len, const char *text)
+{
+    size_t n = strlen(text);
+
+    for (size_t i = 0; i + n <= len; i++)
+        if (!memcmp(data + i, text, n))
+            return true;
+    return false;
+}
+
+/* Puts the VM at the start of the run of a value */
+static int prepare(struct sweep *sw, syn_vm *vm, uint16_t value)
+{
+    const struct syn_sweep *p = sw->params;
+
+    if (syn_snapshot_restore(vm, sw->start) ||
+            (p->input && syn_input(vm, p->input, p->input_len)))
+        return -1;
+    syn_output_clear(vm);
+    syn_set_reg(vm, p->reg, value);
+    return 0;
+}
+
+/*
+ * Runs a value on from where the VM is, for `left` more instructions.
+ * Returns whether it matches, or -1 on failure.
+ */
+static int finish(struct sweep *sw, syn_vm *vm, uint16_t value, uint64_t left)
+{
+    const struct syn_sweep *p = sw->params;
+    enum syn_status status;
+    const char *output;
+    uint16_t original = 0;
+    uint64_t slice;
+    size_t len;
+
+    if (p->stop_at >= 0) {
+        original = syn_peek(vm, p->stop_at);
+        syn_poke(vm, p->stop_at, SWEEP_BREAK);
+    }
+
+    do {
+        if (value >= atomic_load(&sw->best))
+            return 0;
+        slice = left < SWEEP_SLICE ? left : SWEEP_SLICE;
+        status = syn_run_until_input(vm, slice);
+        left -= slice;
+    } while (status == SYN_OK && left);
+
+    if (status == SYN_TRAP_NOMEM)
+        return -1;
+
+    if (p->stop_at >= 0) {
+        if (status != SYN_TRAP_OP || vm->trap_value != SWEEP_BREAK)
+            return 0;
+        /* Make it look as if the run stopped right before the instruction */
+        syn_poke(vm, p->stop_at, original);
+        vm->mem_offset = p->stop_at;
+        vm->status = SYN_OK;
+    }
+
+    if (p->match_reg >= 0 && syn_reg(vm, p->match_reg) != p->match_value)
+        return 0;
+
+    output = syn_output_data(vm, &len);
+    if (p->match_output && !contains(output, len, p->match_output))
+        return 0;
+
+    return !p->match || p->match(vm, value, p->ctx);
+}
+
+/* Runs one value. Returns whether it matches, or -1 on failure. */
+static int try_value(struct sweep *sw, syn_vm *vm, uint16_t value)
+{
+    if (prepare(sw, vm, value))
+        return -1;
+    return finish(sw, vm, value, sw->params->max_insns);
+}
+
+/*
+ * Runs the n values from *value on in lockstep, then each of them on its
+ * own. Returns like try_value(), with *value set to the match.
+ */
+static int try_lanes(struct sweep *sw, struct worker *w, uint16_t *value, int n)
+{
+    const struct syn_sweep *p = sw->params;
+    uint16_t values[LOCKSTEP_LANES];
+    uint64_t ran = 0, slice;
+    int64_t done;
+    int ret;
+
+    for (int i = 0; i < n; i++)
+        values[i] = *value + i;
+
+    /* The lanes stop at the breakpoint as they cannot decode it */
+    if (syn_snapshot_restore(w->vm, sw->start))
+        return -1;
+    if (p->stop_at >= 0)
+        syn_poke(w->vm, p->stop_at, SWEEP_BREAK);
+    lockstep_start(w->ls, w->vm, p->reg, values, n);
+
+    do {
+        for (int i = 0; i < n; i++)
+            if (values[i] >= atomic_load(&sw->best))
+                lockstep_stop(w->ls, i);
+        slice = p->max_insns - ran < SWEEP_SLICE ? p->max_insns - ran : SWEEP_SLICE;
+        ran += slice;
+    } while (lockstep_run(w->ls, w->vm, slice) && ran < p->max_insns);
+
+    /* Each lane picks up in the VM where it stopped */
+    for (int i = 0; i < n; i++) {
+        if (values[i] >= atomic_load(&sw->best))
+            return 0;
+        if (prepare(sw, w->vm, values[i]) || (done = lockstep_lane(w->ls, i, w->vm)) < 0)
+            return -1;
+        if ((ret = finish(sw, w->vm, values[i], p->max_insns - done))) {
+            *value = values[i];
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    struct sweep *sw = w->sweep;
+    int batch = w->ls ? LOCKSTEP_LANES : 1;
+    uint_fast32_t value, best;
+    uint16_t match;
+    int ret;
+
+    for (;;) {
+        value = atomic_fetch_add(&sw->next, batch);
+        if (value > sw->params->last || value >= atomic_load(&sw->best))
+            break;
+
+        if (w->ls) {
+            match = value;
+            if (value + batch > (uint_fast32_t)sw->params->last + 1)
+                batch = sw->params->last + 1 - value;
+            ret = try_lanes(sw, w, &match, batch);
+            value = match;
+        } else {
+            ret = try_value(sw, w->vm, value);
+        }
+
+        if (ret == -1) {
+            atomic_store(&sw->err, errno ? errno : ENOMEM);
+            atomic_store(&sw->best, 0);     /* cancels everything */
+            break;
+        }
+
+        best = atomic_load(&sw->best);
+        while (ret && value < best && !atomic_compare_exchange_weak(&sw->best, &best, value))
+            ;
+    }
+
+    return NULL;
+}
+
+/* Returns a worker's VM, or NULL with errno set */
+static syn_vm *worker_vm(const struct syn_sweep *p)
+{
+    syn_vm *vm;
+
+    if (!(vm = syn_create()))
+        return NULL;
+
+    syn_output_memory(vm);
+    if (syn_set_engine(vm, p->engine) ||
+            (p->hooks && syn_load_hooks(vm, p->hooks)) ||
+            (p->memoize && syn_memoize(vm, 1))) {
+        syn_destroy(vm);
+        if (!errno)
+            errno = EINVAL;
+        return NULL;
+    }
+
+    return vm;
+}
+
+/* Public interface */
+
+void syn_sweep_init(struct syn_sweep *p)
+{
+    memset(p, 0, sizeof *p);
+    p->engine = SYN_ENGINE_DECODED;
+    p->reg = 7;
+    p->last = MAX_INT;
+    p->max_insns = SYN_RUN_FOREVER;
+    p->stop_at = -1;
+    p->match_reg = -1;
+}
+
+int syn_sweep(const syn_snapshot *start, const struct syn_sweep *p, uint16_t *found)
+{
+    struct sweep sw = { .start = start, .params = p };
+    struct worker *workers;
+    long threads = p->threads;
+    long started = 0;
+    int err = 0;
+
+    if (p->reg < 0 || p->reg >= REG_NUM || p->first > p->last ||
+            p->stop_at > MAX_INT || p->match_reg >= REG_NUM) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (threads <= 0 && (threads = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        threads = 1;
+    if (threads > (long)p->last - p->first + 1)
+        threads = p->last - p->first + 1;
+
+    if (!(workers = calloc(threads, sizeof *workers)))
+        return -1;
+
+    atomic_init(&sw.next, p->first);
+    atomic_init(&sw.best, (uint_fast32_t)p->last + 1);
+    atomic_init(&sw.err, 0);
+
+    /* Fewer workers than asked for will do, just not none */
+    for (; started < threads; started++) {
+        workers[started].sweep = &sw;
+        if (!(workers[started].vm = worker_vm(p))) {
+            err = errno;
+            break;
+        }
+        if (p->lockstep && !(workers[started].ls = lockstep_new())) {
+            err = ENOMEM;
+            syn_destroy(workers[started].vm);
+            break;
+        }
+        if ((err = pthread_create(&workers[started].thread, NULL, work, &workers[started]))) {
+            lockstep_free(workers[started].ls);
+            syn_destroy(workers[started].vm);
+            break;
+        }
+    }
+    if (started)
+        err = 0;
+
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        lockstep_free(workers[i].ls);
+        syn_destroy(workers[i].vm);
+    }
+    free(workers);
+
+    if (!err)
+        err = atomic_load(&sw.err);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    if (atomic_load(&sw.best) > p->last)
+        return 0;
+    *found = atomic_load(&sw.best);
+    return 1;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "synacor.h"
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-e <engine>] [-j <threads>] [-r <reg>] [-f <first>] [-l <last>]\n"
+        "       [-n <max insns>] [-i <input file>] [-b <addr>] [-R <reg>=<value>]\n"
+        "       [-o <text>] [-H <hooks file>] [-m] [-L] <snapshot or image>\n", prog);
+    exit(1);
+}
+
+static long number(const char *arg, long max, const char *prog)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 0);
+    if (errno || end == arg || *end || n < 0 || n > max) {
+        fprintf(stderr, "ERROR: Bad number '%s'\n", arg);
+        usage(prog);
+    }
+    return n;
+}
+
+static enum syn_engine parse_engine(const char *name, const char *prog)
+{
+    static const char *names[] = { "call", "switch", "threaded", "decoded", "jit" };
+
+    for (size_t i = 0; i < sizeof names / sizeof *names; i++) {
+        if (strcmp(name, names[i]))
+            continue;
+        if (!syn_engine_available(i)) {
+            fprintf(stderr, "ERROR: The %s engine is not available here!\n", name);
+            exit(1);
+        }
+        return i;
+    }
+
+    fprintf(stderr, "ERROR: Unknown engine '%s'\n", name);
+    usage(prog);
+    return SYN_ENGINE_DECODED;
+}
+
+/* Reads a whole file into memory, or exits */
+static char *read_file(const char *path, size_t *len)
+{
+    size_t size = 4096;
+    char *data = NULL, *p;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "rb"))) {
+        perror(path);
+        exit(1);
+    }
+
+    *len = 0;
+    do {
+        if (!(p = realloc(data, size *= 2))) {
+            perror("input");
+            exit(1);
+        }
+        data = p;
+        *len += fread(data + *len, 1, size - *len, fp);
+    } while (*len == size);
+
+    fclose(fp);
+    return data;
+}
+
+/* Snapshots load as such, anything else as an image */
+static syn_snapshot *load_start(const char *path)
+{
+    syn_snapshot *snap;
+    syn_vm *vm;
+
+    if ((snap = syn_snapshot_load(path)) || errno != EINVAL)
+        return snap;
+
+    if (!(vm = syn_create()))
+        return NULL;
+    if (!syn_load(vm, path))
+        snap = syn_snapshot_take(vm);
+    syn_destroy(vm);
+    return snap;
+}
+
+int main(int argc, char **argv)
+{
+    struct syn_sweep sweep;
+    syn_snapshot *start;
+    uint16_t found;
+    char *eq;
+    int opt;
+
+    syn_sweep_init(&sweep);
+
+    while ((opt = getopt(argc, argv, "e:j:r:f:l:n:i:b:R:o:H:mL")) != -1) {
+        switch (opt) {
+            case 'e':
+                sweep.engine = parse_engine(optarg, argv[0]);
+                break;
+            case 'j':
+                sweep.threads = number(optarg, 4096, argv[0]);
+                break;
+            case 'r':
+                sweep.reg = number(optarg, 7, argv[0]);
+                break;
+            case 'f':
+                sweep.first = number(optarg, 32767, argv[0]);
+                break;
+            case 'l':
+                sweep.last = number(optarg, 32767, argv[0]);
+                break;
+            case 'n':
+                sweep.max_insns = strtoull(optarg, NULL, 0);
+                break;
+            case 'i':
+                sweep.input = read_file(optarg, &sweep.input_len);
+                break;
+            case 'b':
+                sweep.stop_at = number(optarg, 32767, argv[0]);
+                break;
+            case 'R':
+                if (!(eq = strchr(optarg, '=')))
+                    usage(argv[0]);
+                *eq = '\0';
+                sweep.match_reg = number(optarg, 7, argv[0]);
+                sweep.match_value = number(eq + 1, 32767, argv[0]);
+                break;
+            case 'o':
+                sweep.match_output = optarg;
+                break;
+            case 'H':
+                sweep.hooks = optarg;
+                break;
+            case 'm':
+                sweep.memoize = 1;
+                break;
+            case 'L':
+                sweep.lockstep = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (!(start = load_start(argv[optind]))) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    switch (syn_sweep(start, &sweep, &found)) {
+        case 1:
+            printf("%u\n", found);
+            break;
+        case 0:
+            fprintf(stderr, "No value matches\n");
+            exit(1);
+        default:
+            perror("sweep");
+            exit(1);
+    }
+
+    syn_snapshot_free(start);
+    return 0;
+}
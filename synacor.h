@@ -0,0 +1,361 @@
+#ifndef SYNACOR_H__
+#define SYNACOR_H__
+
+/*
+ * libsynacor: runs Synacor challenge images inside the calling process.
+ *
+ * Every syn_vm is independent of all others, so any number of them can run
+ * at the same time, each from one thread at a time. A VM runs until its
+ * instruction budget is used up, it waits for input, or it stops for good;
+ * faults in the guest are returned as trap codes and never end the process.
+ *
+ *     syn_vm *vm = syn_create();
+ *
+ *     syn_load(vm, "challenge.bin");
+ *     while (syn_run_until_input(vm, SYN_RUN_FOREVER) == SYN_INPUT)
+ *         syn_input(vm, line, strlen(line));
+ *     syn_destroy(vm);
+ *
+ * Output goes to file descriptor 1 and input, once none is queued with
+ * syn_input(), comes from file descriptor 0, unless other ones are set
+ * below. Output is buffered until the guest waits for input or a run
+ * returns.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define SYN_API __attribute__((visibility("default")))
+#else
+    #define SYN_API
+#endif
+
+typedef struct vm syn_vm;
+typedef struct syn_snapshot syn_snapshot;
+
+/*
+ * I/O callbacks. A writer takes all of `data`; a reader fills up to `size`
+ * bytes of `buf` and returns how many, 0 meaning end of input.
+ */
+typedef void (*syn_write_fn)(void *ctx, const char *data, size_t len);
+typedef size_t (*syn_read_fn)(void *ctx, char *buf, size_t size);
+
+/*
+ * A native implementation of a guest routine, see syn_hook(). Returns 0 once
+ * it has done what the routine does, or nonzero to have the routine run.
+ */
+typedef int (*syn_hook_fn)(syn_vm *vm, void *ctx);
+
+/* An instruction budget which never runs out */
+#define SYN_RUN_FOREVER UINT64_MAX
+
+enum syn_engine {
+    SYN_ENGINE_CALL,        /* one function call per instruction */
+    SYN_ENGINE_SWITCH,      /* inlined handlers in a switch loop */
+    SYN_ENGINE_THREADED,    /* inlined handlers, computed goto dispatch */
+    SYN_ENGINE_DECODED,     /* pre-decoded instruction cache (default) */
+    SYN_ENGINE_JIT          /* x86-64 basic-block JIT */
+};
+
+/* Why a run returned. Everything from SYN_HALT on is final. */
+enum syn_status {
+    SYN_OK,                 /* the instruction budget is used up */
+    SYN_INPUT,              /* waiting for input, see syn_run_until_input() */
+    SYN_HALT,               /* executed `halt` */
+    SYN_END,                /* ran off the end of memory */
+    SYN_TRAP_OP,            /* op code out of range */
+    SYN_TRAP_ARGS,          /* instruction cut short by the end of memory */
+    SYN_TRAP_INT,           /* operand is neither a number nor a register */
+    SYN_TRAP_REG,           /* operand must be a register but is not */
+    SYN_TRAP_UNDERFLOW,     /* `pop` or `ret` on an empty stack */
+    SYN_TRAP_NOMEM,         /* the host ran out of memory */
+    SYN_TRAP_HOOK,          /* a hook and its guest routine disagree */
+    SYN_TRAP_DIV,           /* `mod` by 0 */
+    SYN_TRAP_ADDR           /* `rmem` or `wmem` past the end of memory */
+};
+
+/* Returns a VM with empty memory, or NULL if out of memory */
+SYN_API syn_vm *syn_create(void);
+SYN_API void syn_destroy(syn_vm *vm);
+
+/*
+ * Resets the VM and loads an image into memory. Images larger than memory
+ * are cut off. The image is read, so the file may change afterwards; VMs
+ * which load the same image, and those syn_snapshot_restore() restores the
+ * same memory to, share its pages until they write them, through a copy
+ * which is kept once in the process. Returns 0, or -1 with errno set.
+ */
+SYN_API int syn_load(syn_vm *vm, const char *path);
+SYN_API int syn_load_image(syn_vm *vm, const void *image, size_t size);
+
+/*
+ * Like syn_load(), but also runs the image up to its first `in`, where it
+ * stops with SYN_INPUT (unless it stops for good before). The state there is
+ * cached in `cache_dir`, keyed by a hash of the image, and later loads of the
+ * same image restore it instead of running the guest again. Output printed
+ * on the way is written to stdout either way.
+ */
+SYN_API int syn_load_warm(syn_vm *vm, const char *path, const char *cache_dir);
+
+/* Returns 0, or -1 if `engine` is not available on this host */
+SYN_API int syn_set_engine(syn_vm *vm, enum syn_engine engine);
+SYN_API int syn_engine_available(enum syn_engine engine);
+
+/*
+ * Runs at most `max_insns` instructions. Once the VM has stopped for good,
+ * returns the same final status again without running anything.
+ */
+SYN_API enum syn_status syn_run(syn_vm *vm, uint64_t max_insns);
+
+/*
+ * Like syn_run(), but returns SYN_INPUT instead of reading from stdin when
+ * the guest executes `in` and no input is queued. The `in` is run again by
+ * the next call.
+ */
+SYN_API enum syn_status syn_run_until_input(syn_vm *vm, uint64_t max_insns);
+
+/* Queues input for `in`. Returns 0, or -1 if out of memory. */
+SYN_API int syn_input(syn_vm *vm, const char *data, size_t len);
+
+/*
+ * Sets where input comes from once the queue is empty: read() on a file
+ * descriptor, a copy of `data` (after which input ends), or a callback.
+ * syn_input_memory() returns 0, or -1 if out of memory.
+ */
+SYN_API void syn_input_fd(syn_vm *vm, int fd);
+SYN_API int syn_input_memory(syn_vm *vm, const char *data, size_t len);
+SYN_API void syn_input_callback(syn_vm *vm, syn_read_fn read, void *ctx);
+
+/*
+ * Sets where output goes: write() on a file descriptor, a buffer in the VM
+ * which syn_output_data() returns, or a callback. Buffered output is
+ * flushed to the old destination first.
+ */
+SYN_API void syn_output_fd(syn_vm *vm, int fd);
+SYN_API void syn_output_memory(syn_vm *vm);
+SYN_API void syn_output_callback(syn_vm *vm, syn_write_fn write, void *ctx);
+
+/*
+ * The output collected by syn_output_memory() so far, and a way to drop it.
+ * The data is not NUL-terminated and stays valid until the next run.
+ */
+SYN_API const char *syn_output_data(const syn_vm *vm, size_t *len);
+SYN_API void syn_output_clear(syn_vm *vm);
+
+/* The address of the next instruction to run */
+SYN_API uint16_t syn_pc(const syn_vm *vm);
+
+/* The status of the last run */
+SYN_API enum syn_status syn_last_status(const syn_vm *vm);
+SYN_API const char *syn_status_string(enum syn_status status);
+
+/* Prints the error message for a trap, exactly as syn-run reports it */
+SYN_API void syn_print_trap(const syn_vm *vm, FILE *fp);
+
+/*
+ * Snapshots hold the complete machine state: memory, registers, program
+ * counter, stack and the status of the last run. They are independent of
+ * the VM they were taken from and can be restored into any VM any number of
+ * times. Restoring drops queued input, and output the sink has refused.
+ */
+
+/* Returns a snapshot of `vm`, or NULL if out of memory */
+SYN_API syn_snapshot *syn_snapshot_take(const syn_vm *vm);
+
+/*
+ * Returns 0, or -1 if out of memory, in which case `vm` is unchanged but
+ * for its memory, which is lost if the host could not map it anew
+ */
+SYN_API int syn_snapshot_restore(syn_vm *vm, const syn_snapshot *snap);
+SYN_API void syn_snapshot_free(syn_snapshot *snap);
+
+/*
+ * Writes a snapshot to a file and reads it back. Return 0 and a snapshot
+ * respectively, or -1 and NULL with errno set (EINVAL for a file which is
+ * not a snapshot).
+ */
+SYN_API int syn_snapshot_save(const syn_snapshot *snap, const char *path);
+SYN_API syn_snapshot *syn_snapshot_load(const char *path);
+
+/*
+ * Machine state for hooks and embedders. Registers are 0-7 and addresses
+ * 0-32767; others read as 0 and writes to them are ignored. syn_pop()
+ * returns -1 if the stack is empty, syn_push() -1 if out of memory.
+ */
+SYN_API uint16_t syn_reg(const syn_vm *vm, int r);
+SYN_API void syn_set_reg(syn_vm *vm, int r, uint16_t val);
+SYN_API uint16_t syn_peek(const syn_vm *vm, uint16_t addr);
+SYN_API void syn_poke(syn_vm *vm, uint16_t addr, uint16_t val);
+SYN_API int syn_push(syn_vm *vm, uint16_t val);
+SYN_API int syn_pop(syn_vm *vm);
+
+/*
+ * Hooks replace guest routines with native code. A `call` to `addr` runs
+ * `fn` instead of the routine at `addr`, and execution continues after the
+ * `call` as if the routine had returned; the whole routine counts as one
+ * instruction. A NULL `fn` removes the hook. Returns 0, or -1 if out of
+ * memory or `addr` is not an address.
+ */
+SYN_API int syn_hook(syn_vm *vm, uint16_t addr, syn_hook_fn fn, void *ctx);
+
+/* Returns the hook built into the library under `name`, or NULL */
+SYN_API syn_hook_fn syn_builtin_hook(const char *name);
+
+/*
+ * Sets the built-in hooks a file names, one "<address> <name>" per line
+ * with `#` starting a comment. Returns 0, -1 with errno set if the file
+ * cannot be read, or the number of the first line which is not valid.
+ */
+SYN_API int syn_load_hooks(syn_vm *vm, const char *path);
+
+/*
+ * In verify mode every hooked call runs the guest routine as well, on a copy
+ * of the VM, and the run stops with SYN_TRAP_HOOK unless the hook left
+ * registers, stack and memory exactly as the routine does. This is slow:
+ * the routines are typically hooked because they take forever.
+ */
+SYN_API void syn_verify_hooks(syn_vm *vm, int on);
+
+/*
+ * Memoizes pure routines: calls to routines which only compute on registers
+ * and their own stack (no memory access or I/O, see memo.c) take their
+ * results from earlier calls with the same arguments. A call found there
+ * counts as one instruction; the instructions run to compute one count
+ * against the budget as usual. Returns 0, or -1 if out of memory.
+ */
+SYN_API int syn_memoize(syn_vm *vm, int on);
+
+/*
+ * Profiling counts the instructions run at every address and of every op
+ * code, and attributes them to guest routines by following `call` and
+ * `ret`. While it is on, runs take a profiling variant of the switch engine
+ * whatever engine is set; off, it costs nothing. Turning it on starts over
+ * from zero. Returns 0, or -1 if out of memory.
+ */
+SYN_API int syn_profile(syn_vm *vm, int on);
+
+/*
+ * Writes the counts so far as a table per op code, address and routine, or
+ * as one "<routine>;<routine>;... <count>" line per call stack, the folded
+ * format flame graph tools read. Both return 0, or -1 with errno set if not
+ * profiling or the write fails.
+ */
+SYN_API int syn_profile_report(const syn_vm *vm, FILE *fp);
+SYN_API int syn_profile_folded(const syn_vm *vm, FILE *fp);
+
+/*
+ * Sampling looks at what the guest is doing `hz` times per second of CPU
+ * time of the thread running the VM: where it is, and in which routines. A
+ * SIGPROF timer takes the samples from whatever engine is set, at next to
+ * no cost. The first VM to sample installs a SIGPROF handler for good; it
+ * passes signals not from its timers on to the handler installed before it,
+ * and one installed later has to do the same. 0 turns sampling off; turning
+ * it on starts over. Returns 0, or -1 with errno set.
+ */
+SYN_API int syn_sample(syn_vm *vm, int hz);
+
+/* Like syn_profile_report() and syn_profile_folded(), for the samples */
+SYN_API int syn_sample_report(const syn_vm *vm, FILE *fp);
+SYN_API int syn_sample_folded(const syn_vm *vm, FILE *fp);
+
+/*
+ * Counters every VM keeps at all times. Instructions and time are counted
+ * at the end of every run and whenever the guest waits for input to be
+ * read, the others as they happen, so a long run is best split into runs
+ * of a few million instructions to watch it. The op code counts need
+ * profiling (see syn_profile()), as counting them costs every instruction;
+ * without it they stay 0.
+ */
+#define SYN_STATS_MAGIC 0x53594e53u    /* "SYNS" */
+#define SYN_STATS_VERSION 4
+#define SYN_NUM_OPS 22
+
+struct syn_stats {
+    uint32_t magic;             /* SYN_STATS_MAGIC */
+    uint32_t version;           /* SYN_STATS_VERSION */
+    uint32_t running;           /* 1 while a run is in progress */
+    uint32_t seq;               /* odd while being published, see below */
+    uint64_t runs;              /* runs of a VM which had not stopped for good */
+    uint64_t instructions;      /* retired; hooked calls count as one */
+    uint64_t run_ns;            /* wall-clock time of the runs, but for reading input */
+    uint64_t wmem;              /* `wmem`s executed */
+    uint64_t stack_max;         /* deepest the guest stack has been, in words */
+    uint64_t input_bytes;       /* read by `in` */
+    uint64_t output_bytes;      /* written by `out` */
+    uint64_t ops[SYN_NUM_OPS];  /* instructions per op code, while profiling */
+    uint64_t fused;             /* dispatches saved by superinstructions */
+    uint64_t pages;             /* 4 KiB pages of memory written since the load */
+};
+
+/* Copies the counters of `vm` to `stats` */
+SYN_API void syn_stats(const syn_vm *vm, struct syn_stats *stats);
+
+/*
+ * Writes counters as a table, with the instructions per second of the
+ * runs. Returns 0, or -1 if the write fails.
+ */
+SYN_API int syn_stats_report(const struct syn_stats *stats, FILE *fp);
+
+/*
+ * Publishes the counters in the POSIX shared memory object `name` (see
+ * shm_open(), e.g. "/syn-run.1234"), which is created if need be. It is
+ * one page holding a struct syn_stats, which every run updates, so another
+ * process can map it read-only and watch the VM without stopping it. NULL
+ * stops publishing and removes the object. Returns 0, or -1 with errno set.
+ *
+ * The VM makes `seq` odd (relaxed, then a release fence) before it writes
+ * the other counters and even again after (a release store). A reader
+ * loads `seq` (acquire), copies the struct, issues an acquire fence and
+ * loads `seq` again; the copy is whole if both loads gave the same even
+ * number, and otherwise it has to try again. syn_stats_read() does this.
+ */
+SYN_API int syn_stats_share(syn_vm *vm, const char *name);
+
+/* Copies the counters published at `shared` to `stats`, see above */
+SYN_API void syn_stats_read(const struct syn_stats *shared,
+    struct syn_stats *stats);
+
+/*
+ * Sweeps run a snapshot once for every value of a register, on worker
+ * threads which each have their own VM, and look for the smallest value
+ * whose run matches. A run stops at `stop_at` if that is set, otherwise
+ * when the guest waits for input (after `input` has been read), stops for
+ * good or uses up `max_insns`. It matches if all conditions which are set
+ * hold then; with `stop_at` set, only runs which got there can match.
+ * syn_sweep_init() fills in the defaults noted below.
+ */
+typedef int (*syn_match_fn)(const syn_vm *vm, uint16_t value, void *ctx);
+
+struct syn_sweep {
+    enum syn_engine engine;     /* SYN_ENGINE_DECODED */
+    const char *hooks;          /* hooks file of every worker, or NULL */
+    int memoize;                /* see syn_memoize(), 0 */
+    int threads;                /* 0: one per CPU */
+    int lockstep;               /* runs values side by side in vectors, 0 */
+
+    int reg;                    /* register the value goes to, 7 */
+    uint16_t first, last;       /* values, both included: 0, 32767 */
+    uint64_t max_insns;         /* budget of every run, SYN_RUN_FOREVER */
+    const char *input;          /* queued before every run, or NULL */
+    size_t input_len;
+    int stop_at;                /* address, or -1 */
+
+    int match_reg;              /* register which must hold match_value, or -1 */
+    uint16_t match_value;
+    const char *match_output;   /* text the output must contain, or NULL */
+    syn_match_fn match;         /* returns nonzero for a match, or NULL */
+    void *ctx;
+};
+
+SYN_API void syn_sweep_init(struct syn_sweep *sweep);
+
+/*
+ * Returns 1 and sets *found to the smallest matching value, 0 if no value
+ * matches, or -1 with errno set
+ */
+SYN_API int syn_sweep(const syn_snapshot *start, const struct syn_sweep *sweep,
+    uint16_t *found);
+
+#endif /* SYNACOR_H__ */
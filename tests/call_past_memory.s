@@ -0,0 +1,6 @@
+; `in` at the end of input reads 0xffff, and the call to it runs off the
+; end of memory: the run ends there, with hooks (call_past_memory.hooks) or
+; memoization or neither
+        in r0
+        call r0
+        halt
@@ -0,0 +1,544 @@
+/*
+ * syn-translate: translates a Synacor image into a C program.
+ *
+ * Code is recovered by following every statically known control transfer
+ * from address 0. Each `call` target starts a routine, which becomes one C
+ * function holding all the code reachable from its entry without another
+ * call; jumps within a routine become gotos. Jumps and calls through
+ * registers, returns to unexpected addresses and anything the translator
+ * did not find go through the runtime's dispatcher (translate_rt.c), which
+ * also interprets blocks the guest has overwritten.
+ *
+ * Code only reachable through self-modification or computed addresses cannot
+ * be found statically; extra entry points can be given with -r.
+ *
+ * Usage: syn-translate [-r <addr>]... <image> [<output.c>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <endian.h>
+#include <unistd.h>
+#include "arch.h"
+#include "decode.h"
+
+#define NO_BLOCK -1
+
+static uint16_t memory[MAX_INT + 1];
+
+static size_t image_words;
+
+static struct insn insns[MAX_INT];
+static bool is_insn[MAX_INT];
+static bool is_leader[MAX_INT];
+static bool is_routine[MAX_INT];
+
+struct block {
+    uint16_t start;
+    uint16_t end;
+    bool falls_through;         /* continues at `end` */
+    int routine;                /* entry of a routine containing it, or -1 */
+};
+
+static struct block blocks[MAX_INT];
+static int num_blocks;
+static int block_at[MAX_INT];
+
+static FILE *out;
+
+static void load(const char *path)
+{
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r"))) {
+        perror("fopen");
+        exit(1);
+    }
+
+    image_words = fread(memory, sizeof *memory, MAX_INT + 1, fp);
+    if (ferror(fp)) {
+        perror("fread");
+        exit(1);
+    }
+    for (size_t i = 0; i < image_words; i++)
+        memory[i] = le16toh(memory[i]);
+
+    fclose(fp);
+}
+
+static bool is_reg_arg(const struct insn *in, int n)
+{
+    return in->kinds & (1 << n);
+}
+
+static int reg_arg(const struct insn *in, int n)
+{
+#ifdef FOLDED_REGS
+    return in->arg[n] - MIN_REG;
+#else
+    return in->arg[n];
+#endif
+}
+
+/* Whether control never continues with the next instruction */
+static bool ends_flow(enum opcode op)
+{
+    return op == JMP || op == RET || op == HALT;
+}
+
+static bool ends_block(enum opcode op)
+{
+    return ends_flow(op) || op == JT || op == JF || op == CALL;
+}
+
+/* The fixed jump or call target of `in`, or -1 */
+static int static_target(const struct insn *in)
+{
+    int n;
+
+    switch (in->op) {
+        case JMP: case CALL: n = 0; break;
+        case JT: case JF: n = 1; break;
+        default: return -1;
+    }
+
+    return is_reg_arg(in, n) ? -1 : in->arg[n];
+}
+
+/*
+ * Finds every instruction reachable through fixed control transfers from
+ * `root`, which starts a routine if `routine` is set.
+ */
+static void discover(uint16_t root, bool routine)
+{
+    static uint16_t work[MAX_INT + 1];
+    size_t n = 0;
+
+    work[n++] = root;
+    is_leader[root] = true;
+    if (routine)
+        is_routine[root] = true;
+
+    while (n) {
+        uint16_t pc = work[--n];
+        struct insn *in = &insns[pc];
+        int target;
+
+        if (pc >= MAX_INT || is_insn[pc] || !decode_insn(memory, pc, in))
+            continue;
+        is_insn[pc] = true;
+
+        if ((target = static_target(in)) >= 0 && target < MAX_INT) {
+            is_leader[target] = true;
+            if (in->op == CALL)
+                is_routine[target] = true;
+            work[n++] = target;
+        }
+
+        if (!ends_flow(in->op) && pc + in->len < MAX_INT) {
+            if (ends_block(in->op))
+                is_leader[pc + in->len] = true;
+            work[n++] = pc + in->len;
+        }
+    }
+}
+
+/* Splits the recovered code into basic blocks at the leaders */
+static void find_blocks(void)
+{
+    num_blocks = 0;
+    for (int pc = 0; pc < MAX_INT; pc++)
+        block_at[pc] = NO_BLOCK;
+
+    for (int start = 0; start < MAX_INT; start++) {
+        struct block *b;
+        int pc = start;
+
+        if (!is_leader[start] || !is_insn[start])
+            continue;
+
+        b = &blocks[num_blocks];
+        b->start = start;
+        b->routine = -1;
+        block_at[start] = num_blocks++;
+
+        for (;;) {
+            struct insn *in = &insns[pc];
+
+            pc += in->len;
+            if (ends_block(in->op)) {
+                b->falls_through = !ends_flow(in->op);
+                break;
+            }
+            if (pc >= MAX_INT || !is_insn[pc] || is_leader[pc]) {
+                b->falls_through = true;
+                break;
+            }
+        }
+        b->end = pc;
+    }
+}
+
+/*
+ * Jumps and calls through a register whose value was set from a constant
+ * earlier in the same block (`set r0 1287; call r0`) lead to code the first
+ * pass could not see. Returns whether any new code was discovered.
+ */
+static bool discover_indirect(void)
+{
+    bool found = false;
+
+    for (int i = 0; i < num_blocks; i++) {
+        int known[REG_NUM];
+
+        for (int r = 0; r < REG_NUM; r++)
+            known[r] = -1;
+
+        for (int pc = blocks[i].start; pc < blocks[i].end; pc += insns[pc].len) {
+            struct insn *in = &insns[pc];
+            int n = (in->op == JT || in->op == JF) ? 1 : 0;
+            int target;
+
+            if ((in->op == JMP || in->op == JT || in->op == JF || in->op == CALL) &&
+                    is_reg_arg(in, n) && (target = known[reg_arg(in, n)]) >= 0 &&
+                    target < MAX_INT && !is_insn[target]) {
+                discover(target, in->op == CALL);
+                found = true;
+            }
+
+            if (op_has_dest_reg(in->op))
+                known[reg_arg(in, 0)] = in->op == SET && !is_reg_arg(in, 1) ? in->arg[1] : -1;
+        }
+    }
+
+    return found;
+}
+
+/* Collects the blocks of the routine entered at `entry` into `member` */
+static void find_routine(uint16_t entry, bool *member)
+{
+    static int work[MAX_INT];
+    int n = 0;
+
+    for (int i = 0; i < num_blocks; i++)
+        member[i] = false;
+
+    member[block_at[entry]] = true;
+    work[n++] = block_at[entry];
+
+    while (n) {
+        struct block *b = &blocks[work[--n]];
+        struct insn *last = NULL;
+        int succ[2], nsucc = 0;
+
+        for (int pc = b->start; pc < b->end; pc += insns[pc].len)
+            last = &insns[pc];
+
+        if (last->op != CALL && static_target(last) >= 0)
+            succ[nsucc++] = static_target(last);
+        if (b->falls_through)
+            succ[nsucc++] = b->end;
+
+        for (int i = 0; i < nsucc; i++) {
+            int id = succ[i] < MAX_INT ? block_at[succ[i]] : NO_BLOCK;
+
+            if (id != NO_BLOCK && !member[id]) {
+                member[id] = true;
+                work[n++] = id;
+            }
+        }
+    }
+}
+
+/* Code generation */
+
+static void emit_val(const struct insn *in, int n)
+{
+    if (is_reg_arg(in, n))
+        fprintf(out, "rt_vm.regs[%d]", reg_arg(in, n));
+    else
+        fprintf(out, "%u", in->arg[n]);
+}
+
+/* Continues at a fixed address */
+static void emit_goto(uint16_t target, const bool *member)
+{
+    int id = target < MAX_INT ? block_at[target] : NO_BLOCK;
+
+    if (id != NO_BLOCK && member[id])
+        fprintf(out, "goto L_%u;", target);
+    else
+        fprintf(out, "return %u;", target);
+}
+
+/* Continues at operand n */
+static void emit_jump(const struct insn *in, int n, const bool *member)
+{
+    if (is_reg_arg(in, n)) {
+        fprintf(out, "{ pc = rt_vm.regs[%d]; goto dispatch; }", reg_arg(in, n));
+    } else {
+        emit_goto(in->arg[n], member);
+    }
+}
+
+static void emit_binary(const struct insn *in, const char *fmt_op, bool mod_32768)
+{
+    fprintf(out, "    rt_vm.regs[%d] = (", reg_arg(in, 0));
+    emit_val(in, 1);
+    fprintf(out, " %s ", fmt_op);
+    emit_val(in, 2);
+    fprintf(out, mod_32768 ? ") %% 32768;\n" : ");\n");
+}
+
+static void emit_insn(const struct insn *in, uint16_t pc, const bool *member)
+{
+    uint16_t next = pc + in->len;
+
+    fprintf(out, "    /* %u: %s */\n", pc, op_to_string(in->op));
+
+    switch (in->op) {
+        case HALT:
+            fprintf(out, "    vm_stop(&rt_vm, SYN_HALT, 0);\n");
+            break;
+        case SET:
+            fprintf(out, "    rt_vm.regs[%d] = ", reg_arg(in, 0));
+            emit_val(in, 1);
+            fprintf(out, ";\n");
+            break;
+        case PUSH:
+            fprintf(out, "    rt_push(");
+            emit_val(in, 0);
+            fprintf(out, ");\n");
+            break;
+        case POP:
+            fprintf(out, "    rt_vm.regs[%d] = rt_pop();\n", reg_arg(in, 0));
+            break;
+        case EQ:
+            emit_binary(in, "==", false);
+            break;
+        case GT:
+            emit_binary(in, ">", false);
+            break;
+        case JMP:
+            fprintf(out, "    ");
+            emit_jump(in, 0, member);
+            fprintf(out, "\n");
+            break;
+        case JT:
+        case JF:
+            fprintf(out, "    if (%s", in->op == JF ? "!" : "");
+            emit_val(in, 0);
+            fprintf(out, ")\n        ");
+            emit_jump(in, 1, member);
+            fprintf(out, "\n");
+            break;
+        case ADD:
+            emit_binary(in, "+", true);
+            break;
+        case MULT:
+            fprintf(out, "    rt_vm.regs[%d] = ((uint32_t)", reg_arg(in, 0));
+            emit_val(in, 1);
+            fprintf(out, " * ");
+            emit_val(in, 2);
+            fprintf(out, ") %% 32768;\n");
+            break;
+        case MOD:
+            fprintf(out, "    rt_vm.regs[%d] = rt_mod(", reg_arg(in, 0));
+            emit_val(in, 1);
+            fprintf(out, ", ");
+            emit_val(in, 2);
+            fprintf(out, ");\n");
+            break;
+        case AND:
+            emit_binary(in, "&", false);
+            break;
+        case OR:
+            emit_binary(in, "|", false);
+            break;
+        case NOT:
+            fprintf(out, "    rt_vm.regs[%d] = ~", reg_arg(in, 0));
+            emit_val(in, 1);
+            fprintf(out, " & 32767;\n");
+            break;
+        case RMEM:
+            fprintf(out, "    rt_vm.regs[%d] = rt_rmem(", reg_arg(in, 0));
+            emit_val(in, 1);
+            fprintf(out, ");\n");
+            break;
+        case WMEM:
+            fprintf(out, "    if (rt_wmem(");
+            emit_val(in, 0);
+            fprintf(out, ", ");
+            emit_val(in, 1);
+            fprintf(out, "))\n        return %u;\n", next);
+            break;
+        case CALL:
+            fprintf(out, "    rt_push(%u);\n", next);
+            if (is_reg_arg(in, 0)) {
+                fprintf(out, "    pc = rt_call_indirect(rt_vm.regs[%d]);\n", reg_arg(in, 0));
+            } else {
+                int target = in->arg[0];
+                int id = target < MAX_INT ? block_at[target] : NO_BLOCK;
+
+                if (id != NO_BLOCK)
+                    fprintf(out, "    pc = rt_call(routine_%u, %u);\n", target, target);
+                else
+                    fprintf(out, "    pc = %u;\n", target);
+            }
+            fprintf(out, "    if (pc != %u)\n        goto dispatch;\n", next);
+            break;
+        case RET:
+            fprintf(out, "    return rt_pop();\n");
+            break;
+        case OUT:
+            fprintf(out, "    vm_output(&rt_vm, %u, ", pc);
+            emit_val(in, 0);
+            fprintf(out, ");\n");
+            break;
+        case IN:
+            fprintf(out, "    rt_vm.regs[%d] = vm_input(&rt_vm, %u);\n", reg_arg(in, 0), pc);
+            break;
+        case NOOP:
+            break;
+        default:
+            fprintf(stderr, "INTERNAL ERROR in %s! Unrecognized opcode: %d\n",
+                __func__, in->op);
+            exit(1);
+    }
+}
+
+static void emit_routine(uint16_t entry, bool *member)
+{
+    int prev_end = -1;
+
+    find_routine(entry, member);
+
+    fprintf(out, "\nstatic uint16_t routine_%u(uint16_t pc)\n{\n", entry);
+    fprintf(out, "dispatch: __attribute__((unused));\n    switch (pc) {\n");
+    for (int i = 0; i < num_blocks; i++) {
+        if (member[i])
+            fprintf(out, "        case %u: goto L_%u;\n", blocks[i].start, blocks[i].start);
+    }
+    fprintf(out, "        default: return pc;\n    }\n");
+
+    for (int i = 0; i < num_blocks; i++) {
+        struct block *b = &blocks[i];
+
+        if (!member[i])
+            continue;
+        /* The dispatcher enters a block through its own routine if it has one */
+        if (b->routine < 0 || b->start == entry)
+            b->routine = entry;
+
+        if (prev_end >= 0) {
+            fprintf(out, "    ");
+            emit_goto(prev_end, member);
+            fprintf(out, "\n");
+        }
+
+        fprintf(out, "\nL_%u:\n", b->start);
+        fprintf(out, "    if (stale[%d])\n        return %u;\n", i, b->start);
+        for (int pc = b->start; pc < b->end; pc += insns[pc].len)
+            emit_insn(&insns[pc], pc, member);
+
+        prev_end = b->falls_through ? b->end : -1;
+    }
+
+    if (prev_end >= 0) {
+        fprintf(out, "    ");
+        emit_goto(prev_end, member);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "}\n");
+}
+
+static void emit_program(const char *image)
+{
+    static bool member[MAX_INT];
+
+    fprintf(out, "/* Generated by syn-translate from %s. Do not edit. */\n", image);
+    fprintf(out, "#include \"translate_rt.h\"\n\n");
+    fprintf(out, "static uint8_t stale[%d];\n\n", num_blocks ? num_blocks : 1);
+
+    for (int pc = 0; pc < MAX_INT; pc++) {
+        if (is_routine[pc] && is_insn[pc])
+            fprintf(out, "static uint16_t routine_%u(uint16_t pc);\n", pc);
+    }
+
+    for (int pc = 0; pc < MAX_INT; pc++) {
+        if (is_routine[pc] && is_insn[pc])
+            emit_routine(pc, member);
+    }
+
+    fprintf(out, "\nstatic const struct rt_block blocks[] = {\n");
+    for (int i = 0; i < num_blocks; i++) {
+        fprintf(out, "    { %u, %u, routine_%u },\n",
+            blocks[i].start, blocks[i].end, blocks[i].routine);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "const struct rt_program rt_program = { blocks, stale, %d };\n\n", num_blocks);
+
+    fprintf(out, "const uint16_t rt_image[] = {");
+    for (size_t i = 0; i < image_words; i++)
+        fprintf(out, "%s%u,", i % 12 ? " " : "\n    ", memory[i]);
+    fprintf(out, image_words ? "\n};\n" : " 0 };\n");
+    fprintf(out, "const size_t rt_image_words = %zu;\n", image_words);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-r <addr>]... <image> [<output.c>]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static uint16_t roots[MAX_INT];
+    size_t num_roots = 0;
+    unsigned long addr;
+    char *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+            case 'r':
+                addr = strtoul(optarg, &end, 0);
+                if (*end || addr >= MAX_INT) {
+                    fprintf(stderr, "ERROR: Invalid entry point '%s'\n", optarg);
+                    exit(1);
+                }
+                if (num_roots < MAX_INT)
+                    roots[num_roots++] = addr;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1 && argc - optind != 2)
+        usage(argv[0]);
+
+    load(argv[optind]);
+
+    out = stdout;
+    if (argc - optind == 2 && !(out = fopen(argv[optind + 1], "w"))) {
+        perror("fopen");
+        exit(1);
+    }
+
+    discover(0, true);
+    for (size_t i = 0; i < num_roots; i++)
+        discover(roots[i], true);
+    find_blocks();
+    while (discover_indirect())
+        find_blocks();
+    emit_program(argv[optind]);
+
+    if (fclose(out)) {
+        perror("fclose");
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Runtime for programs generated by syn-translate, see translate_rt.h.
+ *
+ * The dispatcher runs translated code wherever a valid translation starts
+ * and interprets everything else: code the translator could not find
+ * statically, instructions which fault, and blocks which went stale because
+ * the guest wrote to them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "cmc/stack.h"
+#include "translate_rt.h"
+
+STACK_GENERATE_SOURCE(s, stack, /* func modifier */, uint16_t)
+
+struct vm rt_vm;
+static uint16_t rt_memory[MAX_INT + 1];
+rt_routine rt_entry[MAX_INT + 1];
+uint8_t rt_code[MAX_INT + 1];
+int rt_depth;
+
+void rt_stack_underflow(void)
+{
+    vm_stop(&rt_vm, SYN_TRAP_UNDERFLOW, 0);
+}
+
+void rt_trap(enum syn_status status, uint16_t value)
+{
+    vm_stop(&rt_vm, status, value);
+}
+
+/* A translated program is the whole process, so stopping ends it */
+void vm_stop(struct vm *vm, enum syn_status status, uint16_t value)
+{
+    vm->status = status;
+    vm->trap_value = value;
+    vm_flush(vm);
+    if (status > SYN_END) {
+        print_trap(stderr, status, value);
+        exit(1);
+    }
+    exit(0);
+}
+
+/* Marks every block covering `addr` stale. Returns nonzero. */
+int rt_code_written(uint16_t addr)
+{
+    for (size_t i = 0; i < rt_program.num_blocks; i++) {
+        const struct rt_block *b = &rt_program.blocks[i];
+
+        if (b->start <= addr && addr < b->end && !rt_program.stale[i]) {
+            rt_program.stale[i] = 1;
+            rt_entry[b->start] = NULL;
+        }
+    }
+
+    return 1;
+}
+
+void verify_int_or_die(struct vm *vm, uint16_t i)
+{
+    if (i > MAX_INT)
+        vm_stop(vm, SYN_TRAP_INT, i);
+}
+
+void verify_reg_or_die(struct vm *vm, uint16_t addr)
+{
+    if (!is_reg(addr))
+        vm_stop(vm, SYN_TRAP_REG, addr);
+}
+
+/* io.c counts for the statistics of the library, which translated programs do not keep */
+void stats_pause(struct vm *vm)
+{
+    (void)vm;
+}
+
+void stats_resume(struct vm *vm)
+{
+    (void)vm;
+}
+
+static void init(void)
+{
+    rt_vm.sink_fd = 1;
+    rt_vm.memory = rt_memory;
+
+    if (!(rt_vm.prog_stack = s_new(128))) {
+        perror("stack");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < rt_image_words && i <= MAX_INT; i++)
+        rt_vm.memory[i] = rt_image[i];
+
+    for (size_t i = 0; i < rt_program.num_blocks; i++) {
+        const struct rt_block *b = &rt_program.blocks[i];
+
+        rt_entry[b->start] = b->routine;
+        for (uint32_t addr = b->start; addr < b->end; addr++)
+            rt_code[addr] = 1;
+    }
+}
+
+int main(void)
+{
+    struct vm *vm = &rt_vm;
+    uint16_t pc = 0;
+    uint16_t op, a, b, c;
+
+    init();
+
+    for (;;) {
+        while (pc < MAX_INT && rt_entry[pc])
+            pc = rt_entry[pc](pc);
+
+        if (pc >= MAX_INT) {
+            vm->mem_offset = pc;
+            vm_stop(vm, SYN_END, 0);
+        }
+
+        op = vm->memory[pc++];
+
+#define TARGET(op) case op:
+#define DISPATCH() continue
+#define STORE(addr, val) rt_wmem(addr, val)
+#define CALL_HOOK(target, next) 0   /* translated programs have no hooks */
+#define SYNC()                      /* nor a budget */
+#define RELOAD()
+#define PUBLISH()                   /* nor a sampler */
+
+        switch (op) {
+#include "exec_loop.h"
+            default:
+                vm->mem_offset = pc;
+                vm_stop(vm, SYN_TRAP_OP, op);
+        }
+
+#undef TARGET
+#undef DISPATCH
+#undef STORE
+#undef CALL_HOOK
+#undef SYNC
+#undef RELOAD
+#undef PUBLISH
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef SYNACOR_TRANSLATE_RT_H__
+#define SYNACOR_TRANSLATE_RT_H__
+
+/*
+ * Runtime for programs generated by syn-translate. The generated file defines
+ * the image (`rt_image`) and `rt_program`; everything else, including the
+ * single VM translated code runs on, lives in translate_rt.c.
+ *
+ * A routine function takes the address to start at and returns the address
+ * the guest continues at once it leaves the routine, normally the one its
+ * `ret` popped. Callers which are not expecting that address hand it up
+ * until some routine has a label for it, or to the dispatcher in
+ * translate_rt.c, which interprets whatever has no valid translation.
+ */
+
+/* Translated code always uses the split register layout */
+#undef FOLDED_REGS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arch.h"
+#include "prog_stack.h"
+#include "vm.h"
+
+/* Guest calls nest as C calls up to this depth, then go through the dispatcher */
+#define RT_MAX_DEPTH 16384
+
+typedef uint16_t (*rt_routine)(uint16_t pc);
+
+/* A translated basic block: guest words [start, end) */
+struct rt_block {
+    uint16_t start;
+    uint16_t end;
+    rt_routine routine;
+};
+
+struct rt_program {
+    const struct rt_block *blocks;
+    uint8_t *stale;             /* set once a block's words have been written */
+    size_t num_blocks;
+};
+
+extern const uint16_t rt_image[];
+extern const size_t rt_image_words;
+extern const struct rt_program rt_program;
+
+extern struct vm rt_vm;
+extern rt_routine rt_entry[MAX_INT + 1];
+extern uint8_t rt_code[MAX_INT + 1];
+extern int rt_depth;
+
+int rt_code_written(uint16_t addr);
+void rt_stack_underflow(void);
+_Noreturn void rt_trap(enum syn_status status, uint16_t value);
+
+static inline void rt_push(uint16_t val)
+{
+    stack *s = rt_vm.prog_stack;
+
+    if (s->count < s->capacity)
+        s->buffer[s->count++] = val;
+    else if (!s_push(s, val))
+        rt_trap(SYN_TRAP_NOMEM, 0);
+}
+
+static inline uint16_t rt_pop(void)
+{
+    stack *s = rt_vm.prog_stack;
+
+    if (!s->count)
+        rt_stack_underflow();
+    return s->buffer[--s->count];
+}
+
+static inline uint16_t rt_mod(uint16_t a, uint16_t b)
+{
+    if (!b)
+        rt_trap(SYN_TRAP_DIV, 0);
+    return a % b;
+}
+
+static inline uint16_t rt_rmem(uint16_t addr)
+{
+    if (addr > MAX_INT)
+        rt_trap(SYN_TRAP_ADDR, addr);
+    return rt_vm.memory[addr];
+}
+
+/* Returns nonzero if the write hit translated code */
+static inline int rt_wmem(uint16_t addr, uint16_t val)
+{
+    if (addr > MAX_INT)
+        rt_trap(SYN_TRAP_ADDR, addr);
+    rt_vm.memory[addr] = val;
+    return rt_code[addr] ? rt_code_written(addr) : 0;
+}
+
+/* Runs `routine` from `pc`, or leaves it to the dispatcher if nested too deeply */
+static inline uint16_t rt_call(rt_routine routine, uint16_t pc)
+{
+    if (rt_depth >= RT_MAX_DEPTH)
+        return pc;
+
+    rt_depth++;
+    pc = routine(pc);
+    rt_depth--;
+    return pc;
+}
+
+/* call through a register: runs whatever translation starts at `pc` */
+static inline uint16_t rt_call_indirect(uint16_t pc)
+{
+    rt_routine routine = pc <= MAX_INT ? rt_entry[pc] : NULL;
+
+    return routine ? rt_call(routine, pc) : pc;
+}
+
+#endif /* SYNACOR_TRANSLATE_RT_H__ */
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include "vm.h"
+#include "decode.h"
+#include "jit.h"
+#include "image.h"
+#include "profile.h"
+
+/* Returns a VM with zeroed memory and registers, or NULL if out of memory */
+struct vm *vm_new(void)
+{
+    struct vm *vm;
+
+    if (!(vm = calloc(1, sizeof *vm)))
+        return NULL;
+
+    if (!(vm->prog_stack = s_new(128))) {
+        free(vm);
+        return NULL;
+    }
+
+    vm->memory = mmap(NULL, VM_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm->memory == MAP_FAILED) {
+        s_free(vm->prog_stack);
+        free(vm);
+        return NULL;
+    }
+
+#ifdef FOLDED_REGS
+    for (uint16_t i = 0; i <= MAX_INT; i++)
+        vm->operand_file[i] = i;
+    vm->regs = vm->operand_file + MIN_REG;
+#endif
+
+    vm->stats.magic = SYN_STATS_MAGIC;
+    vm->stats.version = SYN_STATS_VERSION;
+    vm->engine = SYN_ENGINE_DECODED;
+    vm->source_fd = 0;
+    vm->sink_fd = 1;
+    return vm;
+}
+
+void vm_drop_caches(struct vm *vm)
+{
+    icache_free(vm->icache);
+    vm->icache = NULL;
+    jit_free(vm->jit);
+    vm->jit = NULL;
+    verified_free(vm->verified);
+    vm->verified = NULL;
+    memo_reset(vm->memo);
+}
+
+void vm_free(struct vm *vm)
+{
+    if (!vm)
+        return;
+
+    syn_stats_share(vm, NULL);
+    vm_drop_caches(vm);
+    hooks_free(vm);
+    memo_free(vm->memo);
+    profile_free(vm->profile);
+    sample_free(vm->sampler);
+    s_free(vm->prog_stack);
+    free(vm->input);
+    free(vm->script);
+    free(vm->output);
+    munmap(vm->memory, VM_MEMORY_SIZE);
+    image_put(vm->image);
+    free(vm);
+}
+
+void vm_poke(struct vm *vm, uint16_t addr, uint16_t val)
+{
+    if (vm->memory[addr] == val)
+        return;
+
+    vm->memory[addr] = val;
+    vm_written(vm, addr);
+    if (vm->icache)
+        icache_invalidate(vm->icache, addr);
+    if (vm->jit)
+        jit_invalidate(vm->jit, addr);
+    if (vm->verified)
+        verified_update(vm->verified, vm->memory, addr);
+    if (vm->memo)
+        memo_invalidate(vm->memo, addr);
+}
+
+/* Memory is about to be replaced as a whole */
+static void forget_memory(struct vm *vm)
+{
+    image_put(vm->image);
+    vm->image = NULL;
+    vm->written = 0;
+    vm->stats.pages = 0;
+}
+
+int vm_set_memory(struct vm *vm, struct image *img, const uint16_t *memory)
+{
+    forget_memory(vm);
+    if (img && !image_map(img, vm->memory)) {
+        vm->image = img;
+        return 0;
+    }
+    image_put(img);
+
+    /* Copied onto fresh zeros, so that pages of zeros take no memory */
+    if (mmap(vm->memory, VM_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        return -1;
+    for (uint32_t addr = 0; addr <= MAX_INT; addr++) {
+        if (memory[addr]) {
+            vm->memory[addr] = memory[addr];
+            vm_written(vm, addr);
+        }
+    }
+    return 0;
+}
+
+void vm_stop(struct vm *vm, enum syn_status status, uint16_t value)
+{
+    vm->status = status;
+    vm->trap_value = value;
+    longjmp(vm->stop, 1);
+}
+
+/* Public interface */
+
+syn_vm *syn_create(void)
+{
+    return vm_new();
+}
+
+void syn_destroy(syn_vm *vm)
+{
+    vm_free(vm);
+}
+
+/* Converts `words` from the little-endian byte order of images */
+static void from_le(uint16_t *memory, size_t words)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+    for (size_t i = 0; i < words; i++)
+        memory[i] = le16toh(memory[i]);
+#else
+    (void)memory;
+    (void)words;
+#endif
+}
+
+/* Everything but memory starts afresh with a new image */
+static void reset(struct vm *vm)
+{
+    for (int r = 0; r < REG_NUM; r++)
+        vm->regs[r] = 0;
+    s_clear(vm->prog_stack);
+    vm->mem_offset = 0;
+    vm->input_len = vm->input_pos = 0;
+    vm->status = SYN_OK;
+}
+
+/*
+ * Images are shared through image.c, in host byte order, so VMs never map
+ * the file they were loaded from: it may change or shrink under them.
+ */
+int syn_load_image(syn_vm *vm, const void *image, size_t size)
+{
+    size_t words = size / sizeof *vm->memory;
+    uint16_t *memory;
+    int ret;
+
+    if (words > MAX_INT + 1)
+        words = MAX_INT + 1;
+
+    if (!(memory = calloc(MAX_INT + 1, sizeof *memory)))
+        return -1;
+    memcpy(memory, image, words * sizeof *memory);
+    from_le(memory, words);
+
+    vm_drop_caches(vm);
+    ret = vm_set_memory(vm, image_get(memory), memory);
+    free(memory);
+    reset(vm);
+
+    return ret;
+}
+
+int syn_load(syn_vm *vm, const char *path)
+{
+    uint16_t *image;
+    size_t words;
+    FILE *fp;
+    int err;
+
+    if (!(image = malloc(VM_MEMORY_SIZE)))
+        return -1;
+
+    if (!(fp = fopen(path, "r"))) {
+        free(image);
+        return -1;
+    }
+
+    words = fread(image, sizeof *image, MAX_INT + 1, fp);
+    err = ferror(fp) ? errno : 0;
+    fclose(fp);
+
+    if (!err && syn_load_image(vm, image, words * sizeof *image))
+        err = errno;
+    free(image);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int syn_engine_available(enum syn_engine engine)
+{
+    return engine_available(engine);
+}
+
+int syn_set_engine(syn_vm *vm, enum syn_engine engine)
+{
+    if (!engine_available(engine))
+        return -1;
+
+    if (engine != vm->engine)
+        vm_drop_caches(vm);
+    vm->engine = engine;
+    return 0;
+}
+
+static enum syn_status run(struct vm *vm, uint64_t max_insns, bool stop_at_input)
+{
+    if (vm->status >= SYN_HALT)
+        return vm->status;
+
+    vm->budget = max_insns;
+    vm->stop_at_input = stop_at_input;
+    stats_start(vm);
+    if (setjmp(vm->stop)) {
+        if (vm->sampler)
+            sample_leave(vm->sampler);
+        if (vm_flush(vm) && vm->status < SYN_HALT)
+            vm->status = SYN_TRAP_NOMEM;
+        stats_stop(vm);
+        return vm->status;
+    }
+
+    /*
+     * Profiling takes an engine of its own, so the others do not pay for it.
+     * Sampling only needs the program counter all engines publish.
+     */
+    if (vm->profile)
+        execute_file_profiled(vm);
+    if (vm->sampler)
+        sample_enter(vm->sampler);
+
+    switch (vm->engine) {
+        case SYN_ENGINE_CALL:
+            execute_file(vm);
+            break;
+        case SYN_ENGINE_SWITCH:
+            execute_file_switch(vm);
+            break;
+        case SYN_ENGINE_THREADED:
+            execute_file_threaded(vm);
+            break;
+        case SYN_ENGINE_DECODED:
+            execute_file_decoded(vm);
+            break;
+        case SYN_ENGINE_JIT:
+            execute_file_jit(vm);
+            break;
+    }
+
+    /* not reached, the engines only return through vm_stop() */
+    return vm->status;
+}
+
+enum syn_status syn_run(syn_vm *vm, uint64_t max_insns)
+{
+    return run(vm, max_insns, false);
+}
+
+enum syn_status syn_run_until_input(syn_vm *vm, uint64_t max_insns)
+{
+    return run(vm, max_insns, true);
+}
+
+uint16_t syn_pc(const syn_vm *vm)
+{
+    return vm->mem_offset;
+}
+
+enum syn_status syn_last_status(const syn_vm *vm)
+{
+    return vm->status;
+}
+
+const char *syn_status_string(enum syn_status status)
+{
+    switch (status) {
+        case SYN_OK: return "ok";
+        case SYN_INPUT: return "input";
+        case SYN_HALT: return "halt";
+        case SYN_END: return "end";
+        case SYN_TRAP_OP: return "bad op code";
+        case SYN_TRAP_ARGS: return "missing arguments";
+        case SYN_TRAP_INT: return "bad number";
+        case SYN_TRAP_REG: return "bad register";
+        case SYN_TRAP_UNDERFLOW: return "stack underflow";
+        case SYN_TRAP_NOMEM: return "out of memory";
+        case SYN_TRAP_HOOK: return "hook mismatch";
+        case SYN_TRAP_DIV: return "division by zero";
+        case SYN_TRAP_ADDR: return "bad address";
+    }
+    return "unknown";
+}
+
+void syn_print_trap(const syn_vm *vm, FILE *fp)
+{
+    print_trap(fp, vm->status, vm->trap_value);
+}
+
+uint16_t syn_reg(const syn_vm *vm, int r)
+{
+    return r >= 0 && r < REG_NUM ? vm->regs[r] : 0;
+}
+
+void syn_set_reg(syn_vm *vm, int r, uint16_t val)
+{
+    if (r >= 0 && r < REG_NUM)
+        vm->regs[r] = val;
+}
+
+uint16_t syn_peek(const syn_vm *vm, uint16_t addr)
+{
+    return addr <= MAX_INT ? vm->memory[addr] : 0;
+}
+
+void syn_poke(syn_vm *vm, uint16_t addr, uint16_t val)
+{
+    if (addr <= MAX_INT)
+        vm_poke(vm, addr, val);
+}
+
+int syn_push(syn_vm *vm, uint16_t val)
+{
+    return vm_push(vm, val) ? 0 : -1;
+}
+
+int syn_pop(syn_vm *vm)
+{
+    int val;
+
+    if (s_empty(vm->prog_stack))
+        return -1;
+    val = s_top(vm->prog_stack);
+    s_pop(vm->prog_stack);
+    return val;
+}
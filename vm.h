@@ -0,0 +1,306 @@
+#ifndef SYNACOR_VM_H__
+#define SYNACOR_VM_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <setjmp.h>
+#include "arch.h"
+#include "prog_stack.h"
+#include "decode.h"
+#include "synacor.h"
+
+struct jit;
+struct image;
+struct hook;
+struct memo;
+struct profile;
+struct sampler;
+
+/* Guest I/O is moved in chunks of this size */
+#define VM_IO_SIZE 4096
+
+/* Where input comes from and output goes to, see syn_input_fd() etc. */
+enum io_kind {
+    IO_FD,
+    IO_MEMORY,
+    IO_CALLBACK
+};
+
+/* The guest's memory, MAX_INT + 1 words */
+#define VM_MEMORY_SIZE ((MAX_INT + 1) * sizeof(uint16_t))
+
+/* Pages of memory as the VM counts them, the usual 4 KiB of the host */
+#define VM_PAGE_WORDS 2048
+#define VM_PAGES ((MAX_INT + 1) / VM_PAGE_WORDS)
+
+/*
+ * The complete state of one guest. Nothing an engine runs on lives outside
+ * of it, so any number of VMs can run side by side, one per thread.
+ *
+ * Engines keep the program counter in a local while they run and store it
+ * in mem_offset whenever they stop; the op_functions[] handlers of the call
+ * engine work on mem_offset directly.
+ */
+struct vm {
+    /*
+     * In host byte order, converted once as images are loaded. A private
+     * mapping of its own, onto which loads and snapshots map a shared image
+     * (image.c), so that VMs running the same image share its pages until
+     * they write them.
+     */
+    uint16_t *memory;
+    struct image *image;        /* mapped over memory, or NULL */
+    uint32_t written;           /* pages written since, one bit each */
+    uint16_t mem_offset;
+#ifdef FOLDED_REGS
+    /*
+     * Operands resolve through a single table: slots 0-32767 hold their own
+     * index (so a literal reads back as itself) and the registers live right
+     * after them in slots 32768-32775. Reading any valid operand is then one
+     * load, with no is_reg() branch.
+     */
+    uint16_t operand_file[MAX_REG + 1];
+    uint16_t *regs;             /* operand_file + MIN_REG */
+#else
+    uint16_t regs[REG_NUM];
+#endif
+    stack *prog_stack;
+
+    enum syn_engine engine;
+    struct icache *icache;      /* decoded engine, created on first use */
+    struct jit *jit;            /* jit engine, created on first use */
+    struct verified *verified;  /* switch and threaded engines, likewise */
+
+    /*
+     * Input for `in`: whatever syn_input() queued, then chunks read from the
+     * source (io.c) whenever the queue runs dry
+     */
+    char *input;
+    size_t input_len, input_pos, input_size;
+    enum io_kind source;
+    int source_fd;
+    syn_read_fn read;
+    void *read_ctx;
+    char *script;               /* IO_MEMORY source */
+    size_t script_len, script_pos;
+
+    /* Output of `out`, buffered until the guest waits for input or stops */
+    char out_buf[VM_IO_SIZE];
+    size_t out_len;
+    enum io_kind sink;
+    int sink_fd;
+    syn_write_fn write;
+    void *write_ctx;
+    char *output;               /* IO_MEMORY sink */
+    size_t output_len, output_size;
+
+    /* Native hooks by guest address (hooks.c), NULL while none is set */
+    struct hook **hooks;
+    bool verify_hooks;
+    struct vm *verify_vm;       /* runs the guest routines in verify mode */
+    struct memo *memo;          /* memoized pure routines (memo.c), or NULL */
+    struct profile *profile;    /* counts while profiling (profile.c), or NULL */
+    struct sampler *sampler;    /* samples while sampling (sample.c), or NULL */
+
+    /* Always kept (stats.c), and copied to the shared page as they are counted */
+    struct syn_stats stats;
+    uint64_t counted;           /* budget left when the run was last counted */
+    uint64_t counted_at;        /* and when, in ns */
+    struct syn_stats *shared;   /* see syn_stats_share(), or NULL */
+    char *shared_name;
+
+    /* The current run */
+    uint64_t budget;            /* instructions it may still execute */
+    volatile uint16_t live_pc;  /* where the engine is, see VM_PUBLISH() */
+    volatile bool stack_moving; /* while vm_push() grows the stack */
+    bool stop_at_input;
+    jmp_buf stop;               /* where vm_stop() returns to */
+
+    /* How the last run ended */
+    enum syn_status status;
+    uint16_t trap_value;        /* offending word, op code for SYN_TRAP_ARGS */
+};
+
+struct vm *vm_new(void);
+void vm_free(struct vm *vm);
+
+/* Drops the engines' caches, which have to go whenever code changes behind their back */
+void vm_drop_caches(struct vm *vm);
+
+/*
+ * Count the instructions and the time of a run: from its start, up to and
+ * from a wait for input, and up to its stop
+ */
+void stats_start(struct vm *vm);
+void stats_pause(struct vm *vm);
+void stats_resume(struct vm *vm);
+void stats_stop(struct vm *vm);
+
+/* Writes a word of memory from outside the engines, keeping their caches valid */
+void vm_poke(struct vm *vm, uint16_t addr, uint16_t val);
+
+/*
+ * Replaces memory by `img` mapped over it, taking the reference, or by a
+ * copy of `memory` if `img` is NULL or cannot be mapped. Returns 0, or -1
+ * if memory is lost; the caller drops the caches first.
+ */
+int vm_set_memory(struct vm *vm, struct image *img, const uint16_t *memory);
+
+/*
+ * Notes a write to the page of `addr`, which the VM holds a copy of from
+ * then on
+ */
+static inline void vm_written(struct vm *vm, uint16_t addr)
+{
+    uint32_t page = UINT32_C(1) << (addr / VM_PAGE_WORDS);
+
+    if (!(vm->written & page)) {
+        vm->written |= page;
+        vm->stats.pages++;
+    }
+}
+
+/*
+ * Ends the current run with `status`. The caller stores the program counter
+ * in mem_offset first. `value` is kept for the trap's error message.
+ */
+_Noreturn void vm_stop(struct vm *vm, enum syn_status status, uint16_t value);
+
+/*
+ * Returns the next input character for the `in` at `pc`, or stops the run
+ * there if syn_run_until_input() finds no queued input. Output is flushed
+ * before the source is read.
+ */
+uint16_t vm_input(struct vm *vm, uint16_t pc);
+
+/* Hands data to the sink. Returns 0, or -1 if out of memory. */
+int vm_write(struct vm *vm, const char *data, size_t len);
+
+/* Empties the output buffer into the sink. Returns 0 or -1 like vm_write(). */
+int vm_flush(struct vm *vm);
+
+/*
+ * Buffers a character the guest outputs with the `out` at `pc`. A full
+ * buffer is flushed first; if that fails the run stops at `pc`.
+ */
+static inline void vm_output(struct vm *vm, uint16_t pc, uint16_t c)
+{
+    if (vm->out_len == VM_IO_SIZE && vm_flush(vm)) {
+        vm->mem_offset = pc;
+        vm_stop(vm, SYN_TRAP_NOMEM, 0);
+    }
+    vm->out_buf[vm->out_len++] = c;
+}
+
+/*
+ * Counts one instruction at `pc` against `left`, the engine's copy of the
+ * budget of the current run
+ */
+#define VM_TICK(vm, left, pc) \
+    do { \
+        if (!(left)) { \
+            (vm)->mem_offset = (pc); \
+            VM_SYNC((vm), (left)); \
+            vm_stop((vm), SYN_OK, 0); \
+        } \
+        (left)--; \
+    } while (0)
+
+/*
+ * Tells the sampler (sample.c) where the engine is. A store on every
+ * instruction would slow down every run, sampled or not, so the engines
+ * publish where a run starts and the targets of jumps, calls and returns,
+ * and the JIT the start of every block; the sampler only needs the routine.
+ */
+#define VM_PUBLISH(vm, pc) ((vm)->live_pc = (pc))
+
+/*
+ * Stores an engine's copy of the budget back in the VM. Engines do this
+ * before anything that may stop the run, so that the instructions it took
+ * can be counted (stats.c); keeping the copy in a local is worth it.
+ */
+#define VM_SYNC(vm, left) ((vm)->budget = (left))
+
+/*
+ * Runs the hook for a `call` to `target`, if there is one, or the call
+ * itself if the routine is memoized, as if the routine had returned to
+ * `next`; the engine goes on at mem_offset then. Returns false if the
+ * engine has to make the call. Engines only call this while vm->hooks or
+ * vm->memo is set.
+ */
+bool vm_hook(struct vm *vm, uint16_t target, uint16_t next);
+void hooks_free(struct vm *vm);
+
+/* Whether a `call` to `addr` has to go through vm_hook() */
+bool vm_call_hooked(struct vm *vm, uint16_t addr);
+
+/*
+ * Memoization (memo.c). memo_call() is vm_hook() for calls without a hook;
+ * memo_invalidate() has to see every write to memory.
+ */
+bool memo_call(struct vm *vm, uint16_t target, uint16_t next);
+bool memo_pure(struct vm *vm, uint16_t addr);
+void memo_invalidate(struct memo *m, uint16_t addr);
+void memo_reset(struct memo *m);
+void memo_free(struct memo *m);
+
+/* Writes a word of memory from the engines */
+static inline void vm_store(struct vm *vm, uint16_t addr, uint16_t val)
+{
+    vm->stats.wmem++;
+    vm->memory[addr] = val;
+    vm_written(vm, addr);
+    if (vm->verified)
+        verified_update(vm->verified, vm->memory, addr);
+    if (vm->memo)
+        memo_invalidate(vm->memo, addr);
+}
+
+/*
+ * Doubles the room of the full guest stack. Returns false if out of memory.
+ * The sampler's signal handler reads the stack, so it is told while the
+ * buffer moves.
+ */
+static inline bool vm_grow_stack(struct vm *vm)
+{
+    stack *s = vm->prog_stack;
+    uint16_t *buffer;
+
+    vm->stack_moving = true;
+    atomic_signal_fence(memory_order_seq_cst);
+    if ((buffer = realloc(s->buffer, 2 * s->capacity * sizeof *buffer))) {
+        s->buffer = buffer;
+        s->capacity *= 2;
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+    vm->stack_moving = false;
+    return buffer != NULL;
+}
+
+/* Pushes onto the guest stack from the engines. Returns false if out of memory. */
+static inline bool vm_push(struct vm *vm, uint16_t val)
+{
+    if (s_full(vm->prog_stack) && !vm_grow_stack(vm))
+        return false;
+    s_push(vm->prog_stack, val);
+    if (vm->prog_stack->count > vm->stats.stack_max)
+        vm->stats.stack_max = vm->prog_stack->count;
+    return true;
+}
+
+/* Operand checks of the engines; a bad operand stops the run */
+void verify_int_or_die(struct vm *vm, uint16_t i);
+void verify_reg_or_die(struct vm *vm, uint16_t addr);
+
+/* The engines (exec.c). They only ever return through vm_stop(). */
+bool engine_available(enum syn_engine engine);
+void execute_file(struct vm *vm);
+void execute_file_switch(struct vm *vm);
+void execute_file_threaded(struct vm *vm);
+void execute_file_decoded(struct vm *vm);
+void execute_file_jit(struct vm *vm);
+void execute_file_profiled(struct vm *vm);
+
+#endif /* SYNACOR_VM_H__ */
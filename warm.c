@@ -0,0 +1,172 @@
+/*
+ * Warm starts: the state of a VM at the first `in` of an image, cached so
+ * that later loads of the same image skip everything the guest does before
+ * it asks for input.
+ *
+ * Cache files are named after a hash of the loaded memory. They hold the
+ * output the guest printed up to that point, followed by the snapshot:
+ *
+ *   magic "SYNW", version, output length (2 words), output, snapshot
+ *
+ * The cache is only ever an optimization; a file which cannot be read or
+ * written makes the load fall back to running the guest.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "vm.h"
+#include "snapshot.h"
+
+#define WARM_MAGIC   "SYNW"
+#define WARM_VERSION 1
+
+struct warm_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t output_len[2];
+};
+
+/* FNV-1a over the bytes of memory */
+static uint64_t image_hash(const uint16_t *memory)
+{
+    const uint8_t *p = (const uint8_t *)memory;
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < (MAX_INT + 1) * sizeof *memory; i++)
+        hash = (hash ^ p[i]) * 0x100000001b3;
+    return hash;
+}
+
+/* Restores the cached state and replays its output. Returns 0 or -1. */
+static int warm_read(struct vm *vm, const char *path)
+{
+    struct syn_snapshot *snap = NULL;
+    struct warm_header h;
+    char *output = NULL;
+    uint32_t output_len;
+    FILE *fp;
+    int ret = -1;
+
+    if (!(fp = fopen(path, "rb")))
+        return -1;
+
+    if (fread(&h, sizeof h, 1, fp) != 1 ||
+            memcmp(h.magic, WARM_MAGIC, sizeof h.magic) ||
+            le16toh(h.version) != WARM_VERSION)
+        goto out;
+
+    output_len = le16toh(h.output_len[0]) | (uint32_t)le16toh(h.output_len[1]) << 16;
+    if (!(output = malloc(output_len ? output_len : 1)) ||
+            fread(output, 1, output_len, fp) != output_len ||
+            !(snap = snapshot_read(fp)) ||
+            syn_snapshot_restore(vm, snap))
+        goto out;
+
+    ret = vm_write(vm, output, output_len);
+
+out:
+    syn_snapshot_free(snap);
+    free(output);
+    fclose(fp);
+    return ret;
+}
+
+/*
+ * Writes the cache file through a temporary one, so readers never see half
+ * of it
+ */
+static void warm_write(struct vm *vm, const char *path, const char *output,
+    size_t output_len)
+{
+    struct syn_snapshot *snap;
+    struct warm_header h;
+    size_t len = strlen(path);
+    char *tmp;
+    FILE *fp;
+    int fd;
+
+    if (!(snap = syn_snapshot_take(vm)))
+        return;
+    if (!(tmp = malloc(len + sizeof ".XXXXXX"))) {
+        syn_snapshot_free(snap);
+        return;
+    }
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".XXXXXX", sizeof ".XXXXXX");
+
+    if ((fd = mkstemp(tmp)) == -1 || !(fp = fdopen(fd, "wb"))) {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        goto out;
+    }
+
+    memcpy(h.magic, WARM_MAGIC, sizeof h.magic);
+    h.version = htole16(WARM_VERSION);
+    h.output_len[0] = htole16(output_len & 0xffff);
+    h.output_len[1] = htole16(output_len >> 16);
+
+    fwrite(&h, sizeof h, 1, fp);
+    fwrite(output, 1, output_len, fp);
+    snapshot_write(snap, fp);
+
+    if (ferror(fp) | fclose(fp) || rename(tmp, path))
+        unlink(tmp);
+
+out:
+    free(tmp);
+    syn_snapshot_free(snap);
+}
+
+int syn_load_warm(syn_vm *vm, const char *path, const char *cache_dir)
+{
+    size_t size = strlen(cache_dir) + sizeof "/0123456789abcdef.warm";
+    enum io_kind sink = vm->sink;
+    enum syn_status status;
+    size_t start, len;
+    char *file;
+    int ret = 0;
+
+    if (syn_load(vm, path))
+        return -1;
+
+    if (!(file = malloc(size)))
+        return -1;
+    snprintf(file, size, "%s/%016" PRIx64 ".warm", cache_dir, image_hash(vm->memory));
+
+    if (!warm_read(vm, file)) {
+        free(file);
+        return 0;
+    }
+
+    /*
+     * Cold start: run to the first `in` with the output collected in memory,
+     * which then goes to the cache as well as to the actual sink
+     */
+    vm_flush(vm);
+    vm->sink = IO_MEMORY;
+    start = vm->output_len;
+    status = syn_run_until_input(vm, SYN_RUN_FOREVER);
+    vm->sink = sink;
+    len = vm->output_len - start;
+
+    if (status == SYN_INPUT && len <= UINT32_MAX) {
+        mkdir(cache_dir, 0777);
+        warm_write(vm, file, vm->output + start, len);
+    }
+
+    if (sink != IO_MEMORY) {
+        ret = vm_write(vm, vm->output + start, len);
+        vm->output_len = start;
+    }
+
+    free(file);
+    return ret;
+}